@@ -0,0 +1,132 @@
+#include "AssetLoader.h"
+
+#include "Profiler.h"
+
+#include <chrono>
+
+namespace {
+	template<typename T>
+	bool IsReady(const T& future)
+	{
+		return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}
+}
+
+AssetLoader::AssetLoader(unsigned nThreads)
+{
+	for (unsigned i = 0; i < std::max(nThreads, 1u); i++) {
+		workers.emplace_back(&AssetLoader::WorkerLoop, this);
+	}
+}
+
+AssetLoader::~AssetLoader()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+		// Their futures report broken promises if anyone still waits on them
+		tasks.clear();
+	}
+	wake.notify_all();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+template<typename F>
+auto AssetLoader::Enqueue(F&& load) -> std::future<decltype(load())>
+{
+	// std::function needs a copyable callable
+	auto task = std::make_shared<std::packaged_task<decltype(load())()>>(std::forward<F>(load));
+	auto result = task->get_future();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back([task]() { (*task)(); });
+	}
+	wake.notify_one();
+	return result;
+}
+
+void AssetLoader::WorkerLoop()
+{
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this]() { return stop || !tasks.empty(); });
+			if (stop) {
+				return;
+			}
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
+
+AssetLoader::TextureFuture AssetLoader::LoadTexture(const std::string& path)
+{
+	auto [it, inserted] = textures.try_emplace(path);
+	if (inserted) {
+		it->second = Enqueue([path]() {
+			PROFILE_SCOPE("Load texture");
+			auto texture = textureFromFile(path.c_str());
+			return texture ? std::make_shared<const Texture>(*texture) : placeholderTexture();
+		}).share();
+	}
+	return it->second;
+}
+
+std::future<Model> AssetLoader::LoadMesh(const std::string& meshPath, TextureFuture texture)
+{
+	// Parsed without waiting for the texture, the model gets it once both are done
+	return Enqueue([meshPath, texture]() {
+		PROFILE_SCOPE("Load mesh");
+		return Model(meshPath.c_str(), IsReady(texture) ? texture.get() : placeholderTexture());
+	});
+}
+
+void AssetLoader::AddModel(const std::string& meshPath, const std::string& texturePath, std::function<void(Model&)> setup)
+{
+	PendingModel model;
+	model.texture = LoadTexture(texturePath);
+	model.mesh = LoadMesh(meshPath, model.texture);
+	model.setup = std::move(setup);
+	pendingModels.push_back(std::move(model));
+}
+
+bool AssetLoader::Update(Scene& scene)
+{
+	bool changed = false;
+	for (auto it = pendingModels.begin(); it != pendingModels.end();) {
+		PendingModel& pending = *it;
+		if (pending.sceneIndex == SIZE_MAX && IsReady(pending.mesh)) {
+			scene.models.push_back(pending.mesh.get());
+			pending.sceneIndex = scene.models.size() - 1;
+			if (pending.setup) {
+				pending.setup(scene.models.back());
+			}
+			changed = true;
+		}
+		if (pending.sceneIndex != SIZE_MAX && IsReady(pending.texture)) {
+			Model& model = scene.models[pending.sceneIndex];
+			if (model.texture != pending.texture.get()) {
+				model.texture = pending.texture.get();
+				changed = true;
+			}
+			it = pendingModels.erase(it);
+			continue;
+		}
+		++it;
+	}
+	return changed;
+}
+
+void AssetLoader::Finish(Scene& scene)
+{
+	for (PendingModel& pending : pendingModels) {
+		pending.mesh.wait();
+		pending.texture.wait();
+	}
+	Update(scene);
+}
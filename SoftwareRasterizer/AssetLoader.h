@@ -0,0 +1,73 @@
+#ifndef ASSET_LOADER_H
+#define ASSET_LOADER_H
+
+#include "Model.h"
+#include "Scene.h"
+#include "Texture.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Loads meshes and textures on background threads, so that starting a scene takes as long as its slowest load
+// instead of the sum of all of them. Models are added to the scene as soon as their mesh is ready and drawn with
+// the placeholder texture until their own arrives, so the scene renders what is there while the rest loads.
+// Textures are cached by path, models that use the same one share it.
+class AssetLoader {
+public:
+	// nThreads decode in parallel
+	explicit AssetLoader(unsigned nThreads = std::max(std::thread::hardware_concurrency(), 1u));
+	// Waits for the loads that already started, the others are dropped
+	~AssetLoader();
+	AssetLoader(const AssetLoader&) = delete;
+	AssetLoader& operator=(const AssetLoader&) = delete;
+
+	using TextureFuture = std::shared_future<std::shared_ptr<const Texture>>;
+	// The placeholder if the texture fails to load
+	TextureFuture LoadTexture(const std::string& path);
+	std::future<Model> LoadMesh(const std::string& meshPath, TextureFuture texture);
+
+	// Queues a model for the scene passed to Update. setup is called on the model before it is added, to set its
+	// shading and transform.
+	void AddModel(const std::string& meshPath, const std::string& texturePath, std::function<void(Model&)> setup = nullptr);
+	// Once per frame, on the thread that renders the scene: adds the models whose meshes finished loading to the
+	// scene and hands the textures that finished loading to their models. Models are appended to scene.models,
+	// which must not be reordered while any are pending. Returns true if the scene changed.
+	bool Update(Scene& scene);
+	// Waits until every queued model is in the scene with its texture
+	void Finish(Scene& scene);
+	// Queued models that are not in the scene yet or still have the placeholder texture
+	std::size_t Pending() const { return pendingModels.size(); }
+private:
+	struct PendingModel {
+		std::future<Model> mesh;
+		TextureFuture texture;
+		std::function<void(Model&)> setup;
+		std::size_t sceneIndex = SIZE_MAX;	// Set once the model is in the scene
+	};
+
+	template<typename F>
+	auto Enqueue(F&& load) -> std::future<decltype(load())>;
+	void WorkerLoop();
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<std::function<void()>> tasks;
+	bool stop = false;
+
+	std::unordered_map<std::string, TextureFuture> textures;
+	std::vector<PendingModel> pendingModels;
+};
+
+#endif // !ASSET_LOADER_H
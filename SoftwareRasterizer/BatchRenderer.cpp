@@ -0,0 +1,139 @@
+#include "BatchRenderer.h"
+
+#include "Renderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+std::optional<std::vector<CameraKeyframe>> cameraTrackFromFile(const char* path)
+{
+	std::ifstream file(path);
+	if (!file) {
+		std::cerr << "Unable to open camera track " << path << ".\n";
+		return std::nullopt;
+	}
+	std::vector<CameraKeyframe> track;
+	std::string line;
+	for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+		const auto start = line.find_first_not_of(" \t\r");
+		if (start == std::string::npos || line[start] == '#') {
+			continue;
+		}
+		std::istringstream fields(line);
+		CameraKeyframe key;
+		if (!(fields >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch)) {
+			std::cerr << path << ':' << lineNumber << ": expected time x y z yaw pitch [zoom].\n";
+			return std::nullopt;
+		}
+		fields >> key.zoom;
+		if (!track.empty() && key.time < track.back().time) {
+			std::cerr << path << ':' << lineNumber << ": keyframes must be in time order.\n";
+			return std::nullopt;
+		}
+		track.push_back(key);
+	}
+	if (track.empty()) {
+		std::cerr << "Camera track " << path << " has no keyframes.\n";
+		return std::nullopt;
+	}
+	return track;
+}
+
+Camera CameraAt(const std::vector<CameraKeyframe>& track, float time)
+{
+	// First keyframe after time, the pose is between it and the one before
+	const auto next = std::upper_bound(track.begin(), track.end(), time, [](float t, const CameraKeyframe& key) { return t < key.time; });
+	const CameraKeyframe& a = next == track.begin() ? *next : *(next - 1);
+	const CameraKeyframe& b = next == track.end() ? *(next - 1) : *next;
+	const float t = b.time > a.time ? std::clamp((time - a.time) / (b.time - a.time), 0.0f, 1.0f) : 0.0f;
+
+	Camera camera(a.position + (b.position - a.position) * t, Vec3(0.0f, 1.0f, 0.0f), a.yaw + (b.yaw - a.yaw) * t, a.pitch + (b.pitch - a.pitch) * t);
+	camera.zoom = a.zoom + (b.zoom - a.zoom) * t;
+	return camera;
+}
+
+double RenderBatch(const Scene& scene, const std::vector<CameraKeyframe>& track, const BatchOptions& options,
+	const std::function<void(int frame, const Color* pixels, int width, int height)>& emit)
+{
+	const int frameCount = options.frameCount;
+	const unsigned nThreads = std::clamp(options.nThreads > 0 ? options.nThreads : std::max(std::thread::hardware_concurrency(), 1u), 1u, (unsigned)std::max(frameCount, 1));
+	const float startTime = track.front().time;
+	const float duration = track.back().time - startTime;
+	const int width = options.width;
+	const int height = options.height;
+
+	// Reorder buffer: frame i goes to slot i % slots.size(), which the frame slots.size() before it has left once
+	// it was emitted
+	struct Slot {
+		std::vector<Color> pixels;
+		bool ready = false;
+	};
+	std::vector<Slot> slots(2 * nThreads);
+	for (Slot& slot : slots) {
+		slot.pixels.resize((std::size_t)width * height);
+	}
+	std::mutex mutex;
+	std::condition_variable changed;
+	int nextFrame = 0;		// Next to be rendered
+	int nextEmitted = 0;	// Next to be emitted
+
+	const auto renderFrames = [&]() {
+		// Frames are the parallel work, one thread per renderer
+		Renderer renderer(options.width, options.height, 0);
+		renderer.SetFrontToBackSorting(true);
+		renderer.SetMultisampling(options.multisampling);
+		for (;;) {
+			int frame;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&]() { return nextFrame >= frameCount || nextFrame < nextEmitted + (int)slots.size(); });
+				if (nextFrame >= frameCount) {
+					return;
+				}
+				frame = nextFrame++;
+			}
+			const float time = frameCount > 1 ? startTime + duration * frame / (frameCount - 1) : startTime;
+			renderer.ClearBuffers();
+			renderer.Render(scene, CameraAt(track, time));
+			Slot& slot = slots[frame % slots.size()];
+			renderer.ResolveTo(slot.pixels.data(), width * (int)sizeof(Color));
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				slot.ready = true;
+			}
+			changed.notify_all();
+		}
+	};
+
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < nThreads; i++) {
+		threads.emplace_back(renderFrames);
+	}
+	for (int frame = 0; frame < frameCount; frame++) {
+		Slot& slot = slots[frame % slots.size()];
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [&]() { return slot.ready; });
+		}
+		emit(frame, slot.pixels.data(), width, height);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			slot.ready = false;
+			nextEmitted++;
+		}
+		changed.notify_all();
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return seconds > 0.0 ? frameCount / seconds : 0.0;
+}
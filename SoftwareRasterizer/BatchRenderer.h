@@ -0,0 +1,42 @@
+#ifndef BATCH_RENDERER_H
+#define BATCH_RENDERER_H
+
+#include "Camera.h"
+#include "Scene.h"
+
+#include <functional>
+#include <optional>
+#include <vector>
+
+// Camera pose at a point in time of a camera track
+struct CameraKeyframe {
+	float time;			// Seconds, increasing along the track
+	Vec3 position;
+	float yaw, pitch;	// Degrees, as in Camera
+	float zoom = ZOOM;
+};
+
+// Reads one keyframe per line: time x y z yaw pitch [zoom]. Empty lines and lines starting with # are skipped.
+std::optional<std::vector<CameraKeyframe>> cameraTrackFromFile(const char* path);
+// Interpolated linearly between the keyframes around time, clamped to the ends of the track
+Camera CameraAt(const std::vector<CameraKeyframe>& track, float time);
+
+struct BatchOptions {
+	int width = 1280;
+	int height = 720;
+	int frameCount = 120;		// Spread evenly over the track, first and last keyframe included
+	unsigned nThreads = 0;		// Frames rendered at once, 0 for one per hardware thread
+	bool multisampling = false;
+};
+
+// Offline rendering of a scene along a camera track with frame level parallelism: every thread renders whole frames
+// with a renderer of its own, so throughput scales with the core count even for scenes too small to keep a thread
+// pool busy within one frame. The renderers only read the scene, its models and textures are shared.
+//
+// Finished frames wait in a reorder buffer until all frames before them are done, and are handed to emit in order
+// on the calling thread, with the resolved image (width x height tightly packed pixels, valid during the call).
+// Threads stall instead of running more than two frames per thread ahead of emit. Returns frames per second.
+double RenderBatch(const Scene& scene, const std::vector<CameraKeyframe>& track, const BatchOptions& options,
+	const std::function<void(int frame, const Color* pixels, int width, int height)>& emit);
+
+#endif // !BATCH_RENDERER_H
@@ -18,6 +18,9 @@ const float PITCH = 0.0f;
 const float SPEED = 1.5f;
 const float SENSITIVITY = 0.1f;
 const float ZOOM = 45.0f;
+// Clip planes of the projection
+const float Z_NEAR = 0.1f;
+const float Z_FAR = 100.0f;
 
 // An abstract camera class that processes input and calculates the corresponding Euler Angles, Vectors and Matrices for use in OpenGL
 class Camera
@@ -52,12 +55,24 @@ public:
         updateCameraVectors();
     }
 
+    // whether both cameras see the scene the same way, for reusing a rendered frame
+    bool SameView(const Camera& other) const
+    {
+        return position == other.position && front == other.front && up == other.up && zoom == other.zoom;
+    }
+
     // returns the view matrix calculated using Euler Angles and the LookAt Matrix
     Mat4 GetViewMatrix() const
     {
         return LookAt(position, right, up, front);
     }
 
+    // returns the projection matrix the renderer draws with, for a render target of height / width inverseAspectRatio
+    Mat4 GetProjectionMatrix(float inverseAspectRatio) const
+    {
+        return Perspective(inverseAspectRatio, Radians(zoom * 2), Z_NEAR, Z_FAR);
+    }
+
     // processes input received from any keyboard-like input system. Accepts input parameter in the form of camera defined ENUM (to abstract it from windowing systems)
     void ProcessKeyboard(Camera_Movement direction, float deltaTime)
     {
@@ -1,54 +1,183 @@
 #include "Clipping.h"
 
-std::vector<ClipSpaceTriangle> ClipAndCull(const std::vector<Face>& faces, const std::vector<Vec4>& clipSpaceVertices)
-{
-	std::vector<ClipSpaceTriangle> trianglesClippedToNear;
+namespace {
+	struct ClipVertex {
+		Vec4 position;
+		Varyings varyings;
+	};
+
+	// Triangle clipped against at most 5 planes (near and 4 guard band planes), each of which can add a vertex
+	constexpr int maxClippedPolygonVertices = 3 + 5;
+
+	// One Sutherland-Hodgman step. Returns the number of vertices written to out.
+	int ClipPolygon(const ClipVertex* in, int count, ClipVertex* out, int plane, GuardBand guardBand)
+	{
+		int outCount = 0;
+		const ClipVertex* prev = &in[count - 1];
+		float prevDistance = ClipPlaneDistance(prev->position, plane, guardBand);
+		for (int i = 0; i < count; i++) {
+			const ClipVertex* curr = &in[i];
+			const float currDistance = ClipPlaneDistance(curr->position, plane, guardBand);
+			if ((prevDistance >= 0) != (currDistance >= 0)) {
+				const float alpha = prevDistance / (prevDistance - currDistance);
+				out[outCount++] = {
+					prev->position + (curr->position - prev->position) * alpha,
+					Lerp(prev->varyings, curr->varyings, alpha)
+				};
+			}
+			if (currDistance >= 0) {
+				out[outCount++] = *curr;
+			}
+			prev = curr;
+			prevDistance = currDistance;
+		}
+		return outCount;
+	}
+
+	// General (slow) path for triangles which cross the guard band. Also clips to the near plane
+	// since the guard band planes are only meaningful for w > 0.
+	void ClipToGuardBand(const Vec4& a, const Varyings& aVaryings, const Vec4& b, const Varyings& bVaryings, const Vec4& c, const Varyings& cVaryings,
+		ClipFlags planesToClip, GuardBand guardBand, std::vector<ClipSpaceTriangle>& out)
+	{
+		ClipVertex buffers[2][maxClippedPolygonVertices] = {
+			{ { a, aVaryings }, { b, bVaryings }, { c, cVaryings } }
+		};
+		int count = 3;
+		int current = 0;
 
-	for (const Face& face : faces) {
+		constexpr int planes[] = { NEAR_PLANE, GUARD_RIGHT_PLANE, GUARD_LEFT_PLANE, GUARD_TOP_PLANE, GUARD_BOTTOM_PLANE };
+		for (int plane : planes) {
+			if (planesToClip & (1 << plane)) {
+				count = ClipPolygon(buffers[current], count, buffers[1 - current], plane, guardBand);
+				current = 1 - current;
+				if (count < 3) {
+					return;
+				}
+			}
+		}
+
+		// Convex polygon, triangulate as a fan
+		const ClipVertex* polygon = buffers[current];
+		for (int i = 1; i < count - 1; i++) {
+			out.push_back({
+				polygon[0].position, polygon[i].position, polygon[i + 1].position,
+				polygon[0].varyings, polygon[i].varyings, polygon[i + 1].varyings
+			});
+		}
+	}
+
+	void ClipAndCullFace(const Face& face, const std::vector<Vec4>& clipSpaceVertices, const std::vector<Varyings>& vertexVaryings,
+		ClipFlags aClipFlags, ClipFlags bClipFlags, ClipFlags cClipFlags, GuardBand guardBand, std::vector<ClipSpaceTriangle>& out,
+		PipelineStats& stats)
+	{
 		const Vec4& a = clipSpaceVertices[face.a];
 		const Vec4& b = clipSpaceVertices[face.b];
 		const Vec4& c = clipSpaceVertices[face.c];
+		const Varyings& aVaryings = vertexVaryings[face.a];
+		const Varyings& bVaryings = vertexVaryings[face.b];
+		const Varyings& cVaryings = vertexVaryings[face.c];
 
-		auto aClipData = VertClipData(a);
-		auto bClipData = VertClipData(b);
-		auto cClipData = VertClipData(c);
+		if (ShouldCull(aClipFlags, bClipFlags, cClipFlags)) {
+			stats.frustumCulled++;
+			return;
+		}
 
-		if (ShouldCull(aClipData, bClipData, cClipData)) {
-			continue;
+		const ClipFlags anyClipFlags = aClipFlags | bClipFlags | cClipFlags;
+		if (anyClipFlags & guardBandClipFlags) {
+			stats.guardBandClipped++;
+			ClipToGuardBand(a, aVaryings, b, bVaryings, c, cVaryings, anyClipFlags & mustClipFlags, guardBand, out);
+			return;
 		}
 
-		if (aClipData.outside[NEAR_PLANE]) {
-			if (bClipData.outside[NEAR_PLANE]) {
-				trianglesClippedToNear.push_back(Clip2Vertices(a, face.aUV, b, face.bUV, c, face.cUV));
+		const bool aOutsideNear = aClipFlags & nearClipFlag;
+		const bool bOutsideNear = bClipFlags & nearClipFlag;
+		const bool cOutsideNear = cClipFlags & nearClipFlag;
+		const int nOutsideNear = aOutsideNear + bOutsideNear + cOutsideNear;
+		stats.nearClipped1To2 += nOutsideNear == 1;
+		stats.nearClipped1To1 += nOutsideNear == 2;
+
+		if (aOutsideNear) {
+			if (bOutsideNear) {
+				out.push_back(Clip2Vertices(a, aVaryings, b, bVaryings, c, cVaryings));
 			}
-			else if (cClipData.outside[NEAR_PLANE]) {
-				trianglesClippedToNear.push_back(Clip2Vertices(c, face.cUV, a, face.aUV,  b, face.bUV));
+			else if (cOutsideNear) {
+				out.push_back(Clip2Vertices(c, cVaryings, a, aVaryings, b, bVaryings));
 			}
 			else {
-				auto triangles = Clip1Vertex(a, face.aUV, b, face.bUV, c, face.cUV);
-				trianglesClippedToNear.push_back(triangles.first);
-				trianglesClippedToNear.push_back(triangles.second);
+				auto triangles = Clip1Vertex(a, aVaryings, b, bVaryings, c, cVaryings);
+				out.push_back(triangles.first);
+				out.push_back(triangles.second);
 			}
 		}
-		else if (bClipData.outside[NEAR_PLANE]) {
-			if (cClipData.outside[NEAR_PLANE]) {
-				trianglesClippedToNear.push_back(Clip2Vertices(b, face.bUV, c, face.cUV, a, face.aUV));
+		else if (bOutsideNear) {
+			if (cOutsideNear) {
+				out.push_back(Clip2Vertices(b, bVaryings, c, cVaryings, a, aVaryings));
 			}
 			else {
-				auto triangles = Clip1Vertex(b, face.bUV, c, face.cUV, a, face.aUV);
-				trianglesClippedToNear.push_back(triangles.first);
-				trianglesClippedToNear.push_back(triangles.second);
+				auto triangles = Clip1Vertex(b, bVaryings, c, cVaryings, a, aVaryings);
+				out.push_back(triangles.first);
+				out.push_back(triangles.second);
 			}
 		}
-		else if (cClipData.outside[NEAR_PLANE]) {
-			auto triangles = Clip1Vertex(c, face.cUV, a, face.aUV, b, face.bUV);
-			trianglesClippedToNear.push_back(triangles.first);
-			trianglesClippedToNear.push_back(triangles.second);
+		else if (cOutsideNear) {
+			auto triangles = Clip1Vertex(c, cVaryings, a, aVaryings, b, bVaryings);
+			out.push_back(triangles.first);
+			out.push_back(triangles.second);
 		}
 		else {
-			trianglesClippedToNear.push_back({ a, b, c, face.aUV, face.bUV, face.cUV });
+			out.push_back({ a, b, c, aVaryings, bVaryings, cVaryings });
+		}
+	}
+}
+
+std::vector<ClipSpaceTriangle> ClipAndCull(const std::vector<Face>& faces, const std::vector<Vec4>& clipSpaceVertices,
+	const std::vector<Varyings>& vertexVaryings, GuardBand guardBand, PipelineStats& stats)
+{
+	std::vector<ClipSpaceTriangle> clippedTriangles;
+	clippedTriangles.reserve(faces.size());
+
+	constexpr std::size_t batchSize = 4;
+	const std::size_t nFaces = faces.size();
+	std::size_t i = 0;
+
+	for (; i + batchSize <= nFaces; i += batchSize) {
+		ClipFlags clipFlags[batchSize][3];
+		ClipFlags anyClipFlags = 0;
+		for (std::size_t j = 0; j < batchSize; j++) {
+			const Face& face = faces[i + j];
+			clipFlags[j][0] = ComputeClipFlags(clipSpaceVertices[face.a], guardBand);
+			clipFlags[j][1] = ComputeClipFlags(clipSpaceVertices[face.b], guardBand);
+			clipFlags[j][2] = ComputeClipFlags(clipSpaceVertices[face.c], guardBand);
+			anyClipFlags |= clipFlags[j][0] | clipFlags[j][1] | clipFlags[j][2];
 		}
+
+		// Fast path: the whole batch lies within the frustum, no culling or clipping decisions to make
+		if (anyClipFlags == 0) {
+			const std::size_t first = clippedTriangles.size();
+			clippedTriangles.resize(first + batchSize);
+			for (std::size_t j = 0; j < batchSize; j++) {
+				const Face& face = faces[i + j];
+				clippedTriangles[first + j] = {
+					clipSpaceVertices[face.a], clipSpaceVertices[face.b], clipSpaceVertices[face.c],
+					vertexVaryings[face.a], vertexVaryings[face.b], vertexVaryings[face.c]
+				};
+			}
+			continue;
+		}
+
+		for (std::size_t j = 0; j < batchSize; j++) {
+			ClipAndCullFace(faces[i + j], clipSpaceVertices, vertexVaryings, clipFlags[j][0], clipFlags[j][1], clipFlags[j][2], guardBand, clippedTriangles, stats);
+		}
+	}
+
+	for (; i < nFaces; i++) {
+		const Face& face = faces[i];
+		ClipAndCullFace(face, clipSpaceVertices, vertexVaryings,
+			ComputeClipFlags(clipSpaceVertices[face.a], guardBand),
+			ComputeClipFlags(clipSpaceVertices[face.b], guardBand),
+			ComputeClipFlags(clipSpaceVertices[face.c], guardBand),
+			guardBand, clippedTriangles, stats);
 	}
 
-	return trianglesClippedToNear;
+	return clippedTriangles;
 }
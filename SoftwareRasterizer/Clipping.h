@@ -1,11 +1,13 @@
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include <algorithm>
 #include <array>
-#include <bitset>
 #include <cstdint>
 #include <vector>
 #include <utility>
+#include "Matrix.h"
+#include "PipelineStats.h"
 #include "Triangle.h"
 #include "Vector.h"
 
@@ -14,60 +16,129 @@ struct Plane {
 	Vec3 n;
 };
 
-using ClipFlags = std::uint8_t;
+using ClipFlags = std::uint16_t;
 
 enum FrustumPlaneIndices {
-	RIGHT_PLANE, LEFT_PLANE, TOP_PLANE, BOTTOM_PLANE, NEAR_PLANE, FAR_PLANE
+	RIGHT_PLANE, LEFT_PLANE, TOP_PLANE, BOTTOM_PLANE, NEAR_PLANE, FAR_PLANE,
+	// Guard band planes lie outside the frustum. Only triangles that cross them need to be clipped against the
+	// side planes, everything else can be left to the clamping of the screen space bounding box when rasterizing.
+	GUARD_RIGHT_PLANE, GUARD_LEFT_PLANE, GUARD_TOP_PLANE, GUARD_BOTTOM_PLANE
 };
 
-struct VertClipData {
-	std::bitset<6> outside;
-	VertClipData(const Vec4& v) {
-		outside[RIGHT_PLANE] = v.x > v.w;
-		outside[LEFT_PLANE] = v.x < -v.w;
-		outside[TOP_PLANE] = v.y > v.w;
-		outside[BOTTOM_PLANE] = v.y < -v.w;
-		outside[NEAR_PLANE] = v.z < 0;
-		outside[FAR_PLANE] = v.z > v.w;
-	}
+constexpr ClipFlags frustumClipFlags = 0x3F;
+constexpr ClipFlags nearClipFlag = 1 << NEAR_PLANE;
+constexpr ClipFlags guardBandClipFlags = 0xF << GUARD_RIGHT_PLANE;
+// Triangles whose vertices have none of these flags set can be rasterized without clipping
+constexpr ClipFlags mustClipFlags = nearClipFlag | guardBandClipFlags;
+
+// Screen space coordinates are kept within this many pixels of the screen center so that
+// edge function setup stays precise. Larger screens get a guard band that at least covers the screen.
+constexpr float guardBandExtent = 4096.0f;
+
+// Guard band half extents in clip space, i.e. a vertex is inside if |x| <= x * w and |y| <= y * w.
+struct GuardBand {
+	float x, y;
+	GuardBand(float screenHalfWidth, float screenHalfHeight)
+		: x(std::max(1.0f, guardBandExtent / screenHalfWidth)), y(std::max(1.0f, guardBandExtent / screenHalfHeight)) {}
 };
 
-std::vector<ClipSpaceTriangle> ClipAndCull(const std::vector<Face>& faces, const std::vector<Vec4>& clipSpaceVertices);
+// Branch free outcode computation
+inline ClipFlags ComputeClipFlags(const Vec4& v, GuardBand guardBand) {
+	const float gx = guardBand.x * v.w;
+	const float gy = guardBand.y * v.w;
+	return (ClipFlags)(
+		((v.x > v.w) << RIGHT_PLANE) |
+		((v.x < -v.w) << LEFT_PLANE) |
+		((v.y > v.w) << TOP_PLANE) |
+		((v.y < -v.w) << BOTTOM_PLANE) |
+		((v.z < 0) << NEAR_PLANE) |
+		((v.z > v.w) << FAR_PLANE) |
+		((v.x > gx) << GUARD_RIGHT_PLANE) |
+		((v.x < -gx) << GUARD_LEFT_PLANE) |
+		((v.y > gy) << GUARD_TOP_PLANE) |
+		((v.y < -gy) << GUARD_BOTTOM_PLANE));
+}
+
+// Signed distance (scaled by w) to one of the clip planes, >= 0 means inside
+inline float ClipPlaneDistance(const Vec4& v, int plane, GuardBand guardBand) {
+	switch (plane) {
+	case RIGHT_PLANE: return v.w - v.x;
+	case LEFT_PLANE: return v.w + v.x;
+	case TOP_PLANE: return v.w - v.y;
+	case BOTTOM_PLANE: return v.w + v.y;
+	case NEAR_PLANE: return v.z;
+	case FAR_PLANE: return v.w - v.z;
+	case GUARD_RIGHT_PLANE: return guardBand.x * v.w - v.x;
+	case GUARD_LEFT_PLANE: return guardBand.x * v.w + v.x;
+	case GUARD_TOP_PLANE: return guardBand.y * v.w - v.y;
+	default: return guardBand.y * v.w + v.y;
+	}
+}
+
+// Frustum planes in the space of whatever vertices the matrix transforms to clip space. Normals point inwards.
+// Source: Gribb & Hartmann, "Fast Extraction of Viewing Frustum Planes from the World-View-Projection Matrix"
+inline std::array<Plane, 6> ExtractFrustumPlanes(const Mat4& m) {
+	auto makePlane = [&m](int row, float sign, bool combineWithW) {
+		float a = sign * m[row][0], b = sign * m[row][1], c = sign * m[row][2], d = sign * m[row][3];
+		if (combineWithW) {
+			a += m[3][0]; b += m[3][1]; c += m[3][2]; d += m[3][3];
+		}
+		const float invLength = 1.0f / std::sqrt(a * a + b * b + c * c);
+		Vec3 n = { a * invLength, b * invLength, c * invLength };
+		return Plane{ n * (-d * invLength), n };
+	};
+
+	std::array<Plane, 6> planes;
+	planes[RIGHT_PLANE] = makePlane(0, -1.0f, true);	// x <= w
+	planes[LEFT_PLANE] = makePlane(0, 1.0f, true);		// x >= -w
+	planes[TOP_PLANE] = makePlane(1, -1.0f, true);		// y <= w
+	planes[BOTTOM_PLANE] = makePlane(1, 1.0f, true);	// y >= -w
+	planes[NEAR_PLANE] = makePlane(2, 1.0f, false);		// z >= 0
+	planes[FAR_PLANE] = makePlane(2, -1.0f, true);		// z <= w
+	return planes;
+}
+
+inline bool IsSphereOutsideFrustum(const std::array<Plane, 6>& planes, const Vec3& center, float radius) {
+	for (const Plane& plane : planes) {
+		if (Dot(plane.n, center - plane.p) < -radius) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<ClipSpaceTriangle> ClipAndCull(const std::vector<Face>& faces, const std::vector<Vec4>& clipSpaceVertices,
+	const std::vector<Varyings>& vertexVaryings, GuardBand guardBand, PipelineStats& stats);
 
-inline bool ShouldCull(VertClipData a, VertClipData b, VertClipData c) {
-	return
-		(a.outside[RIGHT_PLANE] && b.outside[RIGHT_PLANE] && c.outside[RIGHT_PLANE]) ||     
-		(a.outside[LEFT_PLANE] && b.outside[LEFT_PLANE] && c.outside[LEFT_PLANE]) || 
-		(a.outside[TOP_PLANE] && b.outside[TOP_PLANE] && c.outside[TOP_PLANE]) ||	 
-		(a.outside[BOTTOM_PLANE] && b.outside[BOTTOM_PLANE] && c.outside[BOTTOM_PLANE]) || 
-		(a.outside[NEAR_PLANE] && b.outside[NEAR_PLANE] && c.outside[NEAR_PLANE]) ||
-		(a.outside[FAR_PLANE] && b.outside[FAR_PLANE] && c.outside[FAR_PLANE]);
+// Cull if all three vertices are outside of the same frustum plane
+inline bool ShouldCull(ClipFlags a, ClipFlags b, ClipFlags c) {
+	return (a & b & c & frustumClipFlags) != 0;
 }
 
 // Only a needs to be clipped to near plane.
-inline std::pair<ClipSpaceTriangle, ClipSpaceTriangle> Clip1Vertex(const Vec4& a, Vec2 aUV, const Vec4& b, Vec2 bUV, const Vec4& c, Vec2 cUV) {
+inline std::pair<ClipSpaceTriangle, ClipSpaceTriangle> Clip1Vertex(const Vec4& a, const Varyings& aVaryings, const Vec4& b, const Varyings& bVaryings, const Vec4& c, const Varyings& cVaryings) {
 	const float abAlpha = -a.z / (b.z - a.z);
 	const float acAlpha = -a.z / (c.z - a.z);
 	Vec4 abBegin = a + (b - a) * abAlpha;
 	Vec4 acBegin = a + (c - a) * acAlpha;
-	Vec2 abBeginUV = aUV + (bUV - aUV) * abAlpha;
-	Vec2 acBeginUV = aUV + (cUV - aUV) * acAlpha;
+	Varyings abBeginVaryings = Lerp(aVaryings, bVaryings, abAlpha);
+	Varyings acBeginVaryings = Lerp(aVaryings, cVaryings, acAlpha);
 	return {
-		{abBegin, b, c, abBeginUV, bUV, cUV},
-		{abBegin, c, acBegin, abBeginUV, cUV, acBeginUV},
+		{abBegin, b, c, abBeginVaryings, bVaryings, cVaryings},
+		{abBegin, c, acBegin, abBeginVaryings, cVaryings, acBeginVaryings},
 	};
 }
 
 // a and b need to be clipped to near plane
-inline ClipSpaceTriangle Clip2Vertices(const Vec4& a, Vec2 aUV, const Vec4& b, Vec2 bUV, const Vec4& c, Vec2 cUV) {
+inline ClipSpaceTriangle Clip2Vertices(const Vec4& a, const Varyings& aVaryings, const Vec4& b, const Varyings& bVaryings, const Vec4& c, const Varyings& cVaryings) {
 	const float acAlpha = -a.z / (c.z - a.z);
 	const float bcAlpha = -b.z / (c.z - b.z);
 	Vec4 acBegin = a + (c - a) * acAlpha; // Replaces a
 	Vec4 bcBegin = b + (c - b) * bcAlpha; // Replaces b
-	Vec2 acBeginUV = aUV + (cUV - aUV) * acAlpha;
-	Vec2 bcBeginUV = bUV + (cUV - bUV) * bcAlpha;
+	Varyings acBeginVaryings = Lerp(aVaryings, cVaryings, acAlpha);
+	Varyings bcBeginVaryings = Lerp(bVaryings, cVaryings, bcAlpha);
 	return {
-		acBegin, bcBegin, c, acBeginUV, bcBeginUV, cUV
+		acBegin, bcBegin, c, acBeginVaryings, bcBeginVaryings, cVaryings
 	};
 }
 
@@ -0,0 +1,59 @@
+#include "DynamicResolution.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	// Aim below the budget so that frame to frame noise doesn't push frames over it
+	constexpr float headroom = 0.9f;
+	// Smoothing factors for frame times above and below the smoothed value
+	constexpr float riseRate = 0.5f;
+	constexpr float fallRate = 0.1f;
+	// Relative scale changes smaller than this are ignored, so the size doesn't jitter around the target
+	constexpr float hysteresis = 0.03f;
+	// Scale changes per update are limited, growing slower than shrinking
+	constexpr float maxShrink = 0.75f;
+	constexpr float maxGrowth = 1.1f;
+	// Frames to wait after a change, the first frames at a new size are often slower (caches, allocation)
+	constexpr int settleFrames = 3;
+}
+
+DynamicResolution::DynamicResolution(int outputWidth, int outputHeight, float targetFrameMs, float minScale)
+	: outputWidth(outputWidth), outputHeight(outputHeight), targetFrameMs(targetFrameMs), minScale(minScale),
+		renderWidth(outputWidth), renderHeight(outputHeight)
+{
+}
+
+bool DynamicResolution::Update(float frameMs)
+{
+	if (smoothedFrameMs == 0.0f) {
+		smoothedFrameMs = frameMs;
+	}
+	else {
+		const float rate = frameMs > smoothedFrameMs ? riseRate : fallRate;
+		smoothedFrameMs += (frameMs - smoothedFrameMs) * rate;
+	}
+
+	if (++framesSinceChange <= settleFrames || smoothedFrameMs <= 0.0f) {
+		return false;
+	}
+
+	const float correction = std::clamp(std::sqrt(targetFrameMs * headroom / smoothedFrameMs), maxShrink, maxGrowth);
+	const float newScale = std::clamp(scale * correction, minScale, 1.0f);
+	if (std::fabs(newScale - scale) < hysteresis * scale) {
+		return false;
+	}
+
+	const int newWidth = std::max(1, (int)(outputWidth * newScale));
+	const int newHeight = std::max(1, (int)(outputHeight * newScale));
+	// Predict the frame time at the new size instead of waiting for the average to catch up
+	smoothedFrameMs *= (newScale * newScale) / (scale * scale);
+	scale = newScale;
+	framesSinceChange = 0;
+	if (newWidth == renderWidth && newHeight == renderHeight) {
+		return false;
+	}
+	renderWidth = newWidth;
+	renderHeight = newHeight;
+	return true;
+}
@@ -0,0 +1,31 @@
+#ifndef DYNAMIC_RESOLUTION_H
+#define DYNAMIC_RESOLUTION_H
+
+// Picks the render resolution from measured frame times so that frames fit a time budget. Rendering cost is
+// roughly proportional to the pixel count, i.e. to the square of the scale, so the scale is corrected by the
+// square root of budget / frame time. Frame times are smoothed, rising ones faster than falling ones so that
+// load spikes are reacted to quickly while the resolution only creeps back up.
+class DynamicResolution {
+public:
+	// Output size is the largest render size, targetFrameMs the budget for the work of one frame
+	DynamicResolution(int outputWidth, int outputHeight, float targetFrameMs, float minScale = 0.25f);
+
+	// Feeds the time the last frame's work took (not counting any wait for the frame rate cap).
+	// Returns true if the render size changed.
+	bool Update(float frameMs);
+
+	int RenderWidth() const { return renderWidth; }
+	int RenderHeight() const { return renderHeight; }
+	float Scale() const { return scale; }
+private:
+	int outputWidth, outputHeight;
+	float targetFrameMs;
+	float minScale;
+
+	float scale = 1.0f;
+	float smoothedFrameMs = 0.0f;
+	int framesSinceChange = 0;
+	int renderWidth, renderHeight;
+};
+
+#endif // !DYNAMIC_RESOLUTION_H
@@ -0,0 +1,306 @@
+#include "FrameCapture.h"
+
+#include "Profiler.h"
+#include "Renderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace {
+	// Full range BT.601 in 8.8 fixed point, as JPEG uses it (C420jpeg)
+	inline std::uint8_t Luma(int r, int g, int b)
+	{
+		return (std::uint8_t)((77 * r + 150 * g + 29 * b + 128) >> 8);
+	}
+
+	// Offset by 128.5 so that the sums stay positive before the shift
+	inline std::uint8_t ChromaB(int r, int g, int b)
+	{
+		return (std::uint8_t)std::min((-43 * r - 85 * g + 128 * b + 32896) >> 8, 255);
+	}
+
+	inline std::uint8_t ChromaR(int r, int g, int b)
+	{
+		return (std::uint8_t)std::min((128 * r - 107 * g - 21 * b + 32896) >> 8, 255);
+	}
+
+	// FRAME header, the luma plane, then both chroma planes at half resolution. Chroma is taken from the average
+	// of each 2x2 block, blocks at odd edges repeat their last row or column.
+	std::size_t EncodeY4mFrame(const Color* pixels, int width, int height, std::vector<std::uint8_t>& out)
+	{
+		constexpr char frameHeader[] = "FRAME\n";
+		constexpr std::size_t headerSize = sizeof(frameHeader) - 1;
+		const int chromaWidth = (width + 1) / 2;
+		const int chromaHeight = (height + 1) / 2;
+		const std::size_t size = headerSize + (std::size_t)width * height + 2 * (std::size_t)chromaWidth * chromaHeight;
+		if (out.size() < size) {
+			out.resize(size);
+		}
+		std::memcpy(out.data(), frameHeader, headerSize);
+		std::uint8_t* luma = out.data() + headerSize;
+		std::uint8_t* chromaB = luma + (std::size_t)width * height;
+		std::uint8_t* chromaR = chromaB + (std::size_t)chromaWidth * chromaHeight;
+
+		for (int cy = 0; cy < chromaHeight; cy++) {
+			const int y0 = 2 * cy;
+			const int y1 = std::min(y0 + 1, height - 1);
+			const Color* row0 = pixels + (std::size_t)y0 * width;
+			const Color* row1 = pixels + (std::size_t)y1 * width;
+			for (int cx = 0; cx < chromaWidth; cx++) {
+				const int x0 = 2 * cx;
+				const int x1 = std::min(x0 + 1, width - 1);
+				const Color block[4] = { row0[x0], row0[x1], row1[x0], row1[x1] };
+				int r = 0, g = 0, b = 0;
+				for (const Color c : block) {
+					r += (c >> 16) & 0xFF;
+					g += (c >> 8) & 0xFF;
+					b += c & 0xFF;
+				}
+				chromaB[cy * chromaWidth + cx] = ChromaB((r + 2) >> 2, (g + 2) >> 2, (b + 2) >> 2);
+				chromaR[cy * chromaWidth + cx] = ChromaR((r + 2) >> 2, (g + 2) >> 2, (b + 2) >> 2);
+			}
+		}
+		for (std::size_t i = 0; i < (std::size_t)width * height; i++) {
+			const Color c = pixels[i];
+			luma[i] = Luma((c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF);
+		}
+		return size;
+	}
+
+	// The Quite OK Image format (qoiformat.org), RGB channels only: the renderer's alpha is always opaque
+	std::size_t EncodeQoi(const Color* pixels, int width, int height, std::vector<std::uint8_t>& out)
+	{
+		constexpr std::size_t headerSize = 14;
+		constexpr std::uint8_t endMarker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+		const std::size_t nPixels = (std::size_t)width * height;
+		// Worst case is a QOI_OP_RGB for every pixel
+		const std::size_t maxSize = headerSize + nPixels * 4 + sizeof(endMarker);
+		if (out.size() < maxSize) {
+			out.resize(maxSize);
+		}
+		std::uint8_t* p = out.data();
+		const auto put32 = [&p](std::uint32_t value) {
+			*p++ = (std::uint8_t)(value >> 24);
+			*p++ = (std::uint8_t)(value >> 16);
+			*p++ = (std::uint8_t)(value >> 8);
+			*p++ = (std::uint8_t)value;
+		};
+		*p++ = 'q'; *p++ = 'o'; *p++ = 'i'; *p++ = 'f';
+		put32((std::uint32_t)width);
+		put32((std::uint32_t)height);
+		*p++ = 3;	// RGB
+		*p++ = 0;	// sRGB
+
+		Color index[64] = {};
+		Color previous = Colors::black;
+		int run = 0;
+		for (std::size_t i = 0; i < nPixels; i++) {
+			const Color c = pixels[i] | 0xFF000000;
+			if (c == previous) {
+				if (++run == 62) {
+					*p++ = (std::uint8_t)(0xC0 | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				*p++ = (std::uint8_t)(0xC0 | (run - 1));
+				run = 0;
+			}
+			const int r = (c >> 16) & 0xFF;
+			const int g = (c >> 8) & 0xFF;
+			const int b = c & 0xFF;
+			const int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+			if (index[hash] == c) {
+				*p++ = (std::uint8_t)hash;
+			}
+			else {
+				index[hash] = c;
+				// Differences wrap around like the channels
+				const int dr = (std::int8_t)(r - (int)((previous >> 16) & 0xFF));
+				const int dg = (std::int8_t)(g - (int)((previous >> 8) & 0xFF));
+				const int db = (std::int8_t)(b - (int)(previous & 0xFF));
+				const int drdg = dr - dg;
+				const int dbdg = db - dg;
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+					*p++ = (std::uint8_t)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+				}
+				else if (dg >= -32 && dg <= 31 && drdg >= -8 && drdg <= 7 && dbdg >= -8 && dbdg <= 7) {
+					*p++ = (std::uint8_t)(0x80 | (dg + 32));
+					*p++ = (std::uint8_t)((drdg + 8) << 4 | (dbdg + 8));
+				}
+				else {
+					*p++ = 0xFE;
+					*p++ = (std::uint8_t)r;
+					*p++ = (std::uint8_t)g;
+					*p++ = (std::uint8_t)b;
+				}
+			}
+			previous = c;
+		}
+		if (run > 0) {
+			*p++ = (std::uint8_t)(0xC0 | (run - 1));
+		}
+		std::memcpy(p, endMarker, sizeof(endMarker));
+		p += sizeof(endMarker);
+		return (std::size_t)(p - out.data());
+	}
+}
+
+FrameCapture::FrameCapture(const CaptureOptions& options)
+	: options(options)
+{
+	if (options.format == CaptureFormat::QOI) {
+		std::error_code error;
+		std::filesystem::create_directories(options.path, error);
+		open = std::filesystem::is_directory(options.path, error);
+		if (!open) {
+			std::cerr << "Unable to create capture directory " << options.path << ".\n";
+		}
+	}
+	else if (std::strcmp(options.path, "-") == 0) {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		stream = stdout;
+		open = WriteStreamHeader();
+	}
+	else {
+		stream = std::fopen(options.path, "wb");
+		open = stream != nullptr && WriteStreamHeader();
+		if (stream == nullptr) {
+			std::cerr << "Unable to open capture file " << options.path << ".\n";
+		}
+	}
+
+	// All allocations happen here
+	buffers.resize(std::max(options.nBuffers, 1u));
+	for (auto& buffer : buffers) {
+		buffer.resize((std::size_t)options.width * options.height);
+		freeBuffers.push_back(buffer.data());
+	}
+	const unsigned nEncoders = options.format == CaptureFormat::QOI ? std::max(options.nEncoderThreads, 1u) : 1;
+	for (unsigned i = 0; i < nEncoders; i++) {
+		encoders.emplace_back(&FrameCapture::EncoderLoop, this);
+	}
+}
+
+FrameCapture::~FrameCapture()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	frameQueued.notify_all();
+	for (auto& encoder : encoders) {
+		encoder.join();
+	}
+	if (stream == stdout) {
+		std::fflush(stream);
+	}
+	else if (stream) {
+		std::fclose(stream);
+	}
+}
+
+Color* FrameCapture::AcquireFrame()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (freeBuffers.empty()) {
+		PROFILE_SCOPE("Capture stall");
+		const auto start = std::chrono::steady_clock::now();
+		bufferFreed.wait(lock, [this]() { return !freeBuffers.empty(); });
+		stallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	Color* frame = freeBuffers.back();
+	freeBuffers.pop_back();
+	return frame;
+}
+
+void FrameCapture::SubmitFrame(Color* frame)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back({ frame, nSubmitted++ });
+	}
+	frameQueued.notify_one();
+}
+
+void FrameCapture::Capture(Renderer& renderer)
+{
+	Color* frame = AcquireFrame();
+	renderer.PresentTo(frame, Pitch(), options.width, options.height);
+	SubmitFrame(frame);
+}
+
+void FrameCapture::EncoderLoop()
+{
+	EncoderScratch scratch;
+	for (;;) {
+		QueuedFrame frame;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			frameQueued.wait(lock, [this]() { return stop || !queue.empty(); });
+			// Queued frames are still encoded when stopping
+			if (queue.empty()) {
+				return;
+			}
+			frame = queue.front();
+			queue.pop_front();
+		}
+		if (open && Encode(frame, scratch)) {
+			nWritten++;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			freeBuffers.push_back(frame.pixels);
+		}
+		bufferFreed.notify_one();
+	}
+}
+
+bool FrameCapture::Encode(const QueuedFrame& frame, EncoderScratch& scratch)
+{
+	PROFILE_SCOPE("Encode frame");
+	switch (options.format) {
+	case CaptureFormat::Raw: {
+		const std::size_t nPixels = (std::size_t)options.width * options.height;
+		return std::fwrite(frame.pixels, sizeof(Color), nPixels, stream) == nPixels;
+	}
+	case CaptureFormat::Y4M: {
+		const std::size_t size = EncodeY4mFrame(frame.pixels, options.width, options.height, scratch.bytes);
+		return std::fwrite(scratch.bytes.data(), 1, size, stream) == size;
+	}
+	case CaptureFormat::QOI: {
+		const std::size_t size = EncodeQoi(frame.pixels, options.width, options.height, scratch.bytes);
+		char name[32];
+		std::snprintf(name, sizeof(name), "frame_%05llu.qoi", (unsigned long long)frame.index);
+		const std::string path = (std::filesystem::path(options.path) / name).string();
+		std::FILE* file = std::fopen(path.c_str(), "wb");
+		if (file == nullptr) {
+			std::cerr << "Unable to write " << path << ".\n";
+			return false;
+		}
+		const bool written = std::fwrite(scratch.bytes.data(), 1, size, file) == size;
+		return std::fclose(file) == 0 && written;
+	}
+	}
+	return false;
+}
+
+bool FrameCapture::WriteStreamHeader()
+{
+	if (options.format != CaptureFormat::Y4M) {
+		return true;
+	}
+	return std::fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", options.width, options.height, options.framesPerSecond) > 0;
+}
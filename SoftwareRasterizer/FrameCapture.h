@@ -0,0 +1,96 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include "Utilities.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Renderer;
+
+enum class CaptureFormat {
+	Raw,	// Frames back to back in one file, 32 bit ARGB pixels (B, G, R, A in memory), rows top to bottom
+	Y4M,	// YUV4MPEG2 stream with 4:2:0 full range BT.601 chroma, for piping into an external encoder
+	QOI		// One frame_00000.qoi image per frame in a directory
+};
+
+struct CaptureOptions {
+	CaptureFormat format = CaptureFormat::Y4M;
+	const char* path = "-";		// File for Raw and Y4M, - for stdout. Directory for QOI.
+	int width = 1280;
+	int height = 720;
+	int framesPerSecond = 30;	// Written to the Y4M header
+	unsigned nBuffers = 4;		// Frames that can be queued before AcquireFrame waits for the encoders
+	unsigned nEncoderThreads = 2;	// QOI only, streams are written by one thread to keep the frame order
+};
+
+// Gets finished frames out of the render loop without stalling it on encoding. Frames are written into buffers
+// from a fixed pool, queued, and encoded on background threads which then return the buffers to the pool, so
+// there are no allocations per frame. Frames are resolved straight into the pool's buffers and the encoders read
+// them in place: raw frames are written from there as they are, Y4M and QOI are converted once into an output
+// buffer each encoder thread reuses. When all buffers are queued, AcquireFrame blocks until one is free, which
+// holds the render loop to the speed of the encoders instead of queueing frames without bound.
+class FrameCapture {
+public:
+	explicit FrameCapture(const CaptureOptions& options);
+	// Encodes the frames still queued, then closes the output
+	~FrameCapture();
+	FrameCapture(const FrameCapture&) = delete;
+	FrameCapture& operator=(const FrameCapture&) = delete;
+
+	// False if the output couldn't be opened, frames are then dropped
+	bool IsOpen() const { return open; }
+	int Width() const { return options.width; }
+	int Height() const { return options.height; }
+	int Pitch() const { return options.width * (int)sizeof(Color); }
+
+	// A free buffer of Width() x Height() pixels with Pitch(), to be passed to SubmitFrame once it holds a frame
+	Color* AcquireFrame();
+	// Queues a buffer from AcquireFrame for encoding, frames are numbered in the order they are submitted
+	void SubmitFrame(Color* frame);
+	// Resolves the renderer's last frame, scaled to the capture size if needed, and submits it
+	void Capture(Renderer& renderer);
+
+	std::uint64_t FramesSubmitted() const { return nSubmitted; }
+	std::uint64_t FramesWritten() const { return nWritten; }
+	// Time the render loop spent waiting in AcquireFrame for the encoders
+	double StallSeconds() const { return stallSeconds; }
+private:
+	struct QueuedFrame {
+		Color* pixels;
+		std::uint64_t index;
+	};
+	// Output buffers of one encoder thread, reused for every frame
+	struct EncoderScratch {
+		std::vector<std::uint8_t> bytes;
+	};
+
+	void EncoderLoop();
+	bool Encode(const QueuedFrame& frame, EncoderScratch& scratch);
+	bool WriteStreamHeader();
+private:
+	CaptureOptions options;
+	bool open = false;
+	std::FILE* stream = nullptr;	// Raw and Y4M
+
+	std::vector<std::vector<Color>> buffers;
+	std::vector<Color*> freeBuffers;
+	std::deque<QueuedFrame> queue;
+	std::mutex mutex;
+	std::condition_variable bufferFreed;
+	std::condition_variable frameQueued;
+	bool stop = false;
+	std::vector<std::thread> encoders;
+
+	std::uint64_t nSubmitted = 0;
+	std::atomic<std::uint64_t> nWritten{ 0 };
+	double stallSeconds = 0.0;
+};
+
+#endif // !FRAME_CAPTURE_H
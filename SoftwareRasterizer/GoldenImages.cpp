@@ -0,0 +1,330 @@
+#include "GoldenImages.h"
+
+#include "Renderer.h"
+#include "Scene.h"
+#include "Texture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+	// Placed around the model's bounding sphere, looking at its center
+	struct GoldenCamera {
+		const char* name;
+		float yaw, pitch;	// Degrees, as in Camera
+		float distance;		// In bounding sphere radii
+	};
+
+	// The model overflows the screen from the close camera, so that triangles reach past the guard band
+	constexpr GoldenCamera cameras[] = {
+		{ "front", 0.0f, 0.0f, 2.5f },
+		{ "side", 90.0f, 0.0f, 2.5f },
+		{ "above", 30.0f, -60.0f, 2.5f },
+		{ "close", -135.0f, 15.0f, 1.1f },
+	};
+
+	struct GoldenConfig {
+		const char* name;
+		ShadingModel shading;
+		RenderPath path;
+		bool multisampling;
+		bool depthPrePass;
+		bool shadows;
+	};
+
+	constexpr GoldenConfig configs[] = {
+		{ "unlit", ShadingModel::Unlit, RenderPath::Forward, false, false, false },
+		{ "flat", ShadingModel::Flat, RenderPath::Forward, false, false, true },
+		{ "gouraud", ShadingModel::Gouraud, RenderPath::Forward, false, true, true },
+		{ "msaa", ShadingModel::Gouraud, RenderPath::Forward, true, false, false },
+		{ "visibility", ShadingModel::Gouraud, RenderPath::VisibilityBuffer, false, false, true },
+	};
+
+	struct Comparison {
+		int mismatched = 0;
+		int maxDifference = 0;
+		int holes = 0;
+	};
+
+	Comparison Compare(const std::vector<Color>& image, const Color* reference, int tolerance)
+	{
+		Comparison result;
+		for (std::size_t i = 0; i < image.size(); i++) {
+			const Color a = image[i];
+			const Color b = reference[i];
+			int difference = 0;
+			for (int shift = 0; shift < 24; shift += 8) {
+				difference = std::max(difference, std::abs((int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF)));
+			}
+			result.maxDifference = std::max(result.maxDifference, difference);
+			result.mismatched += difference > tolerance;
+			result.holes += a == Colors::magenta && b != Colors::magenta;
+		}
+		return result;
+	}
+
+	std::map<std::string, double> LoadBaseline(const fs::path& path)
+	{
+		std::map<std::string, double> baseline;
+		std::ifstream file(path);
+		std::string line;
+		while (std::getline(file, line)) {
+			const auto comma = line.find(',');
+			if (comma != std::string::npos) {
+				baseline[line.substr(0, comma)] = std::atof(line.c_str() + comma + 1);
+			}
+		}
+		return baseline;
+	}
+
+	Scene MakeScene(const Model& model, const GoldenCamera& camera, const GoldenConfig& config)
+	{
+		Scene scene;
+		scene.models.push_back(model);
+		scene.models.back().shading = config.shading;
+		scene.light.castsShadows = config.shadows;
+
+		const float yaw = Radians(camera.yaw);
+		const float pitch = Radians(camera.pitch);
+		const Vec3 front = { std::sin(yaw) * std::cos(pitch), std::sin(pitch), std::cos(yaw) * std::cos(pitch) };
+		scene.cam = Camera(model.boundsCenter - front * (model.boundsRadius * camera.distance), Vec3(0.0f, 1.0f, 0.0f), camera.yaw, camera.pitch);
+		return scene;
+	}
+
+	// The model seen from further away in front of a larger copy of itself, which overlaps the area a partial redraw
+	// is restricted to when the model moves
+	Scene MakeIncrementalScene(const Model& model, const GoldenConfig& config)
+	{
+		constexpr GoldenCamera camera = { "incremental", 30.0f, -20.0f, 6.0f };
+		Scene scene = MakeScene(model, camera, config);
+		scene.light.castsShadows = false;	// Moving shadows make every frame a full redraw
+		const Vec3 front = Normalize(model.boundsCenter - scene.cam.position);
+		Model background = scene.models[0];
+		background.scale = { 3.0f, 3.0f, 3.0f };
+		background.position = model.boundsCenter + front * (model.boundsRadius * 6.0f) - model.boundsCenter * 3.0f;
+		scene.models.push_back(std::move(background));
+		return scene;
+	}
+
+	// Pixels whose depth differs, bit for bit. Rounding differences in the interpolation rarely change a color but
+	// nearly always change the depth.
+	int CompareDepth(Renderer& renderer, std::vector<float>& depth)
+	{
+		const int rowLength = renderer.Pitch() / (int)sizeof(Color);
+		const float* buffer = renderer.DepthBufferData();
+		int mismatched = 0;
+		for (int y = 0; y < renderer.RenderHeight(); y++) {
+			for (int x = 0; x < renderer.RenderWidth(); x++) {
+				float& value = depth[(std::size_t)y * renderer.RenderWidth() + x];
+				mismatched += std::memcmp(&value, buffer + (std::size_t)y * rowLength + x, sizeof(float)) != 0;
+				value = buffer[(std::size_t)y * rowLength + x];
+			}
+		}
+		return mismatched;
+	}
+
+	// Moves the model of an incremental scene a little at a time and compares each partial redraw with a full frame,
+	// which it must match exactly, in color and (without multisampling) in depth. image is left with the first one
+	// that differs.
+	Comparison CompareIncremental(Renderer& renderer, bool multisampling, Scene scene, std::vector<Color>& image, std::vector<Color>& fullImage)
+	{
+		constexpr int nFrames = 8;
+		const int pitch = renderer.RenderWidth() * (int)sizeof(Color);
+		std::vector<float> depth(image.size());
+		Comparison comparison;
+		renderer.SetIncremental(true);
+		renderer.Render(scene);
+		for (int frame = 0; frame < nFrames && comparison.mismatched == 0; frame++) {
+			Model& model = scene.models[0];
+			model.position.x += model.boundsRadius * 0.2f;
+			model.position.y += model.boundsRadius * 0.07f * (frame % 3 - 1);
+			renderer.Render(scene);
+			renderer.ResolveTo(image.data(), pitch);
+			if (!multisampling) {
+				CompareDepth(renderer, depth);
+			}
+			// The next frame is partial again, redrawn from this full one
+			renderer.ClearBuffers();
+			renderer.Render(scene);
+			renderer.ResolveTo(fullImage.data(), pitch);
+			comparison = Compare(image, fullImage.data(), 0);
+			if (!multisampling) {
+				comparison.mismatched = std::max(comparison.mismatched, CompareDepth(renderer, depth));
+			}
+		}
+		renderer.SetIncremental(false);
+		return comparison;
+	}
+
+	// Renders once for the image, then timedRenders more times. Returns the median time in milliseconds.
+	double RenderAndTime(Renderer& renderer, const Scene& scene, int timedRenders, std::vector<Color>& image)
+	{
+		const int pitch = renderer.RenderWidth() * (int)sizeof(Color);
+		std::vector<double> times;
+		for (int i = 0; i <= timedRenders; i++) {
+			renderer.ClearBuffers();
+			const auto start = std::chrono::steady_clock::now();
+			renderer.Render(scene);
+			renderer.ResolveTo(image.data(), pitch);
+			times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		}
+		// The first render warms the caches and allocates the reused buffers
+		times.erase(times.begin());
+		if (times.empty()) {
+			return 0.0;
+		}
+		std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+		return times[times.size() / 2];
+	}
+}
+
+int RunGoldenImageTests(const GoldenImageOptions& options)
+{
+	const fs::path referenceDirectory = options.referenceDirectory;
+	std::error_code error;
+
+	// Models with a texture of the same name, sorted so that runs list the cases in the same order
+	std::vector<fs::path> meshPaths;
+	for (const auto& entry : fs::directory_iterator(options.assetDirectory, error)) {
+		fs::path texturePath = entry.path();
+		texturePath.replace_extension(".png");
+		if (entry.path().extension() == ".obj" && fs::exists(texturePath)) {
+			meshPaths.push_back(entry.path());
+		}
+	}
+	std::sort(meshPaths.begin(), meshPaths.end());
+	// The meshes and references aren't part of a checkout, so a run without them is skipped rather than failed
+	if (meshPaths.empty()) {
+		std::cerr << "Skipping the golden image tests: no models with textures (name.obj next to name.png) in "
+			<< options.assetDirectory << ".\n";
+		return 0;
+	}
+	// Update mode always writes the baseline with the references
+	if (!options.updateReferences && !fs::exists(referenceDirectory / "baseline.csv")) {
+		std::cerr << "Skipping the golden image tests: no references in " << referenceDirectory.string()
+			<< ". Run with --golden --update once on a known good build to record them.\n";
+		return 0;
+	}
+	fs::create_directories(referenceDirectory, error);
+
+	const auto baseline = LoadBaseline(referenceDirectory / "baseline.csv");
+	std::ostringstream newBaseline;
+	std::ofstream results;
+	if (!options.updateReferences) {
+		results.open(referenceDirectory / "results.csv");
+		results << "case,result,mismatched pixels,max difference,holes,ms,baseline ms,speedup\n";
+	}
+
+	Renderer renderer(options.width, options.height);
+	renderer.SetFrontToBackSorting(true);
+	std::vector<Color> image((std::size_t)renderer.RenderWidth() * renderer.RenderHeight());
+	std::vector<Color> fullImage(image.size());
+	const int maxMismatched = (int)(options.maxMismatchedFraction * image.size());
+	int failures = 0;
+	int nCases = 0;
+
+	for (const fs::path& meshPath : meshPaths) {
+		fs::path texturePath = meshPath;
+		texturePath.replace_extension(".png");
+		const Model model(meshPath.string().c_str(), texturePath.string().c_str());
+		const std::string asset = meshPath.stem().string();
+
+		for (const GoldenConfig& config : configs) {
+			renderer.SetRenderPath(config.path);
+			renderer.SetMultisampling(config.multisampling);
+			renderer.SetDepthPrePass(config.depthPrePass);
+
+			for (const GoldenCamera& camera : cameras) {
+				const std::string name = asset + "_" + camera.name + "_" + config.name;
+				const fs::path referencePath = referenceDirectory / (name + ".png");
+				const double ms = RenderAndTime(renderer, MakeScene(model, camera, config), options.timedRenders, image);
+				newBaseline << name << ',' << ms << '\n';
+				nCases++;
+
+				if (options.updateReferences) {
+					if (!pngFromPixels(image.data(), renderer.RenderWidth(), renderer.RenderHeight(), referencePath.string().c_str())) {
+						failures++;
+					}
+					std::printf("%-36s written   %8.3f ms\n", name.c_str(), ms);
+					continue;
+				}
+
+				const char* result = nullptr;
+				Comparison comparison;
+				const std::optional<Texture> reference = fs::exists(referencePath) ? textureFromFile(referencePath.string().c_str()) : std::nullopt;
+				if (!reference) {
+					result = "no reference";
+				}
+				else if (reference->width != renderer.RenderWidth() || reference->height != renderer.RenderHeight()) {
+					result = "wrong size";
+				}
+				else {
+					comparison = Compare(image, reference->buffer, options.tolerance);
+					if (comparison.holes > 0) {
+						result = "holes";
+					}
+					else if (comparison.mismatched > maxMismatched) {
+						result = "mismatch";
+					}
+				}
+				if (!result) {
+					result = "passed";
+				}
+				else {
+					failures++;
+					pngFromPixels(image.data(), renderer.RenderWidth(), renderer.RenderHeight(), (referenceDirectory / (name + "_actual.png")).string().c_str());
+				}
+
+				const auto base = baseline.find(name);
+				const double baselineMs = base != baseline.end() ? base->second : 0.0;
+				const double speedup = baselineMs > 0.0 && ms > 0.0 ? baselineMs / ms : 0.0;
+				std::printf("%-36s %-12s %7d px %4d diff %6d holes %8.3f ms", name.c_str(), result, comparison.mismatched,
+					comparison.maxDifference, comparison.holes, ms);
+				if (speedup > 0.0) {
+					std::printf(" %5.2fx", speedup);
+				}
+				std::printf("\n");
+				results << name << ',' << result << ',' << comparison.mismatched << ',' << comparison.maxDifference << ','
+					<< comparison.holes << ',' << ms << ',' << baselineMs << ',' << speedup << '\n';
+			}
+
+			// Partial redraws of the forward path, checked against a full frame instead of a reference
+			if (!options.updateReferences && config.path == RenderPath::Forward) {
+				const std::string name = asset + "_incremental_" + config.name;
+				const Comparison comparison = CompareIncremental(renderer, config.multisampling, MakeIncrementalScene(model, config), image, fullImage);
+				const char* result = comparison.mismatched == 0 ? "passed" : "mismatch";
+				if (comparison.mismatched > 0) {
+					failures++;
+					pngFromPixels(image.data(), renderer.RenderWidth(), renderer.RenderHeight(), (referenceDirectory / (name + "_actual.png")).string().c_str());
+				}
+				nCases++;
+				std::printf("%-36s %-12s %7d px %4d diff\n", name.c_str(), result, comparison.mismatched, comparison.maxDifference);
+				results << name << ',' << result << ',' << comparison.mismatched << ',' << comparison.maxDifference << ",0,0,0,0\n";
+			}
+		}
+	}
+
+	if (options.updateReferences) {
+		std::ofstream(referenceDirectory / "baseline.csv") << newBaseline.str();
+		std::printf("Wrote %d references to %s\n", nCases - failures, referenceDirectory.string().c_str());
+	}
+	else {
+		std::printf("%d of %d cases passed\n", nCases - failures, nCases);
+	}
+	std::fflush(stdout);
+	return failures;
+}
@@ -0,0 +1,31 @@
+#ifndef GOLDEN_IMAGES_H
+#define GOLDEN_IMAGES_H
+
+// Regression check for the renderer: renders every model in the asset directory (name.obj with name.png) from a set
+// of fixed cameras with a set of renderer configurations, offscreen, and compares the images with stored references.
+// A case fails if too many pixels differ by more than the tolerance, or if any pixel shows the magenta clear color
+// where the reference doesn't (a hole between triangles). Every case is also timed and compared with the baseline
+// timing recorded with the references, so a new fast path can be checked for correctness and speed in one run.
+// With every forward configuration, a partial redraw of incremental rendering after a model moved is also compared
+// with a full frame, which it has to match exactly.
+//
+// Writes results.csv (one line per case) to the reference directory, and name_actual.png next to the reference of
+// each failing case. Update mode writes the references and the baseline timings instead.
+//
+// Neither the meshes nor the references are checked in. To set up a checkout, copy the .obj files next to their
+// textures in the asset directory and run --golden --update on a known good build; until then the tests are skipped.
+struct GoldenImageOptions {
+	const char* assetDirectory = "Assets";
+	const char* referenceDirectory = "Golden";
+	bool updateReferences = false;
+	int width = 640;
+	int height = 360;
+	int tolerance = 8;					// Largest per channel difference of a matching pixel
+	float maxMismatchedFraction = 0.001f;	// Rounding differences between CPUs (_mm_rcp_ps) move a few texels
+	int timedRenders = 5;				// The median is reported
+};
+
+// Returns the number of failed cases
+int RunGoldenImageTests(const GoldenImageOptions& options);
+
+#endif // !GOLDEN_IMAGES_H
@@ -1,22 +1,45 @@
 #ifndef LIGHT_H
 #define LIGHT_H
 
+#include <cstdint>
+#include <immintrin.h>
+#include "Utilities.h"
 #include "Vector.h"
 
 struct DirectionalLight {
-	Vec3 dir;
+	Vec3 dir;	// World space, normalized. Direction the light travels in.
+	float ambient = 0.2f;
+	bool castsShadows = false;
+	int shadowMapSize = 1024;	// Width and height of the shadow map in texels
 };
 
-Color ApplyIntensity(Color color, float intensity) {
-	if (intensity < 0) intensity = 0;
-	else if (intensity > 1) intensity = 1;
+inline Color ApplyIntensity(Color color, float intensity) {
+	intensity = Clamp(intensity, 0.0f, 1.0f);
 
-	std::uint32_t a = color.dword & 0xFF000000;
-	std::uint32_t r = (color.dword & 0x00FF0000) * intensity;
-	std::uint32_t g = (color.dword & 0x0000FF00) * intensity;
-	std::uint32_t b = (color.dword & 0x000000FF) * intensity;
+	std::uint32_t a = color & 0xFF000000;
+	std::uint32_t r = (std::uint32_t)((color & 0x00FF0000) * intensity);
+	std::uint32_t g = (std::uint32_t)((color & 0x0000FF00) * intensity);
+	std::uint32_t b = (std::uint32_t)((color & 0x000000FF) * intensity);
 	return a | (r & 0x00FF0000) | (g & 0x0000FF00) | (b & 0x000000FF);
 }
 
+// ApplyIntensity for four pixels at once. The channels are widened to 16 bits and multiplied by the intensity
+// in 8.8 fixed point, so a full intensity of 256 keeps the channel as is. Alpha is left untouched.
+inline __m128i ApplyIntensity4(__m128i colors, __m128 intensities) {
+	const __m128 clamped = _mm_min_ps(_mm_max_ps(intensities, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+	const __m128i fixedPoint = _mm_cvttps_epi32(_mm_mul_ps(clamped, _mm_set1_ps(256.0f)));
+	// 16 bit intensities of pixels 0-3 in the low 8 bytes
+	const __m128i packed = _mm_packus_epi32(fixedPoint, fixedPoint);
+	// Broadcast each pixel's intensity to its B, G and R channels, alpha gets 256
+	const __m128i alpha = _mm_set_epi16(256, 0, 0, 0, 256, 0, 0, 0);
+	const __m128i lo = _mm_or_si128(_mm_shuffle_epi8(packed, _mm_set_epi8(-1, -1, 3, 2, 3, 2, 3, 2, -1, -1, 1, 0, 1, 0, 1, 0)), alpha);
+	const __m128i hi = _mm_or_si128(_mm_shuffle_epi8(packed, _mm_set_epi8(-1, -1, 7, 6, 7, 6, 7, 6, -1, -1, 5, 4, 5, 4, 5, 4)), alpha);
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i colorsLo = _mm_mullo_epi16(_mm_unpacklo_epi8(colors, zero), lo);
+	const __m128i colorsHi = _mm_mullo_epi16(_mm_unpackhi_epi8(colors, zero), hi);
+	return _mm_packus_epi16(_mm_srli_epi16(colorsLo, 8), _mm_srli_epi16(colorsHi, 8));
+}
+
 #endif
 
@@ -1,11 +1,30 @@
 #include <SDL.h>
 #include <SDL_image.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
 
+#include "AssetLoader.h"
+#include "BatchRenderer.h"
+#include "DynamicResolution.h"
+#include "FrameCapture.h"
+#include "GoldenImages.h"
+#include "MeshStreamer.h"
+#include "Microbenchmarks.h"
+#include "Profiler.h"
 #include "Renderer.h"
 #include "Scene.h"
+#include "Texture.h"
 #include "Window.h"
 
-bool ProcessInput(Camera &camera, float deltaTime)
+bool ProcessInput(Camera &camera, Renderer &renderer, float deltaTime)
 {
 	SDL_Event event;
 	while (SDL_PollEvent(&event))
@@ -19,6 +38,13 @@ bool ProcessInput(Camera &camera, float deltaTime)
 			{
 			case SDLK_ESCAPE:
 				return false;
+			case SDLK_h:
+				renderer.SetOverdrawHeatmap(!renderer.OverdrawHeatmap());
+				break;
+			case SDLK_p:
+				// stderr, stdout may be carrying a --capture stream
+				std::cerr << renderer.GetPipelineStats() << std::endl;
+				break;
 			}
 			break;
 		case SDL_MOUSEMOTION:
@@ -70,13 +96,149 @@ void QuitSDL() {
 	SDL_Quit();
 }
 
+// Queues the scene's models, loader.Update(scene) adds them as they finish loading
+Scene LoadScene(AssetLoader& loader) {
+	Scene scene;
+	scene.cam.position.z = -5;
+	loader.AddModel("Assets/drone.obj", "Assets/drone.png", [](Model& model) { model.shading = ShadingModel::Gouraud; });
+	return scene;
+}
+
+// Renders the scene along the camera track, writing frame_00000.png... to outputDirectory if there is one
+int RunBatch(const char* trackPath, int frameCount, const char* outputDirectory)
+{
+	const auto track = cameraTrackFromFile(trackPath);
+	if (!track) {
+		return 1;
+	}
+	if (outputDirectory) {
+		std::error_code error;
+		std::filesystem::create_directories(outputDirectory, error);
+	}
+	AssetLoader loader;
+	Scene scene = LoadScene(loader);
+	loader.Finish(scene);
+	BatchOptions options;
+	options.frameCount = frameCount;
+	options.multisampling = true;
+	int failures = 0;
+	const double fps = RenderBatch(scene, *track, options, [&](int frame, const Color* pixels, int width, int height) {
+		if (outputDirectory) {
+			char name[32];
+			std::snprintf(name, sizeof(name), "frame_%05d.png", frame);
+			failures += !pngFromPixels(pixels, width, height, (std::filesystem::path(outputDirectory) / name).string().c_str());
+		}
+	});
+	std::printf("Rendered %d frames at %.1f frames per second\n", frameCount, fps);
+	return failures == 0 ? 0 : 1;
+}
+
+// Flies along the camera track over a field of streamed copies of the drone, rendering offscreen, and prints how the
+// streamer kept up with budgetMiB of mesh memory
+int RunStreaming(const char* trackPath, int frameCount, std::size_t budgetMiB)
+{
+	const auto track = cameraTrackFromFile(trackPath);
+	if (!track) {
+		return 1;
+	}
+	StreamingOptions options;
+	options.budgetBytes = budgetMiB << 20;
+	// Every frame draws all models in view, as the window would with a fast enough disk
+	options.waitForVisible = true;
+	MeshStreamer streamer(options);
+	Scene scene;
+	constexpr int gridSize = 8;
+	constexpr float spacing = 8.0f;
+	for (int z = 0; z < gridSize; z++) {
+		for (int x = 0; x < gridSize; x++) {
+			const bool added = streamer.AddModel(scene, "Assets/drone.obj", "Assets/drone.png", [&](Model& model) {
+				model.shading = ShadingModel::Gouraud;
+				model.position = Vec3((x - gridSize / 2) * spacing, 0.0f, z * spacing);
+			});
+			if (!added) {
+				return 1;
+			}
+		}
+	}
+
+	BatchOptions size;
+	Renderer renderer(size.width, size.height);
+	const float startTime = track->front().time;
+	const float frameTime = (track->back().time - startTime) / std::max(frameCount - 1, 1);
+	for (int frame = 0; frame < frameCount; frame++) {
+		scene.cam = CameraAt(*track, startTime + frame * frameTime);
+		streamer.Update(scene, (float)renderer.RenderHeight() / renderer.RenderWidth(), frame > 0 ? frameTime : 0.0f);
+		renderer.Render(scene);
+	}
+	std::cout << streamer.Stats();
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	if (!InitSDL()) {
 		return -1;
 	}
 
+	// --golden [--update]: checks (or writes) the regression images offscreen instead of opening a window. Run with
+	// --update once to record the references, see GoldenImages.h
+	if (argc > 1 && std::strcmp(argv[1], "--golden") == 0) {
+		GoldenImageOptions options;
+		options.updateReferences = argc > 2 && std::strcmp(argv[2], "--update") == 0;
+		const int failures = RunGoldenImageTests(options);
+		QuitSDL();
+		return failures == 0 ? 0 : 1;
+	}
+
+	// --bench [filter] [--json path]: times the pipeline's building blocks instead of opening a window
+	if (argc > 1 && std::strcmp(argv[1], "--bench") == 0) {
+		MicrobenchmarkOptions options;
+		for (int i = 2; i < argc; i++) {
+			if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+				options.jsonPath = argv[++i];
+			}
+			else {
+				options.filter = argv[i];
+			}
+		}
+		const bool written = Microbenchmarks(options).Run();
+		QuitSDL();
+		return written ? 0 : 1;
+	}
+
+	// --batch track.txt [frames] [output directory]: renders frames along a camera track offscreen, several at once
+	if (argc > 2 && std::strcmp(argv[1], "--batch") == 0) {
+		const int frameCount = argc > 3 ? std::max(std::atoi(argv[3]), 1) : BatchOptions().frameCount;
+		const int result = RunBatch(argv[2], frameCount, argc > 4 ? argv[4] : nullptr);
+		QuitSDL();
+		return result;
+	}
+
+	// --stream track.txt [frames] [budget MiB]: streams meshes in and out along a camera track offscreen
+	if (argc > 2 && std::strcmp(argv[1], "--stream") == 0) {
+		const int frameCount = argc > 3 ? std::max(std::atoi(argv[3]), 1) : BatchOptions().frameCount;
+		const std::size_t budgetMiB = argc > 4 ? (std::size_t)std::max(std::atoi(argv[4]), 1) : StreamingOptions().budgetBytes >> 20;
+		const int result = RunStreaming(argv[2], frameCount, budgetMiB);
+		QuitSDL();
+		return result;
+	}
+
+	// --capture raw|y4m|qoi path: also writes every frame out, see FrameCapture (path - streams to stdout)
+	std::optional<CaptureOptions> captureOptions;
+	if (argc > 3 && std::strcmp(argv[1], "--capture") == 0) {
+		captureOptions.emplace();
+		captureOptions->format = std::strcmp(argv[2], "raw") == 0 ? CaptureFormat::Raw
+			: std::strcmp(argv[2], "qoi") == 0 ? CaptureFormat::QOI : CaptureFormat::Y4M;
+		captureOptions->path = argv[3];
+	}
+
+	// Loads while the window is created and the first frames are drawn
+	AssetLoader loader;
+	Scene scene = LoadScene(loader);
+
 	auto wnd = Window::CreateFullscreen();
+	// Profiling builds also count cycles, cache and branch misses per stage where the platform allows it
+	PROFILE_ENABLE_HARDWARE_COUNTERS();
 
 	if (wnd) {
 		constexpr int FPS = 30;
@@ -84,13 +246,25 @@ int main(int argc, char *argv[])
 
 		Window& window = wnd.value();
 		Renderer renderer(window.w(), window.h());
-		Scene scene;
-		scene.cam.position.z = -5;
-		scene.models.push_back(Model("Assets/drone.obj", "Assets/drone.png"));
+		renderer.SetFrontToBackSorting(true);
+		renderer.SetMultisampling(true);
+		// Frames are only redrawn where something changed, Render clears what it redraws
+		renderer.SetIncremental(true);
+		// Rasterizes each model while the geometry of the next ones is processed
+		renderer.SetPipelining(std::thread::hardware_concurrency() > 1);
+		// Scales the render size so that a frame's work fits the frame time
+		DynamicResolution resolution(window.w(), window.h(), (float)FRAME_TARGET_TIME_MS);
+		std::optional<FrameCapture> capture;
+		if (captureOptions) {
+			captureOptions->width = window.w();
+			captureOptions->height = window.h();
+			captureOptions->framesPerSecond = FPS;
+			capture.emplace(*captureOptions);
+		}
 		std::uint32_t previousFrameTime = 0;
 		float deltaTime = 0.0f;
 
-		bool isRunning = ProcessInput(scene.cam, deltaTime);
+		bool isRunning = ProcessInput(scene.cam, renderer, deltaTime);
 		constexpr float msToSFactor = 1.0f / 1000.0f;
 		while (isRunning)
 		{
@@ -106,11 +280,27 @@ int main(int argc, char *argv[])
 			deltaTime = (currentTime - previousFrameTime) * msToSFactor;
 			previousFrameTime = SDL_GetTicks();
 
-			isRunning = ProcessInput(scene.cam, deltaTime);
+			const auto workStart = std::chrono::steady_clock::now();
+			isRunning = ProcessInput(scene.cam, renderer, deltaTime);
+			loader.Update(scene);
 			renderer.Render(scene);
-			window.CopyAndPresent(renderer.ColorBufferData(), renderer.Pitch());
-			renderer.ClearBuffers();
+			// Resolving multisampled pixels and upscaling straight into the window's texture
+			window.Present([&renderer, &window](Color* pixels, int pitch) { renderer.PresentTo(pixels, pitch, window.w(), window.h()); });
+			if (capture) {
+				capture->Capture(renderer);
+			}
+
+			const float workMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - workStart).count();
+			if (resolution.Update(workMs)) {
+				renderer.SetRenderSize(resolution.RenderWidth(), resolution.RenderHeight());
+			}
+			PROFILE_END_FRAME();
+		}
+		if (capture) {
+			std::cerr << "Captured " << capture->FramesSubmitted() << " frames, waited " << capture->StallSeconds() << " s for the encoders\n";
 		}
+		PROFILE_PRINT_RUN_SUMMARY();
+		PROFILE_WRITE_TRACE("trace.json");
 	}
 	else {
 		std::cerr << "Failed to create window\n";
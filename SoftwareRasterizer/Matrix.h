@@ -136,6 +136,17 @@ inline Mat4 Perspective(float inverseAspectRatio, float fovRadians, float zNear,
 	};
 }
 
+inline Mat4 Orthographic(float halfWidth, float halfHeight, float zNear, float zFar) {
+	// Scales x and y to [-1, 1] and normalizes z values from [zNear, zFar] to [0, 1]. w stays 1, so there is
+	// no perspective division and depth is linear in z.
+	return {
+		1.0f / halfWidth,	0,					0,							0,
+		0,					1.0f / halfHeight,	0,							0,
+		0,					0,					1.0f / (zFar - zNear),		-zNear / (zFar - zNear),
+		0,					0,					0,							1
+	};
+}
+
 inline Mat4 LookAt(Vec3 camPos, Vec3 camRight, Vec3 camUp, Vec3 camForward) {
 	return {
 		camRight.x, camRight.y, camRight.z, -Dot(camRight, camPos),
@@ -145,6 +156,55 @@ inline Mat4 LookAt(Vec3 camPos, Vec3 camRight, Vec3 camUp, Vec3 camForward) {
 	};
 }
 
+// Determinant of the upper left 3x3 (linear) part. Negative if the transform mirrors geometry.
+inline float Determinant3x3(const Mat4& m) {
+	return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+		   m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+		   m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+
+// Inverse of a matrix whose last row is (0, 0, 0, 1), such as model and view matrices.
+inline Mat4 AffineInverse(const Mat4& m) {
+	const float invDet = 1.0f / Determinant3x3(m);
+	Mat4 inv;
+	inv[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invDet;
+	inv[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+	inv[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+	inv[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * invDet;
+	inv[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+	inv[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+	inv[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invDet;
+	inv[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+	inv[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+	for (int r = 0; r < 3; r++) {
+		inv[r][3] = -(inv[r][0] * m[0][3] + inv[r][1] * m[1][3] + inv[r][2] * m[2][3]);
+	}
+	inv[3][0] = inv[3][1] = inv[3][2] = 0.0f;
+	inv[3][3] = 1.0f;
+	return inv;
+}
+
+// Transforms a direction (w = 0) by the upper left 3x3 part only
+inline Vec3 TransformDirection(const Mat4& m, Vec3 v) {
+	return {
+		m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+		m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+		m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z
+	};
+}
+
+// Inverse transpose of the linear part of an affine matrix. Keeps normals perpendicular to surfaces under non-uniform scaling.
+inline Mat4 NormalMatrix(const Mat4& m) {
+	const Mat4 inv = AffineInverse(m);
+	Mat4 normal = Identity();
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 3; c++) {
+			normal[r][c] = inv[c][r];
+		}
+	}
+	return normal;
+}
+
 inline Mat4 ModelMatrix(Vec3 pos, Vec3 rotation, Vec3 scale) {
 	return Translation(pos)* Rotation(rotation)* Scaling(scale);
 }
@@ -0,0 +1,171 @@
+#include "MeshStreamer.h"
+
+#include "Clipping.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace {
+	template<typename T>
+	bool IsReady(const T& future)
+	{
+		return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}
+
+	struct LoadRequest {
+		bool inView;
+		bool neededNow;		// In view or close, rather than only ahead
+		float distance;		// From the camera to the bounds
+		std::size_t streamedIndex;
+	};
+}
+
+MeshStreamer::MeshStreamer(const StreamingOptions& options)
+	: options(options), loader(options.nLoaderThreads)
+{
+}
+
+bool MeshStreamer::AddModel(Scene& scene, const std::string& meshPath, const std::string& texturePath, std::function<void(Model&)> setup)
+{
+	Vec3 center;
+	float radius;
+	if (!Model::ReadBounds(meshPath.c_str(), center, radius)) {
+		std::cerr << "Unable to read mesh " << meshPath << ".\n";
+		return false;
+	}
+	Model& model = scene.models.emplace_back(placeholderTexture());
+	model.boundsCenter = center;
+	model.boundsRadius = radius;
+	if (setup) {
+		setup(model);
+	}
+
+	StreamedModel streamed;
+	streamed.meshPath = meshPath;
+	streamed.modelIndex = scene.models.size() - 1;
+	streamed.texture = loader.LoadTexture(texturePath);
+	streamedModels.push_back(std::move(streamed));
+	stats.streamedModels++;
+	return true;
+}
+
+void MeshStreamer::Update(Scene& scene, float inverseAspectRatio, float deltaTime)
+{
+	PROFILE_SCOPE("Streaming");
+	updateIndex++;
+	for (StreamedModel& streamed : streamedModels) {
+		if (streamed.loading.valid() && IsReady(streamed.loading)) {
+			Adopt(scene, streamed);
+		}
+		if (!streamed.hasTexture && IsReady(streamed.texture)) {
+			scene.models[streamed.modelIndex].texture = streamed.texture.get();
+			streamed.hasTexture = true;
+		}
+	}
+
+	// The renderer's projection, from where the camera is and from where it is headed
+	const Camera& camera = scene.cam;
+	const Mat4 proj = camera.GetProjectionMatrix(inverseAspectRatio);
+	const auto planes = ExtractFrustumPlanes(proj * camera.GetViewMatrix());
+	Camera ahead = camera;
+	if (hasPreviousCamera && deltaTime > 0.0f) {
+		ahead.position += (camera.position - previousCameraPosition) * (options.prefetchSeconds / deltaTime);
+	}
+	const auto planesAhead = ExtractFrustumPlanes(proj * ahead.GetViewMatrix());
+	previousCameraPosition = camera.position;
+	hasPreviousCamera = true;
+
+	std::vector<LoadRequest> requests;
+	unsigned nLoading = 0;
+	for (std::size_t i = 0; i < streamedModels.size(); i++) {
+		StreamedModel& streamed = streamedModels[i];
+		const Model& model = scene.models[streamed.modelIndex];
+		const float maxScale = std::max({ std::fabs(model.scale.x), std::fabs(model.scale.y), std::fabs(model.scale.z) });
+		const Vec3 center = ModelMatrix(model.position, model.rotation, model.scale) * model.boundsCenter;
+		const float radius = model.boundsRadius * maxScale;
+		const float distance = std::max((center - camera.position).length() - radius, 0.0f);
+		const bool inView = !IsSphereOutsideFrustum(planes, center, radius);
+		const bool neededNow = inView || distance <= options.loadDistance;
+		streamed.inView = inView;
+		const bool neededAhead = !IsSphereOutsideFrustum(planesAhead, center, radius) ||
+			(center - ahead.position).length() - radius <= options.loadDistance;
+
+		if (inView) {
+			stats.lookups++;
+			stats.hits += streamed.resident;
+		}
+		if (neededNow || neededAhead) {
+			streamed.lastUsed = updateIndex;
+			if (!streamed.resident && !streamed.loading.valid()) {
+				requests.push_back({ inView, neededNow, distance, i });
+			}
+		}
+		nLoading += streamed.loading.valid();
+	}
+
+	// Needed now before needed ahead, nearest first
+	std::sort(requests.begin(), requests.end(), [](const LoadRequest& a, const LoadRequest& b) {
+		return a.neededNow != b.neededNow ? a.neededNow : a.distance < b.distance;
+	});
+	for (const LoadRequest& request : requests) {
+		// Update waits for the models in view anyway, so they don't queue behind the limit
+		if (nLoading >= options.maxLoadsInFlight && !(options.waitForVisible && request.inView)) {
+			continue;
+		}
+		StreamedModel& streamed = streamedModels[request.streamedIndex];
+		streamed.loading = loader.LoadMesh(streamed.meshPath, streamed.texture);
+		nLoading++;
+		stats.loads++;
+		stats.prefetches += !request.neededNow;
+	}
+
+	if (options.waitForVisible) {
+		const auto start = std::chrono::steady_clock::now();
+		for (StreamedModel& streamed : streamedModels) {
+			if (streamed.inView && streamed.loading.valid()) {
+				streamed.loading.wait();
+				Adopt(scene, streamed);
+			}
+		}
+		stats.stallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	Evict(scene);
+}
+
+void MeshStreamer::Adopt(Scene& scene, StreamedModel& streamed)
+{
+	Model loaded = streamed.loading.get();
+	streamed.bytes = loaded.MeshBytes();
+	scene.models[streamed.modelIndex].AdoptMesh(std::move(loaded));
+	streamed.resident = true;
+	stats.residentModels++;
+	stats.residentBytes += streamed.bytes;
+	stats.peakResidentBytes = std::max(stats.peakResidentBytes, stats.residentBytes);
+}
+
+void MeshStreamer::Evict(Scene& scene)
+{
+	if (stats.residentBytes <= options.budgetBytes) {
+		return;
+	}
+	std::vector<StreamedModel*> candidates;
+	for (StreamedModel& streamed : streamedModels) {
+		if (streamed.resident && streamed.lastUsed < updateIndex) {
+			candidates.push_back(&streamed);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(), [](const StreamedModel* a, const StreamedModel* b) { return a->lastUsed < b->lastUsed; });
+	for (StreamedModel* streamed : candidates) {
+		if (stats.residentBytes <= options.budgetBytes) {
+			break;
+		}
+		scene.models[streamed->modelIndex].ReleaseMesh();
+		streamed->resident = false;
+		stats.residentModels--;
+		stats.residentBytes -= streamed->bytes;
+		stats.evictions++;
+	}
+}
@@ -0,0 +1,95 @@
+#ifndef MESH_STREAMER_H
+#define MESH_STREAMER_H
+
+#include "AssetLoader.h"
+#include "Scene.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct StreamingOptions {
+	std::size_t budgetBytes = (std::size_t)256 << 20;	// Mesh memory of the resident models
+	float loadDistance = 10.0f;		// Models whose bounds come this close to the camera are loaded outside the view too
+	float prefetchSeconds = 1.0f;	// Also loads what will be in view at the camera position this far ahead
+	unsigned maxLoadsInFlight = 4;	// Queued at once, so that new requests can still overtake older ones
+	bool waitForVisible = false;	// Update blocks until the models in view are loaded instead of drawing them later,
+									// models that are only close or ahead still load in the background
+	unsigned nLoaderThreads = 2;
+};
+
+struct StreamingStats {
+	std::size_t streamedModels = 0;
+	std::size_t residentModels = 0;
+	std::size_t residentBytes = 0;
+	std::size_t peakResidentBytes = 0;
+	std::uint64_t lookups = 0;		// Models in view, summed over the updates
+	std::uint64_t hits = 0;			// Of them resident
+	std::uint64_t loads = 0;
+	std::uint64_t prefetches = 0;	// Loads for models that were not in view yet
+	std::uint64_t evictions = 0;
+	double stallSeconds = 0.0;		// Spent waiting for models in view with waitForVisible
+
+	float HitRate() const { return lookups > 0 ? (float)hits / lookups : 1.0f; }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const StreamingStats& stats) {
+	return os <<
+		"Streamed models:     " << stats.streamedModels << '\n' <<
+		"Resident models:     " << stats.residentModels << '\n' <<
+		"Resident MiB:        " << stats.residentBytes / (1024.0 * 1024.0) << " (peak " << stats.peakResidentBytes / (1024.0 * 1024.0) << ")\n" <<
+		"Hit rate:            " << stats.HitRate() * 100.0f << "% of " << stats.lookups << '\n' <<
+		"Loads:               " << stats.loads << " (" << stats.prefetches << " prefetched)\n" <<
+		"Evictions:           " << stats.evictions << '\n' <<
+		"Stall seconds:       " << stats.stallSeconds << '\n';
+}
+
+// Keeps the mesh memory of a scene's streamed models within a budget. Their bounds are read up front with
+// Model::ReadBounds, and their geometry is loaded on the loader's threads once they are in view or close to the
+// camera, nearest first. Models are also loaded before they come into view: the camera's motion over the last
+// update is extrapolated prefetchSeconds ahead and the models in view or close from there are requested as well.
+// While over budget the resident models that were used least recently (in view or close) are evicted, those
+// needed in the current update never are. A model without its mesh draws nothing.
+class MeshStreamer {
+public:
+	explicit MeshStreamer(const StreamingOptions& options = StreamingOptions());
+
+	// Appends a model without geometry to the scene and streams its mesh, setup is called on it right away to set
+	// its shading and transform. The texture is loaded at once and stays resident. Returns false if the mesh file
+	// can't be read.
+	bool AddModel(Scene& scene, const std::string& meshPath, const std::string& texturePath, std::function<void(Model&)> setup = nullptr);
+	// Once per frame, before rendering: requests, adopts and evicts meshes for the scene's camera.
+	// inverseAspectRatio is the render target's height / width, deltaTime the time since the last update in seconds.
+	void Update(Scene& scene, float inverseAspectRatio, float deltaTime);
+
+	const StreamingStats& Stats() const { return stats; }
+private:
+	struct StreamedModel {
+		std::string meshPath;
+		std::size_t modelIndex;		// In scene.models
+		AssetLoader::TextureFuture texture;
+		bool hasTexture = false;
+		bool resident = false;
+		std::size_t bytes = 0;
+		std::future<Model> loading;	// Valid while the mesh loads
+		std::uint64_t lastUsed = 0;	// Update that last needed the model
+		bool inView = false;		// In the camera's view in the last update
+	};
+
+	void Adopt(Scene& scene, StreamedModel& streamed);
+	void Evict(Scene& scene);
+private:
+	StreamingOptions options;
+	AssetLoader loader;
+	std::vector<StreamedModel> streamedModels;
+	StreamingStats stats;
+	std::uint64_t updateIndex = 0;
+	Vec3 previousCameraPosition = { 0, 0, 0 };
+	bool hasPreviousCamera = false;
+};
+
+#endif // !MESH_STREAMER_H
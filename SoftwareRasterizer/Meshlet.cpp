@@ -0,0 +1,181 @@
+#include "Meshlet.h"
+
+#include <algorithm>
+
+static void ComputeBounds(Meshlet& meshlet, const std::vector<Vec3>& vertices, const std::vector<Face>& faces, const std::uint32_t* meshletVertices)
+{
+	// Bounding sphere centered on the AABB of the meshlet's vertices
+	Vec3 min = vertices[meshletVertices[0]];
+	Vec3 max = min;
+	for (std::uint32_t i = 1; i < meshlet.vertexCount; i++) {
+		const Vec3& v = vertices[meshletVertices[i]];
+		min = { std::min(min.x, v.x), std::min(min.y, v.y), std::min(min.z, v.z) };
+		max = { std::max(max.x, v.x), std::max(max.y, v.y), std::max(max.z, v.z) };
+	}
+	meshlet.center = (min + max) * 0.5f;
+	meshlet.radius = 0.0f;
+	for (std::uint32_t i = 0; i < meshlet.vertexCount; i++) {
+		meshlet.radius = std::max(meshlet.radius, (vertices[meshletVertices[i]] - meshlet.center).length());
+	}
+
+	// Normal cone. Winding order matches IsFrontFacingViewSpace so the face normal points away from the camera
+	// when the face is back facing.
+	std::vector<Vec3> normals;
+	normals.reserve(meshlet.faceCount);
+	Vec3 axis = { 0, 0, 0 };
+	for (std::uint32_t i = meshlet.firstFace; i < meshlet.firstFace + meshlet.faceCount; i++) {
+		const Vec3& a = vertices[faces[i].a];
+		const Vec3& b = vertices[faces[i].b];
+		const Vec3& c = vertices[faces[i].c];
+		Vec3 n = Cross(b - a, c - b);
+		const float length = n.length();
+		n = length > 0.0f ? n / length : Vec3{ 0, 0, 0 };
+		normals.push_back(n);
+		axis += n;
+	}
+
+	meshlet.coneApex = meshlet.center;
+	meshlet.coneAxis = { 0, 0, 1 };
+	meshlet.coneCutoff = noConeCutoff;
+
+	const float axisLength = axis.length();
+	if (axisLength == 0.0f) {
+		return;
+	}
+	axis = axis / axisLength;
+
+	// Degenerate faces (zero normal) are never rasterized so they don't constrain the cone
+	float minDot = 1.0f;
+	for (const Vec3& n : normals) {
+		if (n.x != 0.0f || n.y != 0.0f || n.z != 0.0f) {
+			minDot = std::min(minDot, Dot(n, axis));
+		}
+	}
+
+	// Cone is (nearly) a half space or wider, no camera position can see only back faces
+	if (minDot <= 0.1f) {
+		return;
+	}
+
+	// Move the apex back along the axis until every face plane is in front of it
+	float maxT = 0.0f;
+	for (std::uint32_t i = 0; i < meshlet.faceCount; i++) {
+		const Vec3& n = normals[i];
+		const Vec3& a = vertices[faces[meshlet.firstFace + i].a];
+		const float dn = Dot(axis, n);
+		if (dn > 0.0f) {
+			maxT = std::max(maxT, Dot(meshlet.center - a, n) / dn);
+		}
+	}
+
+	meshlet.coneApex = meshlet.center - axis * maxT;
+	meshlet.coneAxis = axis;
+	meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+}
+
+std::vector<Meshlet> BuildMeshlets(const std::vector<Vec3>& vertices, std::vector<Face>& faces, std::vector<std::uint32_t>& meshletVertices)
+{
+	const std::uint32_t nFaces = (std::uint32_t)faces.size();
+	const std::uint32_t nVertices = (std::uint32_t)vertices.size();
+
+	// Faces adjacent to each vertex, stored contiguously per vertex
+	std::vector<std::uint32_t> adjacencyOffsets(nVertices + 1, 0);
+	for (const Face& face : faces) {
+		adjacencyOffsets[face.a + 1]++;
+		adjacencyOffsets[face.b + 1]++;
+		adjacencyOffsets[face.c + 1]++;
+	}
+	for (std::uint32_t i = 0; i < nVertices; i++) {
+		adjacencyOffsets[i + 1] += adjacencyOffsets[i];
+	}
+	std::vector<std::uint32_t> adjacentFaces(adjacencyOffsets.back());
+	{
+		std::vector<std::uint32_t> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+		for (std::uint32_t i = 0; i < nFaces; i++) {
+			adjacentFaces[fill[faces[i].a]++] = i;
+			adjacentFaces[fill[faces[i].b]++] = i;
+			adjacentFaces[fill[faces[i].c]++] = i;
+		}
+	}
+
+	std::vector<Meshlet> meshlets;
+	meshlets.reserve(nFaces / maxMeshletFaces + 1);
+	std::vector<Face> orderedFaces;
+	orderedFaces.reserve(nFaces);
+	std::vector<bool> isFaceUsed(nFaces, false);
+
+	// Index of the meshlet that last referenced each vertex. Avoids a per meshlet set of vertex indices.
+	std::vector<std::uint32_t> lastMeshlet(nVertices, UINT32_MAX);
+	auto countNewVertices = [&](const Face& face) {
+		const std::uint32_t meshletIndex = (std::uint32_t)meshlets.size();
+		return (std::uint32_t)(lastMeshlet[face.a] != meshletIndex) +
+			(lastMeshlet[face.b] != meshletIndex && face.b != face.a) +
+			(lastMeshlet[face.c] != meshletIndex && face.c != face.a && face.c != face.b);
+	};
+
+	Meshlet current{};
+	current.firstVertex = (std::uint32_t)meshletVertices.size();
+	std::vector<std::uint32_t> candidates;
+	auto flush = [&]() {
+		if (current.faceCount == 0) return;
+		meshlets.push_back(current);
+		current = Meshlet{};
+		current.firstFace = (std::uint32_t)orderedFaces.size();
+		current.firstVertex = (std::uint32_t)meshletVertices.size();
+		candidates.clear();
+	};
+	auto addFace = [&](std::uint32_t faceIndex) {
+		const Face& face = faces[faceIndex];
+		isFaceUsed[faceIndex] = true;
+		orderedFaces.push_back(face);
+		const std::uint32_t indices[3] = { face.a, face.b, face.c };
+		for (std::uint32_t index : indices) {
+			if (lastMeshlet[index] != meshlets.size()) {
+				lastMeshlet[index] = (std::uint32_t)meshlets.size();
+				meshletVertices.push_back(index);
+				current.vertexCount++;
+			}
+			for (std::uint32_t i = adjacencyOffsets[index]; i < adjacencyOffsets[index + 1]; i++) {
+				if (!isFaceUsed[adjacentFaces[i]]) {
+					candidates.push_back(adjacentFaces[i]);
+				}
+			}
+		}
+		current.faceCount++;
+	};
+
+	// Grow each meshlet greedily across shared edges so it stays compact, which keeps its bounding sphere
+	// small and its normal cone narrow. Picks the candidate that adds the fewest new vertices.
+	std::uint32_t nextSeed = 0;
+	while (orderedFaces.size() < nFaces) {
+		std::uint32_t best = UINT32_MAX;
+		std::uint32_t bestNewVertices = 4;
+		if (current.faceCount < maxMeshletFaces) {
+			auto last = std::remove_if(candidates.begin(), candidates.end(), [&](std::uint32_t f) { return isFaceUsed[f]; });
+			candidates.erase(last, candidates.end());
+			for (std::uint32_t f : candidates) {
+				const std::uint32_t newVertices = countNewVertices(faces[f]);
+				if (newVertices < bestNewVertices && current.vertexCount + newVertices <= maxMeshletVertices) {
+					best = f;
+					bestNewVertices = newVertices;
+				}
+			}
+		}
+
+		if (best == UINT32_MAX) {
+			// Nothing adjacent fits, start a new meshlet from the next unused face in file order
+			flush();
+			while (isFaceUsed[nextSeed]) nextSeed++;
+			best = nextSeed;
+		}
+		addFace(best);
+	}
+	flush();
+
+	for (Meshlet& meshlet : meshlets) {
+		ComputeBounds(meshlet, vertices, orderedFaces, meshletVertices.data() + meshlet.firstVertex);
+	}
+	faces = std::move(orderedFaces);
+
+	return meshlets;
+}
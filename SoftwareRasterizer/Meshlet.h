@@ -0,0 +1,41 @@
+#ifndef MESHLET_H
+#define MESHLET_H
+
+#include <cstdint>
+#include <vector>
+#include "Triangle.h"
+#include "Vector.h"
+
+// A small cluster of neighbouring faces that can be culled as a whole before any of its vertices are transformed.
+// Source: https://zeux.io/2023/04/28/meshlet-bounds/ (the cone test matches meshoptimizer's meshopt_computeClusterBounds)
+struct Meshlet {
+	std::uint32_t firstFace, faceCount;		// Range in Model::faces
+	std::uint32_t firstVertex, vertexCount;	// Range in Model::meshletVertices
+
+	// Bounding sphere in model space
+	Vec3 center;
+	float radius;
+
+	// Normal cone in model space. The meshlet is entirely back facing when
+	// Dot(Normalize(coneApex - cameraPosition), coneAxis) >= coneCutoff.
+	Vec3 coneApex;
+	Vec3 coneAxis;
+	float coneCutoff;
+};
+
+constexpr std::uint32_t maxMeshletFaces = 64;
+constexpr std::uint32_t maxMeshletVertices = 64;
+
+// Cutoff used when the normals of a meshlet are spread too widely for the cone test to ever succeed
+constexpr float noConeCutoff = 2.0f;
+
+// Partitions faces into meshlets and appends the unique vertex indices of each meshlet to meshletVertices.
+// Faces are reordered so that the faces of each meshlet are contiguous.
+std::vector<Meshlet> BuildMeshlets(const std::vector<Vec3>& vertices, std::vector<Face>& faces, std::vector<std::uint32_t>& meshletVertices);
+
+inline bool IsMeshletBackFacing(const Meshlet& meshlet, const Vec3& cameraPosition) {
+	Vec3 toApex = meshlet.coneApex - cameraPosition;
+	return Dot(toApex, meshlet.coneAxis) >= meshlet.coneCutoff * toApex.length();
+}
+
+#endif // !MESHLET_H
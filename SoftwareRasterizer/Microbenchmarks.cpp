@@ -0,0 +1,312 @@
+#include "Microbenchmarks.h"
+
+#include "Clipping.h"
+#include "Renderer.h"
+#include "Shader.h"
+#include "Texture.h"
+#include "TriangleSetup.h"
+#include "VertexProcessing.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+
+namespace {
+	// Results are folded into this so that the compiler can't drop the work being timed
+	volatile std::uint32_t sink;
+
+	constexpr int targetWidth = 1280;
+	constexpr int targetHeight = 720;
+
+	double Median(std::vector<double> values)
+	{
+		std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+		return values[values.size() / 2];
+	}
+
+	// Triangle fitting a square of the given size in pixels at a random place on screen, front facing, as clip space
+	// vertices with w = 1 and the texture coordinates in the first two varyings
+	ClipSpaceTriangle RandomScreenTriangle(std::mt19937& rng, float size)
+	{
+		std::uniform_real_distribution<float> originX(0.0f, std::max(1.0f, targetWidth - size));
+		std::uniform_real_distribution<float> originY(0.0f, std::max(1.0f, targetHeight - size));
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const float x = originX(rng);
+		const float y = originY(rng);
+		float screen[3][2];
+		for (auto& vertex : screen) {
+			vertex[0] = x + unit(rng) * size;
+			vertex[1] = y + unit(rng) * size;
+		}
+		// The setup accepts triangles with a positive area in screen space (y down)
+		const float area = (screen[1][0] - screen[0][0]) * (screen[2][1] - screen[0][1]) - (screen[1][1] - screen[0][1]) * (screen[2][0] - screen[0][0]);
+		if (area < 0.0f) {
+			std::swap(screen[1], screen[2]);
+		}
+
+		const float halfW = targetWidth / 2.0f;
+		const float halfH = targetHeight / 2.0f;
+		ClipSpaceTriangle triangle = {};
+		Vec4* positions[3] = { &triangle.a, &triangle.b, &triangle.c };
+		Varyings* varyings[3] = { &triangle.aVaryings, &triangle.bVaryings, &triangle.cVaryings };
+		for (int i = 0; i < 3; i++) {
+			*positions[i] = { screen[i][0] / halfW - 1.0f, 1.0f - screen[i][1] / halfH, 0.5f, 1.0f };
+			varyings[i]->v[0] = screen[i][0] / targetWidth;
+			varyings[i]->v[1] = screen[i][1] / targetHeight;
+		}
+		return triangle;
+	}
+
+	// Vertex in front of the camera inside the view frustum, or behind the near plane
+	Vec4 RandomClipSpaceVertex(std::mt19937& rng, bool behindNear)
+	{
+		std::uniform_real_distribution<float> depth(1.0f, 20.0f);
+		std::uniform_real_distribution<float> side(-0.9f, 0.9f);
+		const float w = behindNear ? 0.05f : depth(rng);
+		return { side(rng) * w, side(rng) * w, behindNear ? -0.05f : 0.5f * w, w };
+	}
+}
+
+bool Microbenchmarks::Run()
+{
+	TriangleSetup();
+	Rasterization();
+	TextureSampling();
+	Clipping();
+	VertexTransform();
+
+	if (options.jsonPath && !WriteJson(options.jsonPath)) {
+		std::fprintf(stderr, "Error writing %s\n", options.jsonPath);
+		return false;
+	}
+	return true;
+}
+
+bool Microbenchmarks::IsSelected(const std::string& name) const
+{
+	return !options.filter || name.find(options.filter) != std::string::npos;
+}
+
+template<typename F>
+void Microbenchmarks::Measure(const std::string& name, const char* unit, std::size_t items, F&& run)
+{
+	if (!IsSelected(name)) {
+		return;
+	}
+	for (int i = 0; i < options.warmupRuns; i++) {
+		run();
+	}
+	std::vector<double> times;
+	for (int i = 0; i < std::max(options.runs, 1); i++) {
+		const auto start = std::chrono::steady_clock::now();
+		run();
+		times.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / items);
+	}
+	const double median = Median(times);
+	for (double& time : times) {
+		time = std::fabs(time - median);
+	}
+	const double mad = Median(times);
+	results.push_back({ name, unit, items, median, mad });
+	std::printf("%-32s %10.3f ns/%-9s MAD %8.3f (%4.1f%%)\n", name.c_str(), median, unit, mad, median > 0.0 ? 100.0 * mad / median : 0.0);
+	std::fflush(stdout);
+}
+
+void Microbenchmarks::TriangleSetup()
+{
+	// Edge functions, bounding boxes and attribute planes of medium sized triangles
+	std::mt19937 rng(1);
+	std::vector<ClipSpaceTriangle> triangles(4096);
+	for (auto& triangle : triangles) {
+		triangle = RandomScreenTriangle(rng, 32.0f);
+	}
+	TriangleSetupBuffer<2> buffer;
+	Measure("setup/2 varyings", "triangle", triangles.size(), [&] {
+		buffer.Clear();
+		SetupTriangles<2>(triangles, targetWidth, targetHeight, buffer);
+		sink = sink + (std::uint32_t)buffer.count;
+	});
+}
+
+void Microbenchmarks::Rasterization()
+{
+	struct TriangleSize {
+		const char* name;
+		float size;
+		std::size_t count;
+	};
+	constexpr TriangleSize sizes[] = { { "tiny", 3.0f, 4096 }, { "medium", 40.0f, 1024 }, { "huge", 600.0f, 16 } };
+
+	Renderer renderer(targetWidth, targetHeight);
+	Texture texture(256, 256);
+	ShaderUniforms uniforms;
+	uniforms.texture = &texture;
+
+	for (const TriangleSize& size : sizes) {
+		const std::string scalarName = std::string("raster/scalar/") + size.name;
+		const std::string sseName = std::string("raster/sse/") + size.name;
+		if (!IsSelected(scalarName) && !IsSelected(sseName)) {
+			continue;
+		}
+		std::mt19937 rng(2);
+		std::vector<ClipSpaceTriangle> triangles(size.count);
+		for (auto& triangle : triangles) {
+			triangle = RandomScreenTriangle(rng, size.size);
+		}
+		TriangleSetupBuffer<2> buffer;
+		SetupTriangles<2>(triangles, targetWidth, targetHeight, buffer);
+
+		// Depth is tested but not written, so every run shades the same pixels
+		const std::size_t nTriangles = buffer.count;
+		Measure(scalarName, "triangle", nTriangles, [&] {
+			for (std::size_t i = 0; i < nTriangles; i++) {
+				renderer.DrawTriangle<TexturedFragmentShader, DepthTestNoWrite, OpaqueBlend>(buffer.batches[i / setupBatchSize], i % setupBatchSize, uniforms);
+			}
+			sink = sink + renderer.colorBuffer[0];
+		});
+		Measure(sseName, "triangle", nTriangles, [&] {
+			for (std::size_t i = 0; i < nTriangles; i++) {
+				renderer.DrawTriangleSSE<TexturedFragmentShader, DepthTestNoWrite, OpaqueBlend>(buffer.batches[i / setupBatchSize], i % setupBatchSize, uniforms);
+			}
+			sink = sink + renderer.colorBuffer[0];
+		});
+	}
+}
+
+void Microbenchmarks::TextureSampling()
+{
+	constexpr int textureSize = 1024;
+	constexpr int nSamples = 1 << 20;
+	Texture texture(textureSize, textureSize);
+
+	// Texture coordinates of a screen sized grid of pixels mapping one to one to texels: row by row, rotated by
+	// 30 degrees (rows cut diagonally through the cache lines) and at random
+	std::vector<float> linearU(nSamples), linearV(nSamples), rotatedU(nSamples), rotatedV(nSamples), randomU(nSamples), randomV(nSamples);
+	const float angle = Radians(30.0f);
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	for (int i = 0; i < nSamples; i++) {
+		const float x = (i % textureSize + 0.5f) / textureSize;
+		const float y = (i / textureSize + 0.5f) / textureSize;
+		linearU[i] = x;
+		linearV[i] = y;
+		const float u = 0.5f + (x - 0.5f) * std::cos(angle) - (y - 0.5f) * std::sin(angle);
+		const float v = 0.5f + (x - 0.5f) * std::sin(angle) + (y - 0.5f) * std::cos(angle);
+		rotatedU[i] = u - std::floor(u);
+		rotatedV[i] = v - std::floor(v);
+		randomU[i] = unit(rng);
+		randomV[i] = unit(rng);
+	}
+
+	struct Pattern {
+		const char* name;
+		const std::vector<float>& u;
+		const std::vector<float>& v;
+	};
+	const Pattern patterns[] = { { "linear", linearU, linearV }, { "rotated", rotatedU, rotatedV }, { "random", randomU, randomV } };
+	for (const Pattern& pattern : patterns) {
+		Measure(std::string("texture/scalar/") + pattern.name, "sample", nSamples, [&] {
+			Color sum = 0;
+			for (int i = 0; i < nSamples; i++) {
+				sum += texture(pattern.u[i], pattern.v[i]);
+			}
+			sink = sink + sum;
+		});
+		Measure(std::string("texture/sample4/") + pattern.name, "sample", nSamples, [&] {
+			__m128i sum = _mm_setzero_si128();
+			for (int i = 0; i < nSamples; i += 4) {
+				sum = _mm_add_epi32(sum, SampleTexture4(texture, _mm_loadu_ps(&pattern.u[i]), _mm_loadu_ps(&pattern.v[i]), 0xF));
+			}
+			sink = sink + (std::uint32_t)_mm_cvtsi128_si32(sum);
+		});
+	}
+}
+
+void Microbenchmarks::Clipping()
+{
+	// Percentage of triangles with vertices behind the near plane, half of them with one and half with two
+	constexpr int crossingPercentages[] = { 0, 10, 50 };
+	constexpr std::size_t nTriangles = 4096;
+	const GuardBand guardBand(targetWidth / 2.0f, targetHeight / 2.0f);
+
+	for (int percentage : crossingPercentages) {
+		std::mt19937 rng(4);
+		std::uniform_int_distribution<int> percent(0, 99);
+		std::vector<Vec4> vertices;
+		std::vector<Face> faces;
+		for (std::size_t i = 0; i < nTriangles; i++) {
+			const bool crossing = percent(rng) < percentage;
+			const int nBehind = crossing ? 1 + (int)(i % 2) : 0;
+			const std::uint32_t first = (std::uint32_t)vertices.size();
+			for (int j = 0; j < 3; j++) {
+				vertices.push_back(RandomClipSpaceVertex(rng, j < nBehind));
+			}
+			faces.push_back({ first, first + 1, first + 2, 0 });
+		}
+		const std::vector<Varyings> varyings(vertices.size(), Varyings{});
+
+		Measure("clip/" + std::to_string(percentage) + "% near crossing", "triangle", nTriangles, [&] {
+			PipelineStats stats;
+			sink = sink + (std::uint32_t)ClipAndCull(faces, vertices, varyings, guardBand, stats).size();
+		});
+	}
+}
+
+void Microbenchmarks::VertexTransform()
+{
+	constexpr std::size_t nVertices = 1 << 16;
+	std::mt19937 rng(5);
+	std::uniform_real_distribution<float> coordinate(-1.0f, 1.0f);
+	std::vector<Vec3> vertices(nVertices);
+	for (Vec3& vertex : vertices) {
+		vertex = { coordinate(rng), coordinate(rng), coordinate(rng) };
+	}
+	std::vector<Vec4> clipSpace(nVertices);
+	const Mat4 mvp = Perspective(9.0f / 16.0f, Radians(90.0f), 0.1f, 100.0f) * Translation(0.0f, 0.0f, 5.0f) * Rotation(0.3f, 0.7f, 0.0f);
+
+	Measure("transform/mat4 scalar", "vertex", nVertices, [&] {
+		for (std::size_t i = 0; i < nVertices; i++) {
+			clipSpace[i] = mvp * ToHomogenous(vertices[i], 1.0f);
+		}
+		sink = sink + (std::uint32_t)clipSpace[nVertices / 2].w;
+	});
+
+	// Four vertices at a time like ProcessVertices4: gathered to SoA, transformed, transposed back
+	const SimdMat4 simdMvp(mvp);
+	Measure("transform/mat4 simd4", "vertex", nVertices, [&] {
+		for (std::size_t i = 0; i < nVertices; i += 4) {
+			const Vec3* v = &vertices[i];
+			const __m128 x = _mm_set_ps(v[3].x, v[2].x, v[1].x, v[0].x);
+			const __m128 y = _mm_set_ps(v[3].y, v[2].y, v[1].y, v[0].y);
+			const __m128 z = _mm_set_ps(v[3].z, v[2].z, v[1].z, v[0].z);
+			__m128 clip[4];
+			for (int r = 0; r < 4; r++) {
+				clip[r] = simdMvp.Row(r, x, y, z);
+			}
+			_MM_TRANSPOSE4_PS(clip[0], clip[1], clip[2], clip[3]);
+			for (int j = 0; j < 4; j++) {
+				_mm_storeu_ps(&clipSpace[i + j].x, clip[j]);
+			}
+		}
+		sink = sink + (std::uint32_t)clipSpace[nVertices / 2].w;
+	});
+}
+
+bool Microbenchmarks::WriteJson(const char* path) const
+{
+	FILE* file = std::fopen(path, "w");
+	if (!file) {
+		return false;
+	}
+	std::fprintf(file, "{\n  \"warmupRuns\": %d,\n  \"runs\": %d,\n  \"benchmarks\": [", options.warmupRuns, options.runs);
+	for (std::size_t i = 0; i < results.size(); i++) {
+		const Result& result = results[i];
+		std::fprintf(file, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"items\": %zu, \"medianNs\": %.4f, \"madNs\": %.4f}",
+			i == 0 ? "" : ",", result.name.c_str(), result.unit, result.items, result.medianNs, result.madNs);
+	}
+	std::fprintf(file, "\n  ]\n}\n");
+	return std::fclose(file) == 0;
+}
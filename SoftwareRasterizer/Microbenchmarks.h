@@ -0,0 +1,51 @@
+#ifndef MICROBENCHMARKS_H
+#define MICROBENCHMARKS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Times the building blocks of the pipeline in isolation on synthetic inputs of controlled sizes and distributions:
+// triangle setup, the scalar and SSE raster kernels on tiny, medium and huge triangles, texture sampling with
+// linear, rotated and random access, ClipAndCull with different shares of triangles crossing the near plane and
+// the vertex transform. Every benchmark is warmed up, then repeated, and reports the median time per item and the
+// median absolute deviation (MAD) of the repetitions.
+struct MicrobenchmarkOptions {
+	int warmupRuns = 3;
+	int runs = 21;
+	const char* filter = nullptr;	// Only benchmarks whose names contain this
+	const char* jsonPath = nullptr;	// Also writes the results there, to be diffed across commits
+};
+
+class Microbenchmarks {
+public:
+	explicit Microbenchmarks(const MicrobenchmarkOptions& options) : options(options) {}
+	// Returns false if the results couldn't be written
+	bool Run();
+private:
+	struct Result {
+		std::string name;
+		const char* unit;		// What an item is
+		std::size_t items;		// Per run
+		double medianNs;		// Per item
+		double madNs;
+	};
+
+	bool IsSelected(const std::string& name) const;
+	// run() processes the given number of items once
+	template<typename F>
+	void Measure(const std::string& name, const char* unit, std::size_t items, F&& run);
+
+	void TriangleSetup();
+	void Rasterization();
+	void TextureSampling();
+	void Clipping();
+	void VertexTransform();
+
+	bool WriteJson(const char* path) const;
+private:
+	MicrobenchmarkOptions options;
+	std::vector<Result> results;
+};
+
+#endif // !MICROBENCHMARKS_H
@@ -3,59 +3,211 @@
 #include "Clipping.h"
 
 #include <algorithm>
+#include <cfloat>
 #include <charconv>
 #include <fstream>
 #include <string>
+#include <unordered_map>
+
+namespace {
+	std::shared_ptr<const Texture> LoadTexture(const char* path)
+	{
+		auto texture = textureFromFile(path);
+		return texture ? std::make_shared<const Texture>(*texture) : placeholderTexture();
+	}
+}
 
 Model::Model(const char* meshPath, const char* texturePath)
-	:texture(*textureFromFile(texturePath))
+	: Model(meshPath, LoadTexture(texturePath))
+{
+}
+
+Model::Model(const char* meshPath, std::shared_ptr<const Texture> texture)
+	: texture(std::move(texture))
 {
-	std::vector<Vec2> textureCoords;
+	std::vector<Vec3> positions;
+	std::vector<Vec2> fileTextureCoords;
+	std::vector<Vec3> fileNormals;
+
+	// OBJ indexes positions, texture coordinates and normals separately. Every unique combination becomes one vertex
+	// so that all attributes can be indexed by the same face indices. Faces without normals get smooth normals below.
+	struct VertexKey {
+		int position, uv, normal;
+		bool operator==(const VertexKey& rhs) const { return position == rhs.position && uv == rhs.uv && normal == rhs.normal; }
+	};
+	struct VertexKeyHash {
+		std::size_t operator()(const VertexKey& key) const {
+			return std::hash<std::uint64_t>()(((std::uint64_t)key.position << 32) ^ ((std::uint64_t)key.uv << 16) ^ (std::uint32_t)key.normal);
+		}
+	};
+	std::unordered_map<VertexKey, std::uint32_t, VertexKeyHash> vertexIndices;
+	bool hasAllNormals = true;
+	auto getVertex = [&](int positionIndex, int uvIndex, int normalIndex) {
+		// Indices in obj file are 1-based, adjust to 0-based indices. A normal index of 0 means the face has no normals.
+		positionIndex--;
+		uvIndex--;
+		normalIndex--;
+		auto [it, inserted] = vertexIndices.try_emplace({ positionIndex, uvIndex, normalIndex }, (std::uint32_t)vertices.size());
+		if (inserted) {
+			vertices.push_back(positions[positionIndex]);
+			Vec2 uv = fileTextureCoords[uvIndex];
+			uv.y = 1.0f - uv.y; // Adjust so (0, 0) is at top left and (1, 1) at bottom right for tex coords
+			textureCoords.push_back(uv);
+			if (normalIndex >= 0) {
+				normals.push_back(Normalize(fileNormals[normalIndex]));
+			}
+			else {
+				normals.push_back({ 0, 0, 0 });
+				hasAllNormals = false;
+			}
+		}
+		return it->second;
+	};
+
 	std::ifstream file(meshPath);
 	std::string line;
 	while (std::getline(file, line)) {
 		if (line[0] == 'v') {
 			if (line[1] == ' ') { 
-				vertices.push_back(Vec3());
-				Vec3& vertex = vertices.back();
+				positions.push_back(Vec3());
+				Vec3& vertex = positions.back();
 				auto last = line.c_str() + line.size();
 				auto result = std::from_chars(line.c_str() + 2, last, vertex.x);
 				result = std::from_chars(result.ptr + 1, last, vertex.y);
 				result = std::from_chars(result.ptr + 1, last, vertex.z);
 			}
 			else if (line[1] == 't') {
-				textureCoords.push_back(Vec2());
-				Vec2& coord = textureCoords.back();
+				fileTextureCoords.push_back(Vec2());
+				Vec2& coord = fileTextureCoords.back();
 				auto last = line.c_str() + line.size();
 				auto result = std::from_chars(line.c_str() + 3, last, coord.u);
 				result = std::from_chars(result.ptr + 1, last, coord.v);
 			}
+			else if (line[1] == 'n') {
+				fileNormals.push_back(Vec3());
+				Vec3& normal = fileNormals.back();
+				auto last = line.c_str() + line.size();
+				auto result = std::from_chars(line.c_str() + 3, last, normal.x);
+				result = std::from_chars(result.ptr + 1, last, normal.y);
+				result = std::from_chars(result.ptr + 1, last, normal.z);
+			}
 		}
 		else if (line[0] == 'f') {
-			faces.push_back(Face());
-			Face& face = faces.back();
-			int aUVIndex, bUVIndex, cUVIndex;
+			// Each corner is position/uv or position/uv/normal
 			const auto start = line.c_str();
 			auto last = start + line.size();
-			auto result = std::from_chars(start + 2, last, face.a);
-			result = std::from_chars(result.ptr + 1, last, aUVIndex);
-			// Skip normals
-			result = std::from_chars(start + line.find_first_of(' ', result.ptr - start) + 1, last, face.b);
-			result = std::from_chars(result.ptr + 1, last, bUVIndex);
-			result = std::from_chars(start + line.find_first_of(' ', result.ptr - start) + 1, last, face.c);
-			result = std::from_chars(result.ptr + 1, last, cUVIndex);
-			// Indices in obj file are 1-based, adjust to 0-based indices
-			face.a--;
-			face.b--;
-			face.c--;
-			face.aUV = textureCoords[aUVIndex - 1];
-			face.bUV = textureCoords[bUVIndex - 1];
-			face.cUV = textureCoords[cUVIndex - 1];
-			face.aUV.y = 1.0f - face.aUV.y; // Adjust so (0, 0) is at top left and (1, 1) at bottom right for tex coords
-			face.bUV.y = 1.0f - face.bUV.y;
-			face.cUV.y = 1.0f - face.cUV.y;
+			auto ptr = start + 1;
+			int corners[3][3] = {};
+			for (auto& corner : corners) {
+				auto result = std::from_chars(ptr + 1, last, corner[0]);
+				result = std::from_chars(result.ptr + 1, last, corner[1]);
+				if (result.ptr < last && *result.ptr == '/') {
+					result = std::from_chars(result.ptr + 1, last, corner[2]);
+				}
+				ptr = result.ptr;
+			}
+
+			Face face;
+			face.a = getVertex(corners[0][0], corners[0][1], corners[0][2]);
+			face.b = getVertex(corners[1][0], corners[1][1], corners[1][2]);
+			face.c = getVertex(corners[2][0], corners[2][1], corners[2][2]);
 			face.color = 0xFFFFFFFF;
+			faces.push_back(face);
 		}
 	}
+
+	if (!hasAllNormals) {
+		// Smooth vertex normals for the vertices that have none: sum of the normals of the adjacent faces, weighted by
+		// area (the length of the cross product)
+		std::vector<Vec3> smoothNormals(vertices.size(), Vec3{ 0, 0, 0 });
+		for (const Face& face : faces) {
+			const Vec3& a = vertices[face.a];
+			const Vec3& b = vertices[face.b];
+			const Vec3& c = vertices[face.c];
+			const Vec3 n = Cross(b - a, c - b);
+			smoothNormals[face.a] += n;
+			smoothNormals[face.b] += n;
+			smoothNormals[face.c] += n;
+		}
+		for (std::size_t i = 0; i < vertices.size(); i++) {
+			if (normals[i].x == 0.0f && normals[i].y == 0.0f && normals[i].z == 0.0f) {
+				const float length = smoothNormals[i].length();
+				normals[i] = length > 0.0f ? smoothNormals[i] / length : Vec3{ 0, 0, 1 };
+			}
+		}
+	}
+
+	meshlets = BuildMeshlets(vertices, faces, meshletVertices);
+
+	// Bounding sphere centered on the AABB
+	Vec3 min = vertices.empty() ? Vec3{ 0, 0, 0 } : vertices[0];
+	Vec3 max = min;
+	for (const Vec3& v : vertices) {
+		min = { std::min(min.x, v.x), std::min(min.y, v.y), std::min(min.z, v.z) };
+		max = { std::max(max.x, v.x), std::max(max.y, v.y), std::max(max.z, v.z) };
+	}
+	boundsCenter = (min + max) * 0.5f;
+	boundsRadius = 0.0f;
+	for (const Vec3& v : vertices) {
+		boundsRadius = std::max(boundsRadius, (v - boundsCenter).length());
+	}
+}
+
+void Model::AdoptMesh(Model&& loaded)
+{
+	vertices = std::move(loaded.vertices);
+	textureCoords = std::move(loaded.textureCoords);
+	normals = std::move(loaded.normals);
+	faces = std::move(loaded.faces);
+	meshlets = std::move(loaded.meshlets);
+	meshletVertices = std::move(loaded.meshletVertices);
+	boundsCenter = loaded.boundsCenter;
+	boundsRadius = loaded.boundsRadius;
 }
 
+void Model::ReleaseMesh()
+{
+	// Swapped out rather than cleared, which would keep the capacity
+	std::vector<Vec3>().swap(vertices);
+	std::vector<Vec2>().swap(textureCoords);
+	std::vector<Vec3>().swap(normals);
+	std::vector<Face>().swap(faces);
+	std::vector<Meshlet>().swap(meshlets);
+	std::vector<std::uint32_t>().swap(meshletVertices);
+}
+
+std::size_t Model::MeshBytes() const
+{
+	return vertices.capacity() * sizeof(Vec3) + textureCoords.capacity() * sizeof(Vec2) + normals.capacity() * sizeof(Vec3) +
+		faces.capacity() * sizeof(Face) + meshlets.capacity() * sizeof(Meshlet) + meshletVertices.capacity() * sizeof(std::uint32_t);
+}
+
+bool Model::ReadBounds(const char* meshPath, Vec3& center, float& radius)
+{
+	std::ifstream file(meshPath);
+	if (!file) {
+		return false;
+	}
+	Vec3 min = { FLT_MAX, FLT_MAX, FLT_MAX };
+	Vec3 max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.size() > 1 && line[0] == 'v' && line[1] == ' ') {
+			Vec3 vertex;
+			auto last = line.c_str() + line.size();
+			auto result = std::from_chars(line.c_str() + 2, last, vertex.x);
+			result = std::from_chars(result.ptr + 1, last, vertex.y);
+			result = std::from_chars(result.ptr + 1, last, vertex.z);
+			min = { std::min(min.x, vertex.x), std::min(min.y, vertex.y), std::min(min.z, vertex.z) };
+			max = { std::max(max.x, vertex.x), std::max(max.y, vertex.y), std::max(max.z, vertex.z) };
+		}
+	}
+	if (min.x > max.x) {
+		center = { 0, 0, 0 };
+		radius = 0.0f;
+		return true;
+	}
+	center = (min + max) * 0.5f;
+	radius = (max - center).length();
+	return true;
+}
@@ -1,20 +1,46 @@
 #ifndef MODEL_H
 #define MODEL_H
 
+#include <memory>
 #include <vector>
 #include "Vector.h"
 #include "Texture.h"
 #include "Triangle.h"
 #include "Matrix.h"
+#include "Meshlet.h"
+#include "Shader.h"
 
 struct Model {
 	std::vector<Vec3> vertices;
+	std::vector<Vec2> textureCoords;	// Per vertex
+	std::vector<Vec3> normals;			// Per vertex, normalized
 	std::vector<Face> faces;
-	Texture texture;
+	std::vector<Meshlet> meshlets;
+	std::vector<std::uint32_t> meshletVertices;
+	// Bounding sphere in model space
+	Vec3 boundsCenter;
+	float boundsRadius;
+	std::shared_ptr<const Texture> texture;	// Can be shared by models
 	Vec3 scale = { 1, 1, 1 };
 	Vec3 rotation = { 0, 0, 0 };
 	Vec3 position = { 0, 0, 0 };
+	ShadingModel shading = ShadingModel::Unlit;
+	Blending blending = Blending::Opaque;
+	// A texture that fails to load is replaced by the placeholder
 	Model(const char* meshPath, const char* texturePath);
+	Model(const char* meshPath, std::shared_ptr<const Texture> texture);
+	// No geometry until AdoptMesh, draws nothing
+	explicit Model(std::shared_ptr<const Texture> texture) : boundsCenter{ 0, 0, 0 }, boundsRadius(0.0f), texture(std::move(texture)) {}
+
+	// Takes the geometry and bounds of loaded, keeping the texture, transform and material
+	void AdoptMesh(Model&& loaded);
+	// Frees the geometry, the bounds are kept
+	void ReleaseMesh();
+	std::size_t MeshBytes() const;
+
+	// Bounding sphere of an OBJ file's vertices from a pass over their positions only, without loading the mesh. The
+	// radius is that of the sphere around the bounding box, never smaller than the loaded model's.
+	static bool ReadBounds(const char* meshPath, Vec3& center, float& radius);
 };
 
 
@@ -0,0 +1,160 @@
+#include "PerfCounters.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	constexpr const char* counterNames[PERF_COUNTER_COUNT] = { "cycles", "instructions", "L1D misses", "LLC misses", "branch misses" };
+
+	std::atomic<bool> enabled{ false };
+}
+
+#ifdef __linux__
+
+namespace {
+	struct CounterConfig {
+		std::uint32_t type;
+		std::uint64_t config;
+	};
+
+	constexpr CounterConfig counterConfigs[PERF_COUNTER_COUNT] = {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	};
+
+	// One group per thread, led by the cycle counter, so that a single read returns all counters and they are
+	// always scheduled together
+	struct ThreadCounters {
+		int fds[PERF_COUNTER_COUNT];
+		int order[PERF_COUNTER_COUNT];	// Counter of each value in a group read, in the order they were added
+		int nOpen = 0;
+		std::uint32_t available = 0;
+		bool opened = false;
+
+		ThreadCounters() { std::fill(std::begin(fds), std::end(fds), -1); }
+		~ThreadCounters() {
+			for (int fd : fds) {
+				if (fd != -1) {
+					close(fd);
+				}
+			}
+		}
+
+		// Returns errno of the cycle counter's open, 0 on success
+		int Open() {
+			opened = true;
+			for (int counter = 0; counter < PERF_COUNTER_COUNT; counter++) {
+				perf_event_attr attr;
+				std::memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = counterConfigs[counter].type;
+				attr.config = counterConfigs[counter].config;
+				attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+				// User space only, which is all perf_event_paranoid 2 allows
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				const int leader = nOpen > 0 ? fds[PERF_CYCLES] : -1;
+				const int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+				if (fd == -1) {
+					if (counter == PERF_CYCLES) {
+						return errno;
+					}
+					continue;
+				}
+				fds[counter] = fd;
+				order[nOpen++] = counter;
+				available |= 1u << counter;
+			}
+			return 0;
+		}
+
+		bool Read(PerfCounterValues& out) {
+			// nr, time enabled, time running, one value per counter
+			std::uint64_t buffer[3 + PERF_COUNTER_COUNT];
+			if (read(fds[PERF_CYCLES], buffer, sizeof(buffer)) < (ssize_t)((3 + nOpen) * sizeof(std::uint64_t))) {
+				return false;
+			}
+			const std::uint64_t timeEnabled = buffer[1];
+			const std::uint64_t timeRunning = buffer[2];
+			const double scale = timeRunning > 0 && timeRunning < timeEnabled ? (double)timeEnabled / timeRunning : 1.0;
+			for (int i = 0; i < nOpen; i++) {
+				out.values[order[i]] = scale == 1.0 ? buffer[3 + i] : (std::uint64_t)(buffer[3 + i] * scale);
+			}
+			out.available = available;
+			return true;
+		}
+	};
+
+	thread_local ThreadCounters threadCounters;
+}
+
+bool PerfCounters::Enable()
+{
+	if (!threadCounters.opened) {
+		if (const int error = threadCounters.Open()) {
+			std::cerr << "Hardware performance counters are unavailable: " << std::strerror(error) << ".\n";
+			if (error == EACCES || error == EPERM) {
+				std::cerr << "Lowering /proc/sys/kernel/perf_event_paranoid to 2 or less allows counting user space.\n";
+			}
+			return false;
+		}
+	}
+	if (threadCounters.fds[PERF_CYCLES] == -1) {
+		return false;
+	}
+	enabled = true;
+	return true;
+}
+
+bool PerfCounters::Read(PerfCounterValues& out)
+{
+	if (!enabled.load(std::memory_order_relaxed)) {
+		return false;
+	}
+	if (!threadCounters.opened) {
+		threadCounters.Open();
+	}
+	return threadCounters.fds[PERF_CYCLES] != -1 && threadCounters.Read(out);
+}
+
+#else
+
+bool PerfCounters::Enable()
+{
+	std::cerr << "Hardware performance counters are only supported on Linux.\n";
+	return false;
+}
+
+bool PerfCounters::Read(PerfCounterValues&)
+{
+	return false;
+}
+
+#endif // __linux__
+
+void PerfCounters::Disable()
+{
+	enabled = false;
+}
+
+bool PerfCounters::IsEnabled()
+{
+	return enabled.load(std::memory_order_relaxed);
+}
+
+const char* PerfCounters::Name(int counter)
+{
+	return counterNames[counter];
+}
@@ -0,0 +1,50 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+
+// Hardware performance counters of the calling thread, read through perf_event_open on Linux. Counting is off
+// until Enable() succeeds, which it doesn't on other platforms, without a PMU (some virtual machines) or when
+// kernel.perf_event_paranoid forbids it. Counters the CPU doesn't have are left out and marked as unavailable.
+enum PerfCounter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_MISSES,	// L1 data cache read misses
+	PERF_LLC_MISSES,	// Last level cache misses
+	PERF_BRANCH_MISSES,
+	PERF_COUNTER_COUNT
+};
+
+struct PerfCounterValues {
+	std::uint64_t values[PERF_COUNTER_COUNT] = {};
+	std::uint32_t available = 0;	// Bit i set if values[i] was counted
+
+	bool IsAvailable(int counter) const { return (available >> counter) & 1; }
+};
+
+class PerfCounters {
+public:
+	// Opens the counters for the calling thread, other threads open theirs on their first Read. Prints why and
+	// returns false if they can't be used.
+	static bool Enable();
+	static void Disable();
+	static bool IsEnabled();
+
+	// Counts of the calling thread since its counters were opened, scaled up if the kernel had to multiplex them.
+	// Returns false if counting is off or the thread's counters couldn't be opened.
+	static bool Read(PerfCounterValues& out);
+
+	static const char* Name(int counter);
+};
+
+// Counts between two reads
+inline PerfCounterValues operator-(const PerfCounterValues& end, const PerfCounterValues& start) {
+	PerfCounterValues delta;
+	delta.available = end.available & start.available;
+	for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+		delta.values[i] = delta.IsAvailable(i) ? end.values[i] - start.values[i] : 0;
+	}
+	return delta;
+}
+
+#endif // !PERF_COUNTERS_H
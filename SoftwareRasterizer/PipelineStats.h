@@ -0,0 +1,60 @@
+#ifndef PIPELINE_STATS_H
+#define PIPELINE_STATS_H
+
+#include <cstdint>
+#include <ostream>
+
+// Counters for every stage of the pipeline, like a GPU's pipeline statistics queries. Each thread counts into
+// its own copy (padded to a cache line so threads don't share lines), hot loops count into locals and add them
+// once per triangle or batch, and the copies are summed when the stats are read.
+struct alignas(64) PipelineStats {
+	// Geometry
+	std::uint64_t inputTriangles = 0;		// Faces of all drawn models
+	std::uint64_t meshletCulled = 0;		// In meshlets outside the frustum or facing away
+	std::uint64_t backFacingCulled = 0;
+	std::uint64_t frustumCulled = 0;		// All vertices outside the same frustum plane
+	std::uint64_t nearClipped1To1 = 0;		// Two vertices behind the near plane, clipped to one triangle
+	std::uint64_t nearClipped1To2 = 0;		// One vertex behind the near plane, clipped to two triangles
+	std::uint64_t guardBandClipped = 0;		// Clipped to the guard band (and near plane) as a polygon
+	std::uint64_t setupCulled = 0;			// Zero area, back facing or off screen after projection
+	std::uint64_t rasterized = 0;
+
+	// Pixels (samples are not counted separately with multisampling)
+	std::uint64_t pixelsTested = 0;			// Covered by a triangle and depth tested
+	std::uint64_t depthPassed = 0;
+	std::uint64_t pixelsWritten = 0;		// Color writes
+
+	PipelineStats& operator+=(const PipelineStats& rhs) {
+		inputTriangles += rhs.inputTriangles;
+		meshletCulled += rhs.meshletCulled;
+		backFacingCulled += rhs.backFacingCulled;
+		frustumCulled += rhs.frustumCulled;
+		nearClipped1To1 += rhs.nearClipped1To1;
+		nearClipped1To2 += rhs.nearClipped1To2;
+		guardBandClipped += rhs.guardBandClipped;
+		setupCulled += rhs.setupCulled;
+		rasterized += rhs.rasterized;
+		pixelsTested += rhs.pixelsTested;
+		depthPassed += rhs.depthPassed;
+		pixelsWritten += rhs.pixelsWritten;
+		return *this;
+	}
+};
+
+inline std::ostream& operator<<(std::ostream& os, const PipelineStats& stats) {
+	return os <<
+		"Input triangles:     " << stats.inputTriangles << '\n' <<
+		"Meshlet culled:      " << stats.meshletCulled << '\n' <<
+		"Back facing culled:  " << stats.backFacingCulled << '\n' <<
+		"Frustum culled:      " << stats.frustumCulled << '\n' <<
+		"Near clipped 1 -> 1: " << stats.nearClipped1To1 << '\n' <<
+		"Near clipped 1 -> 2: " << stats.nearClipped1To2 << '\n' <<
+		"Guard band clipped:  " << stats.guardBandClipped << '\n' <<
+		"Setup culled:        " << stats.setupCulled << '\n' <<
+		"Rasterized:          " << stats.rasterized << '\n' <<
+		"Pixels tested:       " << stats.pixelsTested << '\n' <<
+		"Depth passed:        " << stats.depthPassed << '\n' <<
+		"Pixels written:      " << stats.pixelsWritten << '\n';
+}
+
+#endif // !PIPELINE_STATS_H
@@ -0,0 +1,219 @@
+#include "Profiler.h"
+
+#ifdef ENABLE_PROFILER
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+	// Events of one thread. Only the owning thread writes, so recording is a plain store and a release increment.
+	struct ThreadEvents {
+		ProfileEvent events[Profiler::eventsPerThread];
+		std::atomic<std::uint64_t> head{ 0 };	// Total number of events recorded
+		std::uint32_t threadIndex;
+	};
+
+	const auto startTime = std::chrono::steady_clock::now();
+	std::atomic<std::uint32_t> currentFrame{ 0 };
+	std::uint32_t lastSummaryFrame = 0;
+
+	// Buffers live as long as the program, threads only register once
+	std::mutex threadsMutex;
+	std::vector<std::unique_ptr<ThreadEvents>> threads;
+	thread_local ThreadEvents* threadEvents = nullptr;
+
+	ThreadEvents& RegisterThread()
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		threads.push_back(std::make_unique<ThreadEvents>());
+		threads.back()->threadIndex = (std::uint32_t)(threads.size() - 1);
+		return *threads.back();
+	}
+
+	// Calls f(threadIndex, event) for every event still in the ring buffers
+	template<typename F>
+	void ForEachEvent(F&& f)
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		for (const auto& thread : threads) {
+			const std::uint64_t head = thread->head.load(std::memory_order_acquire);
+			const std::uint64_t first = head > Profiler::eventsPerThread ? head - Profiler::eventsPerThread : 0;
+			for (std::uint64_t i = first; i < head; i++) {
+				f(thread->threadIndex, thread->events[i & (Profiler::eventsPerThread - 1)]);
+			}
+		}
+	}
+
+	struct StageTotal {
+		const char* name;
+		std::uint64_t duration = 0;
+		std::uint64_t calls = 0;
+		PerfCounterValues counters;
+	};
+
+	// Totals of all frames that were summarized so far
+	std::vector<StageTotal> runTotals;
+	std::uint32_t runFrames = 0;
+
+	StageTotal& FindStage(std::vector<StageTotal>& totals, const char* name)
+	{
+		// The same literal can have different addresses in different translation units
+		auto total = std::find_if(totals.begin(), totals.end(), [&](const StageTotal& t) { return std::strcmp(t.name, name) == 0; });
+		if (total == totals.end()) {
+			totals.push_back({ name, 0, 0, {} });
+			return totals.back();
+		}
+		return *total;
+	}
+
+	void AddCounters(PerfCounterValues& total, const PerfCounterValues& counters)
+	{
+		for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+			total.values[i] += counters.values[i];
+		}
+		total.available |= counters.available;
+	}
+
+	std::vector<StageTotal> CollectTotals(std::uint32_t firstFrame, std::uint32_t endFrame)
+	{
+		std::vector<StageTotal> totals;
+		ForEachEvent([&](std::uint32_t, const ProfileEvent& event) {
+			if (event.frame < firstFrame || event.frame >= endFrame) {
+				return;
+			}
+			StageTotal& total = FindStage(totals, event.name);
+			total.duration += event.duration;
+			total.calls++;
+			AddCounters(total.counters, event.counters);
+		});
+		return totals;
+	}
+
+	void AddToRunTotals(const std::vector<StageTotal>& totals, std::uint32_t frames)
+	{
+		for (const StageTotal& total : totals) {
+			StageTotal& runTotal = FindStage(runTotals, total.name);
+			runTotal.duration += total.duration;
+			runTotal.calls += total.calls;
+			AddCounters(runTotal.counters, total.counters);
+		}
+		runFrames += frames;
+	}
+
+	void PrintTotals(const std::vector<StageTotal>& totals, double frames)
+	{
+		// Stages that run on several threads add up the time and counts of all of them. Summaries go to stderr, stdout
+		// may be carrying a frame capture (see FrameCapture)
+		for (const StageTotal& total : totals) {
+			std::fprintf(stderr, "  %-24s %8.3f ms %8.1f calls", total.name, total.duration / frames * 1e-6, total.calls / frames);
+			const PerfCounterValues& counters = total.counters;
+			if (counters.IsAvailable(PERF_CYCLES)) {
+				const double cycles = (double)counters.values[PERF_CYCLES];
+				std::fprintf(stderr, " %9.3f Mcycles", cycles / frames * 1e-6);
+				if (counters.IsAvailable(PERF_INSTRUCTIONS) && cycles > 0) {
+					std::fprintf(stderr, " %5.2f IPC", counters.values[PERF_INSTRUCTIONS] / cycles);
+				}
+				for (int i = PERF_L1D_MISSES; i < PERF_COUNTER_COUNT; i++) {
+					if (counters.IsAvailable(i)) {
+						std::fprintf(stderr, " %9.1fk %s", counters.values[i] / frames * 1e-3, PerfCounters::Name(i));
+					}
+				}
+			}
+			std::fprintf(stderr, "\n");
+		}
+		std::fflush(stderr);
+	}
+}
+
+std::uint64_t Profiler::Now()
+{
+	return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void Profiler::Record(const char* name, std::uint64_t start, std::uint64_t end, const PerfCounterValues* startCounters)
+{
+	PerfCounterValues counters;
+	if (startCounters && PerfCounters::Read(counters)) {
+		counters = counters - *startCounters;
+	}
+	else {
+		counters = PerfCounterValues();
+	}
+
+	if (!threadEvents) {
+		threadEvents = &RegisterThread();
+	}
+	const std::uint64_t head = threadEvents->head.load(std::memory_order_relaxed);
+	threadEvents->events[head & (eventsPerThread - 1)] = { name, start, end - start, currentFrame.load(std::memory_order_relaxed), counters };
+	threadEvents->head.store(head + 1, std::memory_order_release);
+}
+
+void Profiler::EndFrame()
+{
+	const std::uint32_t frame = currentFrame.fetch_add(1) + 1;
+	if (frame - lastSummaryFrame >= summaryInterval) {
+		const auto totals = CollectTotals(lastSummaryFrame, frame);
+		std::fprintf(stderr, "Frames %u-%u, per frame:\n", lastSummaryFrame, frame - 1);
+		PrintTotals(totals, frame - lastSummaryFrame);
+		AddToRunTotals(totals, frame - lastSummaryFrame);
+		lastSummaryFrame = frame;
+	}
+}
+
+void Profiler::PrintRunSummary()
+{
+	// Frames since the last summary haven't been added yet
+	const std::uint32_t frame = currentFrame.load();
+	if (frame > lastSummaryFrame) {
+		AddToRunTotals(CollectTotals(lastSummaryFrame, frame), frame - lastSummaryFrame);
+		lastSummaryFrame = frame;
+	}
+	if (runFrames == 0) {
+		return;
+	}
+	std::fprintf(stderr, "Run of %u frames, per frame:\n", runFrames);
+	PrintTotals(runTotals, runFrames);
+}
+
+bool Profiler::WriteChromeTrace(const char* path)
+{
+	FILE* file = std::fopen(path, "w");
+	if (!file) {
+		std::cerr << "Error opening " << path << " for the trace.\n";
+		return false;
+	}
+
+	// Complete ("X") events with microsecond timestamps, one track per thread
+	std::fprintf(file, "{\"traceEvents\":[\n");
+	bool first = true;
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		for (const auto& thread : threads) {
+			std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"Thread %u\"}}",
+				first ? "" : ",\n", thread->threadIndex, thread->threadIndex);
+			first = false;
+		}
+	}
+	ForEachEvent([&](std::uint32_t threadIndex, const ProfileEvent& event) {
+		std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u",
+			first ? "" : ",\n", event.name, threadIndex, event.start * 1e-3, event.duration * 1e-3, event.frame);
+		for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+			if (event.counters.IsAvailable(i)) {
+				std::fprintf(file, ",\"%s\":%llu", PerfCounters::Name(i), (unsigned long long)event.counters.values[i]);
+			}
+		}
+		std::fprintf(file, "}}");
+		first = false;
+	});
+	std::fprintf(file, "\n]}\n");
+	std::fclose(file);
+	return true;
+}
+
+#endif // ENABLE_PROFILER
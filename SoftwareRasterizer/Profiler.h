@@ -0,0 +1,79 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Scoped timers for the pipeline stages. They are only built with ENABLE_PROFILER defined, otherwise the macros
+// below expand to nothing and the profiler costs nothing.
+//   PROFILE_SCOPE("Name")		Times the rest of the enclosing scope. The name must be a string literal, only the pointer is kept.
+//   PROFILE_END_FRAME()		Marks the end of a frame. Prints the average time per frame of every stage to stderr
+//								every Profiler::summaryInterval frames.
+//   PROFILE_WRITE_TRACE(path)	Writes the recorded events as Chrome trace_event JSON (open in chrome://tracing or Perfetto).
+//   PROFILE_ENABLE_HARDWARE_COUNTERS()
+//								Also counts cycles, instructions, cache and branch misses in every scope (see PerfCounters.h).
+//								Returns false, and scopes are only timed, if the counters are unavailable. Has no value
+//								without ENABLE_PROFILER, like the other macros it is then a statement that does nothing.
+//   PROFILE_PRINT_RUN_SUMMARY()	Prints the per frame averages over all frames so far to stderr, e.g. at the end of a benchmark.
+//
+// Every thread records into its own ring buffer, so recording takes no locks and the oldest events are overwritten
+// once a buffer is full. Summaries and traces read the buffers of all threads and should be made between frames,
+// while no stage is running.
+
+#ifdef ENABLE_PROFILER
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "PerfCounters.h"
+
+struct ProfileEvent {
+	const char* name;
+	std::uint64_t start;	// Nanoseconds since the profiler started
+	std::uint64_t duration;
+	std::uint32_t frame;
+	PerfCounterValues counters;	// Counted during the scope, none available unless hardware counters are enabled
+};
+
+class Profiler {
+public:
+	static constexpr std::size_t eventsPerThread = 1 << 14;	// Power of two
+	static constexpr std::uint32_t summaryInterval = 60;
+
+	static std::uint64_t Now();
+	// startCounters is null if the counters weren't read at the start of the scope
+	static void Record(const char* name, std::uint64_t start, std::uint64_t end, const PerfCounterValues* startCounters);
+	static void EndFrame();
+	static bool WriteChromeTrace(const char* path);
+	static void PrintRunSummary();
+};
+
+class ProfileScope {
+public:
+	explicit ProfileScope(const char* name) : name(name), hasCounters(PerfCounters::Read(startCounters)), start(Profiler::Now()) {}
+	~ProfileScope() { Profiler::Record(name, start, Profiler::Now(), hasCounters ? &startCounters : nullptr); }
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+private:
+	const char* name;
+	PerfCounterValues startCounters;
+	bool hasCounters;
+	std::uint64_t start;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_END_FRAME() Profiler::EndFrame()
+#define PROFILE_WRITE_TRACE(path) Profiler::WriteChromeTrace(path)
+#define PROFILE_ENABLE_HARDWARE_COUNTERS() PerfCounters::Enable()
+#define PROFILE_PRINT_RUN_SUMMARY() Profiler::PrintRunSummary()
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILE_END_FRAME()
+#define PROFILE_WRITE_TRACE(path)
+#define PROFILE_ENABLE_HARDWARE_COUNTERS() ((void)0)
+#define PROFILE_PRINT_RUN_SUMMARY()
+
+#endif // ENABLE_PROFILER
+
+#endif // !PROFILER_H
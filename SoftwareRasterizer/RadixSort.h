@@ -0,0 +1,65 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+struct SortItem {
+	std::uint32_t key;
+	std::uint32_t value;
+};
+
+// Sort key of a depth such that smaller depths get smaller keys. The bit pattern of a non-negative float grows
+// with its value, so no range has to be known up front. Negative depths (behind the camera) all map to 0.
+inline std::uint32_t DepthSortKey(float depth) {
+	if (!(depth > 0.0f)) {
+		return 0;
+	}
+	std::uint32_t bits;
+	std::memcpy(&bits, &depth, sizeof(bits));
+	return bits;
+}
+
+// Stable LSD radix sort by key, 8 bits per pass. Passes in which all keys share the same digit are skipped,
+// which is common for depth keys (the exponent bits rarely differ much within a scene).
+// scratch is resized as needed and can be reused across calls.
+inline void RadixSort(std::vector<SortItem>& items, std::vector<SortItem>& scratch)
+{
+	const std::size_t count = items.size();
+	if (count < 2) {
+		return;
+	}
+
+	// All four histograms in one pass over the keys
+	std::uint32_t histograms[4][256] = {};
+	for (const SortItem& item : items) {
+		for (int digit = 0; digit < 4; digit++) {
+			histograms[digit][(item.key >> (digit * 8)) & 0xFF]++;
+		}
+	}
+
+	scratch.resize(count);
+	for (int digit = 0; digit < 4; digit++) {
+		std::uint32_t* histogram = histograms[digit];
+		const int shift = digit * 8;
+		if (histogram[(items[0].key >> shift) & 0xFF] == count) {
+			continue;
+		}
+
+		// Exclusive prefix sum gives each bucket's first output position
+		std::uint32_t offset = 0;
+		for (int bucket = 0; bucket < 256; bucket++) {
+			const std::uint32_t bucketCount = histogram[bucket];
+			histogram[bucket] = offset;
+			offset += bucketCount;
+		}
+		for (const SortItem& item : items) {
+			scratch[histogram[(item.key >> shift) & 0xFF]++] = item;
+		}
+		std::swap(items, scratch);
+	}
+}
+
+#endif // !RADIX_SORT_H
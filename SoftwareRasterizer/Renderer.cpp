@@ -2,154 +2,817 @@
 
 #include "Clipping.h"
 #include "Matrix.h"
+#include "Profiler.h"
 #include "Utilities.h"
+#include "VertexProcessing.h"
 
+#include <algorithm>
 #include <chrono>
+#include <climits>
+#include <cmath>
 #include <immintrin.h>
 #include <iostream>
 
-Renderer::Renderer(int width, int height)
-	: width(width), height(height), colorBuffer((Color*)_aligned_malloc(width * height * sizeof(Color), 16)), 
-		depthBuffer((float*)_aligned_malloc(width* height * sizeof(float), 16))
+namespace {
+	// Row length of the buffers for a render width, see Renderer::width
+	int PaddedWidth(int width) { return (width + 3) / 4 * 4; }
+}
+
+Renderer::Renderer(int width, int height, unsigned nWorkerThreads)
+	: viewportWidth(width), width(PaddedWidth(width)), height(height), maxWidth(PaddedWidth(width)), maxHeight(height),
+		colorBuffer((Color*)_aligned_malloc(maxWidth * maxHeight * sizeof(Color), 16)), 
+		depthBuffer((float*)_aligned_malloc(maxWidth * maxHeight * sizeof(float), 16)),
+		idBuffer((VisibilityId*)_aligned_malloc(maxWidth * maxHeight * sizeof(VisibilityId), 16)), threadPool(nWorkerThreads)
 {
+	// The pool's threads and the raster thread
+	threadStats.resize(threadPool.ThreadCount() + 1);
+	uncountedStats.resize(threadPool.ThreadCount() + 1);
 	ClearBuffers();
 }
 
-void Renderer::Render(const Scene& scene)
+void Renderer::SetPipelining(bool enabled)
 {
-	const auto view = scene.cam.GetViewMatrix();
-	const float inverseAR = (float)height / (float)width;
-	const auto proj = Perspective(inverseAR, Radians(scene.cam.zoom * 2), 0.1f, 100.0f);
+	if (enabled && !rasterThread.joinable()) {
+		for (int i = 0; i < nGeometrySlots; i++) {
+			freeSlots.Push(i);
+		}
+		rasterThread = std::thread([this] { RasterLoop(); });
+		rasterThreadId = rasterThread.get_id();
+	}
+	// The raster thread takes the place of one of the pool's workers, so that the threads don't outnumber the cores
+	const unsigned nWorkers = threadPool.ThreadCount() - 1;
+	threadPool.SetActiveWorkers(enabled && nWorkers > 0 ? nWorkers - 1 : nWorkers);
+	pipelining = enabled;
+}
 
-	for (const Model& model : scene.models) {
-		Render(model, view, proj);
+void Renderer::RasterLoop()
+{
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(pipelineMutex);
+			pipelineWake.wait(lock, [this] { return frameStarted || stopRasterThread; });
+			if (stopRasterThread) {
+				return;
+			}
+			frameStarted = false;
+		}
+
+		// Draw the slots in the order the models were handed over, for the same result as without pipelining
+		for (int index = readySlots.Pop(); index != endOfFrame; index = readySlots.Pop()) {
+			GeometrySlot& slot = geometrySlots[index];
+			(this->*slot.rasterize)(slot);
+			freeSlots.Push(index);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(pipelineMutex);
+			frameRasterized = true;
+		}
+		pipelineWake.notify_all();
 	}
 }
 
-void Renderer::Render(const Model& model, const Mat4& view, const Mat4& proj)
+void Renderer::StartPipelineFrame()
 {
-	// Transform vertices
-	const auto nVertices = model.vertices.size();
-	std::vector<Vec3> viewSpaceVertices(nVertices);
-	std::vector<Vec4> clipSpaceVertices(nVertices);
-	auto mv = view * ModelMatrix(model.position, model.rotation, model.scale);
-	for (int i = 0; i < nVertices; i++) {
-		viewSpaceVertices[i] = mv * model.vertices[i];
-		clipSpaceVertices[i] = proj * ToHomogenous(viewSpaceVertices[i], 1.0f);
-	}
-
-	// Backface culling in view space
-	std::vector<Face> frontFaces;
-	std::copy_if(model.faces.begin(), model.faces.end(), std::back_inserter(frontFaces),
-		[&viewSpaceVertices](const Face& f) {
-			Vec3& a = viewSpaceVertices[f.a];
-			Vec3& b = viewSpaceVertices[f.b];
-			Vec3& c = viewSpaceVertices[f.c];
-			return IsFrontFacingViewSpace(a, b, c);
-		});
+	{
+		std::lock_guard<std::mutex> lock(pipelineMutex);
+		frameStarted = true;
+		frameRasterized = false;
+	}
+	pipelineWake.notify_all();
+}
+
+void Renderer::FinishPipelineFrame()
+{
+	PROFILE_SCOPE("Wait for rasterization");
+	readySlots.Push(endOfFrame);
+	std::unique_lock<std::mutex> lock(pipelineMutex);
+	pipelineWake.wait(lock, [this] { return frameRasterized; });
+}
+
+void Renderer::StopRasterThread()
+{
+	if (!rasterThread.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(pipelineMutex);
+		stopRasterThread = true;
+	}
+	pipelineWake.notify_all();
+	rasterThread.join();
+}
+
+void Renderer::SetMultisampling(bool enabled)
+{
+	if (enabled && !msaaDepth) {
+		msaaDepth = (float*)_aligned_malloc(maxWidth * maxHeight * msaaSampleCount * sizeof(float), 16);
+		msaaColor = (Color*)_aligned_malloc(maxWidth * maxHeight * msaaSampleCount * sizeof(Color), 16);
+		msaaFlags = (std::uint8_t*)_aligned_malloc(maxWidth * maxHeight, 16);
+	}
+	multisampling = enabled;
+	ClearBuffers();
+}
+
+void Renderer::SetOverdrawHeatmap(bool enabled)
+{
+	if (enabled && !overdrawCounts) {
+		overdrawCounts = (std::uint8_t*)_aligned_malloc(maxWidth * maxHeight, 16);
+	}
+	overdrawHeatmap = enabled;
+	ClearBuffers();
+}
+
+void Renderer::SetRenderSize(int renderWidth, int renderHeight)
+{
+	// Rows are packed with the new padded width, the buffers keep their allocations
+	viewportWidth = std::clamp(renderWidth, 1, maxWidth);
+	width = PaddedWidth(viewportWidth);
+	height = std::clamp(renderHeight, 1, maxHeight);
+	ClearBuffers();
+}
+
+void Renderer::Render(const Scene& scene, const Camera& camera)
+{
+	PROFILE_SCOPE("Render");
+	const auto view = camera.GetViewMatrix();
+	const float inverseAR = (float)height / (float)viewportWidth;
+	const auto proj = camera.GetProjectionMatrix(inverseAR);
+
+	const FrameChange change = incremental ? TrackChanges(scene, camera, proj * view) : FrameChange::Full;
+	if (change == FrameChange::None) {
+		// The kept frame is still right
+		pipelineStats = PipelineStats();
+		return;
+	}
+	if (incremental) {
+		if (change == FrameChange::Partial) {
+			ClearRect(dirtyRect);
+		}
+		else {
+			ClearBuffers();
+		}
+	}
+
+	std::fill(threadStats.begin(), threadStats.end(), PipelineStats());
+
+	hasShadowMap = false;
+	if (scene.light.castsShadows) {
+		countingStats = false;
+		RenderShadowMap(scene);
+		countingStats = true;
+	}
+
+	if (renderPath == RenderPath::VisibilityBuffer) {
+		RenderVisibilityBuffer(scene, view, proj);
+	}
+	else {
+		scissor = change == FrameChange::Partial ? &dirtyRect : nullptr;
+		const auto& order = SortModels(scene, view);
+		if (depthPrePass && !multisampling) {
+			RenderDepthPrePass(scene, order, view, proj);
+			depthPrePassDone = true;
+		}
+		pipelineFrame = pipelining;
+		if (pipelineFrame) {
+			StartPipelineFrame();
+		}
+		for (std::uint32_t index : order) {
+			if (!IsOutsideScissor(index)) {
+				Render(scene.models[index], view, proj, scene.light);
+			}
+		}
+		if (pipelineFrame) {
+			FinishPipelineFrame();
+			pipelineFrame = false;
+		}
+		depthPrePassDone = false;
+		scissor = nullptr;
+	}
 
-	// Clip to near plane (only) and cull if completely out of frustum
-	auto clipSpaceTris = ClipAndCull(frontFaces, clipSpaceVertices);
+	pipelineStats = PipelineStats();
+	for (const PipelineStats& stats : threadStats) {
+		pipelineStats += stats;
+	}
+	if (overdrawHeatmap) {
+		DrawOverdrawHeatmap();
+	}
+	frameValid = incremental;
+}
 
-	// Convert triangles from clip space to screen space
-	std::vector<Triangle> screenSpaceTris;
-	screenSpaceTris.reserve(clipSpaceTris.size());
-	const float halfW = width / 2.0f;
+namespace {
+	// Grows with Union like any other rect
+	constexpr ScissorRect emptyRect = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+
+	ScissorRect Union(const ScissorRect& a, const ScissorRect& b)
+	{
+		return { std::min(a.minX, b.minX), std::min(a.minY, b.minY), std::max(a.maxX, b.maxX), std::max(a.maxY, b.maxY) };
+	}
+}
+
+Renderer::FrameChange Renderer::TrackChanges(const Scene& scene, const Camera& camera, const Mat4& viewProjection)
+{
+	PROFILE_SCOPE("Track changes");
+	nextModelSnapshots.clear();
+	for (const Model& model : scene.models) {
+		nextModelSnapshots.push_back({ model.position, model.rotation, model.scale, model.faces.data(), model.faces.size(),
+			model.texture.get(), model.shading, model.blending, ScreenRect(model, viewProjection) });
+	}
+
+	const DirectionalLight& light = scene.light;
+	const bool full = !frameValid || renderPath != RenderPath::Forward || overdrawHeatmap || !camera.SameView(previousCamera) ||
+		light.dir != previousLight.dir || light.ambient != previousLight.ambient || light.castsShadows != previousLight.castsShadows ||
+		light.shadowMapSize != previousLight.shadowMapSize || nextModelSnapshots.size() != modelSnapshots.size();
+	// Where a changed model was and where it is now
+	ScissorRect dirty = emptyRect;
+	for (std::size_t i = 0; !full && i < nextModelSnapshots.size(); i++) {
+		const ModelSnapshot& a = modelSnapshots[i];
+		const ModelSnapshot& b = nextModelSnapshots[i];
+		if (a.position != b.position || a.rotation != b.rotation || a.scale != b.scale || a.faces != b.faces ||
+			a.faceCount != b.faceCount || a.texture != b.texture || a.shading != b.shading || a.blending != b.blending) {
+			dirty = Union(dirty, Union(a.screenRect, b.screenRect));
+		}
+	}
+	previousCamera = camera;
+	previousLight = light;
+	std::swap(modelSnapshots, nextModelSnapshots);
+
+	if (full) {
+		return FrameChange::Full;
+	}
+	if (dirty.minX > dirty.maxX || dirty.minY > dirty.maxY) {
+		return FrameChange::None;
+	}
+	// Shadows of the changed models can fall anywhere, and past half the screen a full redraw costs about the same
+	const long long dirtyArea = (long long)(dirty.maxX - dirty.minX + 1) * (dirty.maxY - dirty.minY + 1);
+	if (light.castsShadows || 2 * dirtyArea > (long long)width * height) {
+		return FrameChange::Full;
+	}
+	dirtyRect = dirty;
+	return FrameChange::Partial;
+}
+
+ScissorRect Renderer::ScreenRect(const Model& model, const Mat4& viewProjection) const
+{
+	const float maxScale = std::max({ std::fabs(model.scale.x), std::fabs(model.scale.y), std::fabs(model.scale.z) });
+	const Vec3 center = ModelMatrix(model.position, model.rotation, model.scale) * model.boundsCenter;
+	const float radius = model.boundsRadius * maxScale;
+
+	// Projected corners of the box around the bounding sphere, with the viewport transform of the setup. The
+	// projection of a box reaching behind the near plane (w = 0.1) doesn't bound it.
+	const float halfW = viewportWidth / 2.0f;
 	const float halfH = height / 2.0f;
-	std::transform(clipSpaceTris.begin(), clipSpaceTris.end(), std::back_inserter(screenSpaceTris),
-		[=](const ClipSpaceTriangle& t)
-		{
-			return ClipSpaceToScreenSpace(t, halfW, halfH);
-		});
+	float minX = FLT_MAX, minY = FLT_MAX;
+	float maxX = -FLT_MAX, maxY = -FLT_MAX;
+	for (int i = 0; i < 8; i++) {
+		const Vec4 corner = viewProjection * Vec4{ center.x + (i & 1 ? radius : -radius), center.y + (i & 2 ? radius : -radius),
+			center.z + (i & 4 ? radius : -radius), 1.0f };
+		if (corner.w < 0.1f) {
+			return { 0, 0, width - 1, height - 1 };
+		}
+		const float x = (corner.x / corner.w + 1.0f) * halfW;
+		const float y = halfH - corner.y / corner.w * halfH;
+		minX = std::min(minX, x);
+		minY = std::min(minY, y);
+		maxX = std::max(maxX, x);
+		maxY = std::max(maxY, y);
+	}
+	if (maxX < 0.0f || maxY < 0.0f || minX >= (float)viewportWidth || minY >= (float)height) {
+		return emptyRect;
+	}
+	// A pixel of margin for the rounding of the setup, widened to groups of four
+	ScissorRect rect;
+	rect.minX = std::max((int)std::max(minX, 0.0f) - 1, 0) / 4 * 4;
+	rect.minY = std::max((int)std::max(minY, 0.0f) - 1, 0);
+	rect.maxX = std::min(((int)std::min(maxX, (float)width) + 1) / 4 * 4 + 3, width - 1);
+	rect.maxY = std::min((int)std::min(maxY, (float)height) + 1, height - 1);
+	return rect;
+}
 
-	const auto nTris = screenSpaceTris.size();
-	for (int i = 0; i < nTris; i++) {
-		DrawTexturedTriangle(screenSpaceTris[i], model.texture);
+void Renderer::ClearRect(const ScissorRect& rect)
+{
+	PROFILE_SCOPE("Clear");
+	// Multisampled buffers store groups of four pixels together, rect.minX and rect.maxX + 1 are multiples of four
+	for (int y = rect.minY; y <= rect.maxY; y++) {
+		const int first = y * width + rect.minX;
+		const int last = y * width + rect.maxX + 1;
+		std::fill(colorBuffer + first, colorBuffer + last, Colors::magenta);
+		std::fill(depthBuffer + first, depthBuffer + last, FLT_MIN);
+		if (multisampling) {
+			std::fill(msaaDepth + first * msaaSampleCount, msaaDepth + last * msaaSampleCount, FLT_MIN);
+			std::fill(msaaFlags + first, msaaFlags + last, 0);
+		}
 	}
 }
 
-// return > 0 means c is in the positive half space of edge ab 
-// Assuming ccw winding order in screen space. Winding order is actually cw in object space
-// But since screen space flips y (therefore changing handedness), ccw winding order is used.
-// Source: https://fgiesen.wordpress.com/2013/02/08/triangle-rasterization-in-practice/
-static inline float orient2d(const Vec2& a, const Vec2& b, const Vec2& c)
+bool Renderer::IsOutsideScissor(std::uint32_t modelIndex) const
 {
-	return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+	if (!scissor) {
+		return false;
+	}
+	const ScissorRect& rect = modelSnapshots[modelIndex].screenRect;
+	return rect.minX > scissor->maxX || rect.maxX < scissor->minX || rect.minY > scissor->maxY || rect.maxY < scissor->minY;
 }
 
-void Renderer::DrawTexturedTriangle(Triangle& t, const Texture& texture)
+void Renderer::CountOverdraw4(int pixelIndex, __m128 mask)
 {
-	// +0.5f for pixel center
-	auto xBounds = std::minmax({ t.a.x, t.b.x, t.c.x });
-	auto yBounds = std::minmax({ t.a.y, t.b.y, t.c.y });
-	float minX = (int)xBounds.first + 0.5f;
-	float maxX = (int)xBounds.second + 0.5f;
-	float minY = (int)yBounds.first + 0.5f;
-	float maxY = (int)yBounds.second + 0.5f;
+	// Lanes of all ones become bytes of one, added with saturation
+	const auto ones = _mm_and_si128(_mm_castps_si128(mask), _mm_set1_epi32(1));
+	const auto increments = _mm_packus_epi16(_mm_packus_epi32(ones, ones), _mm_setzero_si128());
+	int* counts = (int*)(overdrawCounts + pixelIndex);
+	*counts = _mm_cvtsi128_si32(_mm_adds_epu8(_mm_cvtsi32_si128(*counts), increments));
+}
 
-	if (minX < 0) minX = 0.5f;
-	if (maxX > width - 1) maxX = width - 0.5f;
-	if (minY < 0) minY = 0.5f;
-	if (maxY > height - 1) maxY = height - 0.5f;
+void Renderer::DrawOverdrawHeatmap()
+{
+	PROFILE_SCOPE("Overdraw heatmap");
+	constexpr Color ramp[] = {
+		Colors::black, 0xFF000080, 0xFF0000FF, 0xFF0080FF, 0xFF00FF00, 0xFF80FF00, 0xFFFFFF00, 0xFFFF8000, 0xFFFF0000
+	};
+	constexpr int maxCount = (int)(sizeof(ramp) / sizeof(ramp[0])) - 1;
+	const int nPixels = width * height;
+	for (int i = 0; i < nPixels; i++) {
+		colorBuffer[i] = ramp[std::min((int)overdrawCounts[i], maxCount)];
+	}
+	// Resolving would average the samples' colors back in
+	if (multisampling) {
+		std::fill(msaaFlags, msaaFlags + nPixels, 0);
+	}
+}
 
-	Vec2 v0 = { t.a.x, t.a.y };
-	Vec2 v1 = { t.b.x, t.b.y };
-	Vec2 v2 = { t.c.x, t.c.y };
+void Renderer::RenderShadowMap(const Scene& scene)
+{
+	PROFILE_SCOPE("Shadow map");
+	// Bounding sphere of the opaque models in world space
+	Vec3 boundsMin = { FLT_MAX, FLT_MAX, FLT_MAX };
+	Vec3 boundsMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	std::vector<std::pair<Vec3, float>> spheres;
+	for (const Model& model : scene.models) {
+		if (model.blending != Blending::Opaque) {
+			continue;
+		}
+		const float maxScale = std::max({ std::fabs(model.scale.x), std::fabs(model.scale.y), std::fabs(model.scale.z) });
+		const Vec3 center = ModelMatrix(model.position, model.rotation, model.scale) * model.boundsCenter;
+		const float radius = model.boundsRadius * maxScale;
+		boundsMin = { std::min(boundsMin.x, center.x - radius), std::min(boundsMin.y, center.y - radius), std::min(boundsMin.z, center.z - radius) };
+		boundsMax = { std::max(boundsMax.x, center.x + radius), std::max(boundsMax.y, center.y + radius), std::max(boundsMax.z, center.z + radius) };
+		spheres.push_back({ center, radius });
+	}
+	if (spheres.empty()) {
+		return;
+	}
+	const Vec3 sceneCenter = (boundsMin + boundsMax) * 0.5f;
+	float sceneRadius = 0.0f;
+	for (const auto& [center, radius] : spheres) {
+		sceneRadius = std::max(sceneRadius, (center - sceneCenter).length() + radius);
+	}
+	sceneRadius = std::max(sceneRadius, 1e-3f);
 
-	auto triAreaTimes2 = orient2d(v0, v1, v2);
-	auto invTriAreaTimes2 = 1.0f / triAreaTimes2;
+	// Look along the light from outside the sphere. The orthographic projection covers the sphere with some depth to spare.
+	const Vec3 forward = scene.light.dir;
+	const Vec3 worldUp = std::fabs(forward.y) < 0.99f ? Vec3{ 0.0f, 1.0f, 0.0f } : Vec3{ 1.0f, 0.0f, 0.0f };
+	const Vec3 right = Normalize(Cross(worldUp, forward));
+	const Vec3 up = Normalize(Cross(forward, right));
+	const Vec3 eye = sceneCenter - forward * (2.0f * sceneRadius);
+	const float zNear = 0.5f * sceneRadius;
+	const float zFar = 3.5f * sceneRadius;
+	const Mat4 lightView = LookAt(eye, right, up, forward);
+	const Mat4 lightProj = Orthographic(sceneRadius, sceneRadius, zNear, zFar);
 
-	Vec2 aInverseDepthTimesUV = t.a.z * t.aUV;
-	Vec2 bInverseDepthTimesUV = t.b.z * t.bUV;
-	Vec2 cInverseDepthTimesUV = t.c.z * t.cUV;
+	// The depth kernel works on four texels at a time
+	const int size = (std::max(scene.light.shadowMapSize, 4) + 3) / 4 * 4;
+	if (size != shadowMapSize) {
+		_aligned_free(shadowMap);
+		shadowMap = (float*)_aligned_malloc(size * size * sizeof(float), 16);
+		shadowMapSize = size;
+	}
+	std::fill(shadowMap, shadowMap + size * size, FLT_MIN);
 
-	const float abDeltaU = bInverseDepthTimesUV.u - aInverseDepthTimesUV.u;
-	const float abDeltaV = bInverseDepthTimesUV.v - aInverseDepthTimesUV.v;
-	const float acDeltaU = cInverseDepthTimesUV.u - aInverseDepthTimesUV.u;
-	const float acDeltaV = cInverseDepthTimesUV.v - aInverseDepthTimesUV.v;
-	const float abDeltaInverseZ = t.b.z - t.a.z;
-	const float acDeltaInverseZ = t.c.z - t.a.z;
+	auto& setupBuffer = std::get<TriangleSetupBuffer<0>>(setupBuffers);
+	for (const Model& model : scene.models) {
+		if (model.blending != Blending::Opaque) {
+			continue;
+		}
+		ShaderUniforms uniforms;
+		uniforms.texture = model.texture.get();
+		setupBuffer.Clear();
+		ProcessGeometry<DepthOnlyVertexShader, true>(model, lightView, lightProj, uniforms, size, size, setupBuffer);
+		const auto nTris = setupBuffer.count;
+		for (std::size_t i = 0; i < nTris; i++) {
+			DrawTriangleDepthSSE<false>(setupBuffer.batches[i / setupBatchSize], i % setupBatchSize, shadowMap, size, emptyVisibilityId);
+		}
+	}
 
-	Vec2 p{ minX, minY };
+	shadowViewProjection = lightProj * lightView;
+	// Depth is linear from the light, bias by about two texels worth of distance to keep slopes from shadowing themselves
+	const float texelSize = 2.0f * sceneRadius / size;
+	shadowDepthBias = 2.0f * texelSize / (zFar - zNear);
+	hasShadowMap = true;
+}
 
-	float w0Row = orient2d(v1, v2, p);
-	float w1Row = orient2d(v2, v0, p);
-	float w2Row = orient2d(v0, v1, p);
+void Renderer::RenderDepthPrePass(const Scene& scene, const std::vector<std::uint32_t>& order, const Mat4& view, const Mat4& proj)
+{
+	PROFILE_SCOPE("Depth pre-pass");
+	auto& setupBuffer = std::get<TriangleSetupBuffer<0>>(setupBuffers);
+	for (std::uint32_t index : order) {
+		const Model& model = scene.models[index];
+		if (model.blending != Blending::Opaque || IsOutsideScissor(index)) {
+			continue;
+		}
+		ShaderUniforms uniforms;
+		uniforms.texture = model.texture.get();
+		setupBuffer.Clear();
+		ProcessGeometry<DepthOnlyVertexShader>(model, view, proj, uniforms, viewportWidth, height, setupBuffer);
+		const auto nTris = setupBuffer.count;
+		for (std::size_t i = 0; i < nTris; i++) {
+			DrawTriangleDepthSSE<false>(setupBuffer.batches[i / setupBatchSize], i % setupBatchSize, depthBuffer, width, emptyVisibilityId);
+		}
+	}
+}
+
+// Number of set bits in a 4 bit mask
+static inline int PopCount4(int mask)
+{
+	constexpr int counts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+	return counts[mask];
+}
+
+// Work per job of ProcessGeometry. Chunks of faces are made of whole meshlets, so they can be a little larger.
+static constexpr std::size_t geometryChunkVertices = 2048;
+static constexpr std::size_t geometryChunkFaces = 4096;
+
+// Bounding box size in pixels from which DrawTriangleSSE fills triangles span by span
+static constexpr int spanFillMinWidth = 64;
+static constexpr int spanFillMinHeight = 8;
+
+const std::vector<std::uint32_t>& Renderer::SortModels(const Scene& scene, const Mat4& view)
+{
+	const auto nModels = (std::uint32_t)scene.models.size();
+	modelOrder.clear();
+	if (!frontToBackSorting) {
+		for (std::uint32_t i = 0; i < nModels; i++) {
+			modelOrder.push_back(i);
+		}
+		return modelOrder;
+	}
+
+	// Sort by the view space depth of the closest point of the bounding sphere
+	sortItems.clear();
+	transparentSortItems.clear();
+	for (std::uint32_t i = 0; i < nModels; i++) {
+		const Model& model = scene.models[i];
+		const auto mv = view * ModelMatrix(model.position, model.rotation, model.scale);
+		const float maxScale = std::max({ std::fabs(model.scale.x), std::fabs(model.scale.y), std::fabs(model.scale.z) });
+		const float depth = (mv * model.boundsCenter).z - model.boundsRadius * maxScale;
+		const std::uint32_t key = DepthSortKey(depth);
+		if (model.blending == Blending::Opaque) {
+			sortItems.push_back({ key, i });
+		}
+		else {
+			transparentSortItems.push_back({ ~key, i });
+		}
+	}
+	RadixSort(sortItems, sortScratch);
+	RadixSort(transparentSortItems, sortScratch);
+
+	for (const SortItem& item : sortItems) {
+		modelOrder.push_back(item.value);
+	}
+	for (const SortItem& item : transparentSortItems) {
+		modelOrder.push_back(item.value);
+	}
+	return modelOrder;
+}
+
+ShaderUniforms Renderer::MakeUniforms(const Model& model, const Mat4& view, const DirectionalLight& light) const
+{
+	ShaderUniforms uniforms;
+	uniforms.texture = model.texture.get();
+	uniforms.lightDirection = Normalize(TransformDirection(view, light.dir));
+	uniforms.ambient = light.ambient;
+	if (light.castsShadows && hasShadowMap) {
+		// Clip space of the shadow map to texel coordinates, matching the viewport transform of the setup.
+		// Depth becomes 1 - z like in the shadow map.
+		const float halfSize = shadowMapSize / 2.0f;
+		const Mat4 toTexels = {
+			halfSize,	0,			0,		halfSize,
+			0,			-halfSize,	0,		halfSize,
+			0,			0,			-1,		1,
+			0,			0,			0,		1
+		};
+		uniforms.shadowMap = shadowMap;
+		uniforms.shadowMapSize = shadowMapSize;
+		uniforms.shadowTransform = toTexels * shadowViewProjection * ModelMatrix(model.position, model.rotation, model.scale);
+		uniforms.shadowBias = shadowDepthBias;
+	}
+	return uniforms;
+}
+
+void Renderer::Render(const Model& model, const Mat4& view, const Mat4& proj, const DirectionalLight& light)
+{
+	const ShaderUniforms uniforms = MakeUniforms(model, view, light);
+	DispatchShadingModel(model.shading, uniforms.shadowMap != nullptr, [&](auto vertexShader, auto fragmentShader) {
+		Render<decltype(vertexShader), decltype(fragmentShader)>(model, view, proj, uniforms);
+	});
+}
+
+template<typename VertexShader, typename FragmentShader>
+void Renderer::Render(const Model& model, const Mat4& view, const Mat4& proj, const ShaderUniforms& uniforms)
+{
+	switch (model.blending) {
+	case Blending::Opaque:
+		if (depthPrePassDone) {
+			Render<VertexShader, FragmentShader, DepthTestEqual, OpaqueBlend>(model, view, proj, uniforms);
+		}
+		else {
+			Render<VertexShader, FragmentShader, DepthTestAndWrite, OpaqueBlend>(model, view, proj, uniforms);
+		}
+		break;
+	case Blending::AlphaBlend:
+		Render<VertexShader, FragmentShader, DepthTestNoWrite, AlphaBlend>(model, view, proj, uniforms);
+		break;
+	}
+}
+
+template<typename VertexShader, typename FragmentShader, typename DepthMode, typename BlendMode>
+void Renderer::Render(const Model& model, const Mat4& view, const Mat4& proj, const ShaderUniforms& uniforms)
+{
+	if (pipelineFrame) {
+		// Wait for a slot the raster thread is done with, it may still be drawing the models before this one
+		const int index = freeSlots.Pop();
+		GeometrySlot& slot = geometrySlots[index];
+		auto& setupBuffer = std::get<TriangleSetupBuffer<VertexShader::nVaryings>>(slot.setupBuffers);
+		setupBuffer.Clear();
+		ProcessGeometry<VertexShader>(model, view, proj, uniforms, viewportWidth, height, setupBuffer);
+		slot.uniforms = uniforms;
+		slot.rasterize = &Renderer::RasterizeSlot<FragmentShader, DepthMode, BlendMode, VertexShader::nVaryings>;
+		readySlots.Push(index);
+		return;
+	}
 
-	const float w0ColumnIncrement = v1.y - v2.y;
-	const float w1ColumnIncrement = v2.y - v0.y;
-	const float w2ColumnIncrement = v0.y - v1.y;
+	auto& setupBuffer = std::get<TriangleSetupBuffer<VertexShader::nVaryings>>(setupBuffers);
+	setupBuffer.Clear();
+	ProcessGeometry<VertexShader>(model, view, proj, uniforms, viewportWidth, height, setupBuffer);
+	Rasterize<FragmentShader, DepthMode, BlendMode>(setupBuffer, uniforms);
+}
 
-	const float w0RowIncrement = v2.x - v1.x;
-	const float w1RowIncrement = v0.x - v2.x;
-	const float w2RowIncrement = v1.x - v0.x;
+template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+void Renderer::RasterizeSlot(GeometrySlot& slot)
+{
+	Rasterize<FragmentShader, DepthMode, BlendMode>(std::get<TriangleSetupBuffer<nVaryings>>(slot.setupBuffers), slot.uniforms);
+}
 
-	for (p.y = minY; p.y <= maxY; p.y++)
+template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+void Renderer::Rasterize(const TriangleSetupBuffer<nVaryings>& setupBuffer, const ShaderUniforms& uniforms)
+{
+	PROFILE_SCOPE("Rasterize");
+	const auto nTris = setupBuffer.count;
+	if (multisampling && renderPath == RenderPath::Forward) {
+		for (std::size_t i = 0; i < nTris; i++) {
+			DrawTriangleMSAA<FragmentShader, DepthMode, BlendMode>(setupBuffer.batches[i / setupBatchSize], i % setupBatchSize, uniforms);
+		}
+		return;
+	}
+	for (std::size_t i = 0; i < nTris; i++) {
+		DrawTriangleSSE<FragmentShader, DepthMode, BlendMode>(setupBuffer.batches[i / setupBatchSize], i % setupBatchSize, uniforms);
+	}
+}
+
+template<typename VertexShader, bool orthographic>
+void Renderer::ProcessGeometry(const Model& model, const Mat4& view, const Mat4& proj, const ShaderUniforms& uniforms,
+	int targetWidth, int targetHeight, TriangleSetupBuffer<VertexShader::nVaryings>& out)
+{
+	const auto mv = view * ModelMatrix(model.position, model.rotation, model.scale);
+	const auto mvp = proj * mv;
+	PipelineStats& stats = ThreadStats();
+	stats.inputTriangles += model.faces.size();
+
+	// Cull whole meshlets in model space before transforming any of their vertices. The frustum planes
+	// and camera position are brought into model space instead of moving every meshlet's bounds out of it.
+	const auto frustumPlanes = ExtractFrustumPlanes(mvp);
+	const auto modelSpaceCamPos = AffineInverse(mv) * Vec3{ 0, 0, 0 };
+	// Mirroring flips the winding order the normal cones were built with. The cones are tested against
+	// a camera position, which an orthographic view doesn't have.
+	const bool coneCullingEnabled = !orthographic && Determinant3x3(mv) > 0.0f;
+	const VertexTransforms transforms = { SimdMat4(mv), SimdMat4(proj), SimdMat4(NormalMatrix(mv)) };
+
+	const auto nVertices = model.vertices.size();
+	std::vector<Vec3> viewSpaceVertices(nVertices);
+	std::vector<Vec4> clipSpaceVertices(nVertices);
+	std::vector<Varyings> vertexVaryings(nVertices);
+	std::vector<bool> isTransformed(nVertices);
+
+	// Visible meshlets, front to back if sorting is enabled and the model is large enough for it to matter
+	constexpr std::size_t minSortedMeshlets = 16;
+	const bool sortMeshlets = frontToBackSorting && model.meshlets.size() >= minSortedMeshlets;
+	sortItems.clear();
 	{
-		const int rowOffset = (int)p.y * width;
+		PROFILE_SCOPE("Meshlet cull");
+		for (std::uint32_t i = 0; i < (std::uint32_t)model.meshlets.size(); i++) {
+			const Meshlet& meshlet = model.meshlets[i];
+			if (IsSphereOutsideFrustum(frustumPlanes, meshlet.center, meshlet.radius) ||
+				(coneCullingEnabled && IsMeshletBackFacing(meshlet, modelSpaceCamPos))) {
+				stats.meshletCulled += meshlet.faceCount;
+				continue;
+			}
+			// View space z of the center
+			const float depth = sortMeshlets ? mv[2][0] * meshlet.center.x + mv[2][1] * meshlet.center.y + mv[2][2] * meshlet.center.z + mv[2][3] : 0.0f;
+			sortItems.push_back({ DepthSortKey(depth), i });
+		}
+		if (sortMeshlets) {
+			RadixSort(sortItems, sortScratch);
+		}
+	}
+
+	// Vertices of the visible meshlets, each once (shared vertices go with the first meshlet that uses them)
+	std::vector<std::uint32_t> vertexList;
+	{
+		PROFILE_SCOPE("Vertex list");
+		for (const SortItem& item : sortItems) {
+			const Meshlet& meshlet = model.meshlets[item.value];
+			const std::uint32_t* vertexIndices = model.meshletVertices.data() + meshlet.firstVertex;
+			for (std::uint32_t i = 0; i < meshlet.vertexCount; i++) {
+				const std::uint32_t index = vertexIndices[i];
+				if (!isTransformed[index]) {
+					isTransformed[index] = true;
+					vertexList.push_back(index);
+				}
+			}
+		}
+		// Pad by repeating the last vertex
+		while (!vertexList.empty() && vertexList.size() % vertexBatchSize != 0) {
+			vertexList.push_back(vertexList.back());
+		}
+	}
+
+	// Transform and shade vertices four at a time, in chunks on the thread pool. Every vertex is written by one job.
+	const std::size_t nVertexChunks = (vertexList.size() + geometryChunkVertices - 1) / geometryChunkVertices;
+	threadPool.ParallelFor(nVertexChunks, [&](std::size_t chunk) {
+		PROFILE_SCOPE("Transform");
+		const std::size_t first = chunk * geometryChunkVertices;
+		const std::size_t last = std::min(first + geometryChunkVertices, vertexList.size());
+		for (std::size_t i = first; i < last; i += vertexBatchSize) {
+			ProcessVertices4<VertexShader>(model, vertexList.data() + i, transforms, uniforms, viewSpaceVertices, clipSpaceVertices, vertexVaryings);
+		}
+	});
+
+	// Runs of consecutive visible meshlets with about geometryChunkFaces faces each
+	std::vector<std::size_t> chunkStarts;
+	std::size_t chunkFaces = geometryChunkFaces;
+	for (std::size_t i = 0; i < sortItems.size(); i++) {
+		if (chunkFaces >= geometryChunkFaces) {
+			chunkStarts.push_back(i);
+			chunkFaces = 0;
+		}
+		chunkFaces += model.meshlets[sortItems[i].value].faceCount;
+	}
+	const std::size_t nChunks = chunkStarts.size();
+	chunkStarts.push_back(sortItems.size());
+
+	// Face culling, clipping and setup of the chunks in parallel. The first chunk sets up into out, the others into
+	// buffers of their own, which are appended to out in chunk order. Triangles keep the order of the serial loop,
+	// so depth ties resolve the same way.
+	auto& chunkBuffers = std::get<std::vector<TriangleSetupBuffer<VertexShader::nVaryings>>>(chunkSetupBuffers);
+	if (chunkBuffers.size() < nChunks) {
+		chunkBuffers.resize(nChunks);
+	}
+	const GuardBand guardBand = GuardBand(targetWidth / 2.0f, targetHeight / 2.0f);
+	threadPool.ParallelFor(nChunks, [&](std::size_t chunk) {
+		PipelineStats& chunkStats = ThreadStats();
+		std::vector<Face> frontFaces;
+		{
+			PROFILE_SCOPE("Backface cull");
+			std::size_t nFaces = 0;
+			for (std::size_t i = chunkStarts[chunk]; i < chunkStarts[chunk + 1]; i++) {
+				const Meshlet& meshlet = model.meshlets[sortItems[i].value];
+				nFaces += meshlet.faceCount;
+
+				// Backface culling in view space
+				const auto firstFace = model.faces.begin() + meshlet.firstFace;
+				std::copy_if(firstFace, firstFace + meshlet.faceCount, std::back_inserter(frontFaces),
+					[&viewSpaceVertices](const Face& f) {
+						const Vec3& a = viewSpaceVertices[f.a];
+						const Vec3& b = viewSpaceVertices[f.b];
+						const Vec3& c = viewSpaceVertices[f.c];
+						if constexpr (orthographic) {
+							return IsFrontFacingOrthographic(a, b, c);
+						}
+						else {
+							return IsFrontFacingViewSpace(a, b, c);
+						}
+					});
+			}
+			chunkStats.backFacingCulled += nFaces - frontFaces.size();
+		}
+
+		// Cull triangles completely outside of the frustum and clip to the near plane. Only triangles extending past
+		// the guard band are clipped against the side planes, the rest are handled by clamping to the screen bounds.
+		std::vector<ClipSpaceTriangle> clipSpaceTris;
+		if constexpr (VertexShader::isPerFace) {
+			// Give every front face its own three vertices, shaded with the face normal, so that neighbouring
+			// faces don't share (and interpolate) their shading
+			const std::size_t nFaces = frontFaces.size();
+			std::vector<Vec4> faceClipSpaceVertices(nFaces * 3);
+			std::vector<Varyings> faceVaryings(nFaces * 3);
+			{
+				PROFILE_SCOPE("Face shading");
+				for (std::size_t i = 0; i < nFaces; i++) {
+					Face& face = frontFaces[i];
+					const Vec3& a = viewSpaceVertices[face.a];
+					const Vec3& b = viewSpaceVertices[face.b];
+					const Vec3& c = viewSpaceVertices[face.c];
+					const Vec3 normal = Normalize(Cross(b - a, c - b));
+					const std::uint32_t corners[3] = { face.a, face.b, face.c };
+					for (int j = 0; j < 3; j++) {
+						faceClipSpaceVertices[i * 3 + j] = clipSpaceVertices[corners[j]];
+						VertexShader::Shade(model.vertices[corners[j]], model.textureCoords[corners[j]], normal, uniforms, faceVaryings[i * 3 + j]);
+					}
+					face.a = (std::uint32_t)(i * 3);
+					face.b = (std::uint32_t)(i * 3 + 1);
+					face.c = (std::uint32_t)(i * 3 + 2);
+				}
+			}
+			PROFILE_SCOPE("ClipAndCull");
+			clipSpaceTris = ClipAndCull(frontFaces, faceClipSpaceVertices, faceVaryings, guardBand, chunkStats);
+		}
+		else {
+			PROFILE_SCOPE("ClipAndCull");
+			clipSpaceTris = ClipAndCull(frontFaces, clipSpaceVertices, vertexVaryings, guardBand, chunkStats);
+		}
+
+		// Convert triangles from clip space to screen space and set up edge functions and attributes for rasterization
+		PROFILE_SCOPE("Triangle setup");
+		auto& chunkOut = chunk == 0 ? out : chunkBuffers[chunk];
+		if (chunk > 0) {
+			chunkOut.Clear();
+		}
+		const std::size_t firstSetup = chunkOut.count;
+		SetupTriangles<VertexShader::nVaryings, orthographic>(clipSpaceTris, targetWidth, targetHeight, chunkOut, scissor);
+		chunkStats.rasterized += chunkOut.count - firstSetup;
+		chunkStats.setupCulled += clipSpaceTris.size() - (chunkOut.count - firstSetup);
+	});
+
+	PROFILE_SCOPE("Merge geometry chunks");
+	for (std::size_t chunk = 1; chunk < nChunks; chunk++) {
+		out.Append(chunkBuffers[chunk]);
+	}
+}
+
+template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+void Renderer::DrawTriangle(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms)
+{
+	const int minX = t.minX[lane];
+	const int maxX = t.maxX[lane];
+	const int minY = t.minY[lane];
+	const int maxY = t.maxY[lane];
+
+	// Attribute plane equations, relative to the bounding box origin
+	const float inverseZ = t.inverseZ[0][lane];
+	const float inverseZDx = t.inverseZ[1][lane];
+	const float inverseZDy = t.inverseZ[2][lane];
+
+	float w0Row = t.w[0][lane];
+	float w1Row = t.w[1][lane];
+	float w2Row = t.w[2][lane];
+
+	const float w0ColumnIncrement = t.wDx[0][lane];
+	const float w1ColumnIncrement = t.wDx[1][lane];
+	const float w2ColumnIncrement = t.wDx[2][lane];
+
+	const float w0RowIncrement = t.wDy[0][lane];
+	const float w1RowIncrement = t.wDy[1][lane];
+	const float w2RowIncrement = t.wDy[2][lane];
+
+	for (int y = minY; y <= maxY; y++)
+	{
+		const int rowOffset = y * width;
+		const float dy = (float)(y - minY);
 
 		float w0 = w0Row;
 		float w1 = w1Row;
 		float w2 = w2Row;
 
-		for (p.x = minX; p.x <= maxX; p.x++)
+		for (int x = minX; x <= maxX; x++)
 		{
 			if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
-				const auto beta = w1 * invTriAreaTimes2;
-				const auto gamma = w2 * invTriAreaTimes2;
+				const float dx = (float)(x - minX);
 
-				const auto interpolatedInverseZ = t.a.z + beta * abDeltaInverseZ + gamma * acDeltaInverseZ;
-				const int pixelIndex = rowOffset + p.x;
-				if (interpolatedInverseZ > depthBuffer[pixelIndex]) {
-					depthBuffer[pixelIndex] = interpolatedInverseZ;
+				const auto interpolatedInverseZ = inverseZ + dx * inverseZDx + dy * inverseZDy;
+				const int pixelIndex = rowOffset + x;
+				const bool depthPassed = DepthMode::passEqual ? interpolatedInverseZ >= depthBuffer[pixelIndex] : interpolatedInverseZ > depthBuffer[pixelIndex];
+				if (!DepthMode::test || depthPassed) {
+					if constexpr (DepthMode::write) {
+						depthBuffer[pixelIndex] = interpolatedInverseZ;
+					}
 
-					auto interpolatedTexCoordU = aInverseDepthTimesUV.u + beta * abDeltaU + gamma * acDeltaU;
-					auto interpolatedTexCoordV = aInverseDepthTimesUV.v + beta * abDeltaV + gamma * acDeltaV;
+					// One division shared by all varyings
 					const auto interpolatedZ = 1.0f / interpolatedInverseZ;
-					interpolatedTexCoordU *= interpolatedZ;
-					interpolatedTexCoordV *= interpolatedZ;
+					float varyings[nVaryings];
+					for (int i = 0; i < nVaryings; i++) {
+						varyings[i] = (t.varyings[i][0][lane] + dx * t.varyings[i][1][lane] + dy * t.varyings[i][2][lane]) * interpolatedZ;
+					}
 
-					colorBuffer[pixelIndex] = texture(interpolatedTexCoordU, interpolatedTexCoordV);
+					colorBuffer[pixelIndex] = BlendMode::Blend(FragmentShader::Shade(varyings, uniforms), colorBuffer[pixelIndex]);
 				}
 			}
 
@@ -165,101 +828,353 @@ void Renderer::DrawTexturedTriangle(Triangle& t, const Texture& texture)
 }
 
 
-// Proceed at your own risk
+void Renderer::AddFragmentCounts(const FragmentCounts& counts)
+{
+	PipelineStats& stats = ThreadStats();
+	stats.pixelsTested += counts.tested;
+	stats.depthPassed += counts.passed;
+	stats.pixelsWritten += counts.written;
+}
 
-// https://stackoverflow.com/questions/12624466/get-member-of-m128-by-index
-template<unsigned i>
-static inline float GetByIndex(__m128 V)
+// Depth test, depth write, shading and blending of four pixels of a row, the ones set in coverage. Forced inline,
+// as a call per four pixels costs more than small triangles save by skipping their setup.
+template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+__forceinline void Renderer::ShadeFragments4(int pixelIndex, __m128 coverage, __m128 interpolatedInverseZ, const __m128* interpolatedVaryings,
+	const ShaderUniforms& uniforms, FragmentCounts& counts)
 {
-	// shuffle V so that the element that you want is moved to the least-
-	// significant element of the vector (V[0])
-	V = _mm_shuffle_ps(V, V, _MM_SHUFFLE(i, i, i, i));
-	// return the value in V[0]
-	return _mm_cvtss_f32(V);
+	auto writeFlag = coverage;
+
+	// Depth buffer test
+	auto currentZInBuffer = _mm_load_ps(depthBuffer + pixelIndex);
+
+	if constexpr (DepthMode::test) {
+		counts.tested += PopCount4(_mm_movemask_ps(writeFlag));
+		const auto depthPassed = DepthMode::passEqual ?
+			_mm_cmpge_ps(interpolatedInverseZ, currentZInBuffer) : _mm_cmpgt_ps(interpolatedInverseZ, currentZInBuffer);
+		writeFlag = _mm_and_ps(writeFlag, depthPassed);
+		counts.passed += PopCount4(_mm_movemask_ps(writeFlag));
+	}
+
+	// Only proceed if at least one of the four fragments passes the depth buffer test.
+	if (_mm_test_all_zeros(_mm_castps_si128(writeFlag), _mm_castps_si128(writeFlag))) {
+		return;
+	}
+	counts.written += PopCount4(_mm_movemask_ps(writeFlag));
+	if (overdrawHeatmap) {
+		CountOverdraw4(pixelIndex, writeFlag);
+	}
+
+	// Write to depth buffer using predication
+	if constexpr (DepthMode::write) {
+		_mm_store_ps(depthBuffer + pixelIndex,
+			_mm_or_ps(
+				_mm_and_ps(writeFlag, interpolatedInverseZ), // writeFlag & interpolatedInvZ
+				_mm_andnot_ps(writeFlag, currentZInBuffer)   // !writeFlag & currentZInBuffer
+			));
+	}
+
+	// One reciprocal shared by all varyings
+	const auto interpolatedZ = _mm_rcp_ps(interpolatedInverseZ); 
+	__m128 varyings[nVaryings];
+	for (int i = 0; i < nVaryings; i++) {
+		varyings[i] = _mm_mul_ps(interpolatedVaryings[i], interpolatedZ);
+	}
+
+	// Only shade (fetch textures for) pixels which will be written
+	const auto origBufferVal = _mm_load_si128((const __m128i*)(colorBuffer + pixelIndex));
+	const auto newBufferVal = BlendMode::Blend(
+		FragmentShader::Shade(varyings, _mm_movemask_ps(writeFlag), uniforms), origBufferVal);
+
+	// More predication
+	_mm_store_si128((__m128i*)(colorBuffer + pixelIndex),
+		_mm_blendv_epi8(origBufferVal, newBufferVal, _mm_castps_si128(writeFlag)));
 }
 
-static inline __m128 orient2d(const Vec2& a, const Vec2& b, __m128 cx, __m128 cy) {
-	auto ax = _mm_set1_ps(a.x);
-	auto ay = _mm_set1_ps(a.y);
-	auto bx = _mm_set1_ps(b.x);
-	auto by = _mm_set1_ps(b.y);
+// DrawTriangleSSE for triangles whose bounding box fits in nRows rows of nGroups aligned groups of four pixels, which
+// is most of them on dense meshes. The coverage of the whole block is evaluated first, with the loops unrolled, so
+// that triangles which cover no pixel center return before their depth and varyings are set up. The values are
+// stepped exactly as in DrawTriangleSSE, both kernels draw the same pixels with the same results.
+template<int nRows, int nGroups, typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+void Renderer::DrawSmallTriangleSSE(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms)
+{
+	constexpr int simdAlignment = 4;
+
+	const int minX = t.minX[lane];
+	const int alignedMinX = (minX / simdAlignment) * simdAlignment;
+	const int minY = t.minY[lane];
+	// The block can reach past the bounding box and the screen, those rows and groups are masked out, as are those
+	// outside the scissor rect of a partial frame
+	const ScissorRect rect = DrawRect(alignedMinX, minY, t.maxX[lane], t.maxY[lane]);
+	const int firstGroup = (rect.minX - alignedMinX) / simdAlignment;
+	const int lastGroup = (rect.maxX - alignedMinX) / simdAlignment;
+
+	const auto firstFourInRowDx = _mm_add_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), _mm_set1_ps((float)(alignedMinX - minX)));
+	const auto zero = _mm_setzero_ps();
 
-	return _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(bx, ax), _mm_sub_ps(cy, ay)), _mm_mul_ps(_mm_sub_ps(by, ay), _mm_sub_ps(cx, ax)));
+	__m128 wRow[3], wColumnIncrement[3], wRowIncrement[3];
+	for (int edge = 0; edge < 3; edge++) {
+		wRow[edge] = _mm_add_ps(_mm_set1_ps(t.w[edge][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.wDx[edge][lane])));
+		wColumnIncrement[edge] = _mm_set1_ps(simdAlignment * t.wDx[edge][lane]);
+		wRowIncrement[edge] = _mm_set1_ps(t.wDy[edge][lane]);
+	}
+
+	// Bit 4 * (row * nGroups + group) + i is set if pixel i of the group is covered and inside the drawn rect
+	const int boxRowBits = (1 << (4 * (lastGroup + 1))) - (1 << (4 * firstGroup));
+	int boxBits = 0;
+	for (int row = rect.minY - minY; row <= rect.maxY - minY; row++) {
+		boxBits |= boxRowBits << (4 * nGroups * row);
+	}
+	__m128 coverage[nRows][nGroups];
+	int coveredBits = 0;
+	for (int row = 0; row < nRows; row++) {
+		__m128 w[3] = { wRow[0], wRow[1], wRow[2] };
+		for (int group = 0; group < nGroups; group++) {
+			auto mask = _mm_and_ps(_mm_cmpge_ps(w[0], zero), _mm_and_ps(_mm_cmpge_ps(w[1], zero), _mm_cmpge_ps(w[2], zero)));
+			coverage[row][group] = mask;
+			coveredBits |= _mm_movemask_ps(mask) << (4 * (row * nGroups + group));
+			for (int edge = 0; edge < 3; edge++) {
+				w[edge] = _mm_add_ps(w[edge], wColumnIncrement[edge]);
+			}
+		}
+		for (int edge = 0; edge < 3; edge++) {
+			wRow[edge] = _mm_add_ps(wRow[edge], wRowIncrement[edge]);
+		}
+	}
+	coveredBits &= boxBits;
+
+	// Slivers between pixel centers are common at this size
+	if (coveredBits == 0) {
+		return;
+	}
+
+	auto inverseZRow = _mm_add_ps(_mm_set1_ps(t.inverseZ[0][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.inverseZ[1][lane])));
+	const auto inverseZColumnIncrement = _mm_set1_ps(simdAlignment * t.inverseZ[1][lane]);
+	const auto inverseZRowIncrement = _mm_set1_ps(t.inverseZ[2][lane]);
+
+	__m128 varyingsRow[nVaryings], varyingsColumnIncrement[nVaryings], varyingsRowIncrement[nVaryings];
+	for (int i = 0; i < nVaryings; i++) {
+		varyingsRow[i] = _mm_add_ps(_mm_set1_ps(t.varyings[i][0][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.varyings[i][1][lane])));
+		varyingsColumnIncrement[i] = _mm_set1_ps(simdAlignment * t.varyings[i][1][lane]);
+		varyingsRowIncrement[i] = _mm_set1_ps(t.varyings[i][2][lane]);
+	}
+
+	FragmentCounts counts;
+	for (int row = 0; row < nRows; row++) {
+		auto interpolatedInverseZ = inverseZRow;
+		__m128 interpolatedVaryings[nVaryings];
+		for (int i = 0; i < nVaryings; i++) {
+			interpolatedVaryings[i] = varyingsRow[i];
+		}
+
+		for (int group = 0; group < nGroups; group++) {
+			if ((coveredBits >> (4 * (row * nGroups + group))) & 0xF) {
+				ShadeFragments4<FragmentShader, DepthMode, BlendMode, nVaryings>((minY + row) * width + alignedMinX + group * simdAlignment,
+					coverage[row][group], interpolatedInverseZ, interpolatedVaryings, uniforms, counts);
+			}
+
+			interpolatedInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZColumnIncrement);
+			for (int i = 0; i < nVaryings; i++) {
+				interpolatedVaryings[i] = _mm_add_ps(interpolatedVaryings[i], varyingsColumnIncrement[i]);
+			}
+		}
+
+		inverseZRow = _mm_add_ps(inverseZRow, inverseZRowIncrement);
+		for (int i = 0; i < nVaryings; i++) {
+			varyingsRow[i] = _mm_add_ps(varyingsRow[i], varyingsRowIncrement[i]);
+		}
+	}
+
+	AddFragmentCounts(counts);
+}
+
+// DrawTriangleSSE for triangles with a wide bounding box, most of which can be empty. For each row the span of
+// pixel centers inside all three edges is solved for directly. Groups of four pixels inside the span are shaded
+// without coverage tests, only the groups at its two ends are tested against the edges. Depth and varyings are
+// evaluated at the start of each span instead of being stepped across the bounding box, which rounds differently
+// from DrawTriangleSSE, so this isn't used when the depth test only passes on equal depth.
+template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+void Renderer::DrawTriangleSpansSSE(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms)
+{
+	constexpr int simdAlignment = 4;
+
+	const int minX = t.minX[lane];
+	const int maxX = t.maxX[lane];
+	const int minY = t.minY[lane];
+	const int maxY = t.maxY[lane];
+	const int lastOffset = maxX - minX;
+
+	// Offsets of a group's pixels from its first one
+	const auto groupDx = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	const auto zero = _mm_setzero_ps();
+	const auto allOnes = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+	__m128 wDx[3];
+	float inverseWDx[3];
+	for (int edge = 0; edge < 3; edge++) {
+		wDx[edge] = _mm_set1_ps(t.wDx[edge][lane]);
+		inverseWDx[edge] = t.wDx[edge][lane] != 0.0f ? 1.0f / t.wDx[edge][lane] : 0.0f;
+	}
+	const auto inverseZDx = _mm_set1_ps(t.inverseZ[1][lane]);
+	const auto inverseZColumnIncrement = _mm_set1_ps(simdAlignment * t.inverseZ[1][lane]);
+	__m128 varyingsDx[nVaryings], varyingsColumnIncrement[nVaryings];
+	for (int i = 0; i < nVaryings; i++) {
+		varyingsDx[i] = _mm_set1_ps(t.varyings[i][1][lane]);
+		varyingsColumnIncrement[i] = _mm_set1_ps(simdAlignment * t.varyings[i][1][lane]);
+	}
+
+	// Rows are evaluated directly, only the scissor rect of a partial frame is drawn
+	const ScissorRect rect = DrawRect((minX / simdAlignment) * simdAlignment, minY, maxX, maxY);
+	FragmentCounts counts;
+
+	for (int y = rect.minY; y <= rect.maxY; y++) {
+		const float dy = (float)(y - minY);
+		float wRow[3];
+		for (int edge = 0; edge < 3; edge++) {
+			wRow[edge] = t.w[edge][lane] + dy * t.wDy[edge][lane];
+		}
+
+		// Offsets from minX where each edge function crosses zero. Those increasing to the right bound the span on
+		// the left, the others on the right.
+		float left = 0.0f;
+		float right = (float)lastOffset;
+		bool empty = false;
+		for (int edge = 0; edge < 3; edge++) {
+			const float crossing = -wRow[edge] * inverseWDx[edge];
+			if (t.wDx[edge][lane] > 0.0f) {
+				left = std::max(left, crossing);
+			}
+			else if (t.wDx[edge][lane] < 0.0f) {
+				right = std::min(right, crossing);
+			}
+			else {
+				empty |= wRow[edge] < 0.0f;
+			}
+		}
+		if (empty || left > right + 1.0f) {
+			continue;
+		}
+
+		// One pixel of margin on both ends for the rounding of the crossings. The pixels in between are covered if
+		// both of the outermost are, the edge functions being linear.
+		const int first = std::max((int)std::ceil(left) - 1, 0);
+		const int last = std::min((int)std::floor(right) + 1, lastOffset);
+		int fullFirst = first + 2;
+		int fullLast = last - 2;
+		for (int edge = 0; edge < 3 && fullFirst <= fullLast; edge++) {
+			if (wRow[edge] + fullFirst * t.wDx[edge][lane] < 0.0f || wRow[edge] + fullLast * t.wDx[edge][lane] < 0.0f) {
+				fullFirst = lastOffset + 1;
+			}
+		}
+
+		// Depth and varyings at the first group of the span
+		const int spanMinX = ((minX + first) / simdAlignment) * simdAlignment;
+		const auto spanDx = _mm_add_ps(groupDx, _mm_set1_ps((float)(spanMinX - minX)));
+		auto interpolatedInverseZ = _mm_add_ps(_mm_set1_ps(t.inverseZ[0][lane] + dy * t.inverseZ[2][lane]), _mm_mul_ps(spanDx, inverseZDx));
+		__m128 interpolatedVaryings[nVaryings];
+		for (int i = 0; i < nVaryings; i++) {
+			interpolatedVaryings[i] = _mm_add_ps(_mm_set1_ps(t.varyings[i][0][lane] + dy * t.varyings[i][2][lane]), _mm_mul_ps(spanDx, varyingsDx[i]));
+		}
+
+		// Stepped to the scissor rect from the start of the span, as in a full frame
+		int x = spanMinX;
+		for (; x < rect.minX; x += simdAlignment) {
+			interpolatedInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZColumnIncrement);
+			for (int i = 0; i < nVaryings; i++) {
+				interpolatedVaryings[i] = _mm_add_ps(interpolatedVaryings[i], varyingsColumnIncrement[i]);
+			}
+		}
+
+		const int rowOffset = y * width;
+		const int spanMaxX = std::min(minX + last, rect.maxX);
+		for (; x <= spanMaxX; x += simdAlignment) {
+			const int offset = x - minX;
+			auto mask = allOnes;
+			if (offset < fullFirst || offset + simdAlignment - 1 > fullLast) {
+				const auto dx = _mm_add_ps(groupDx, _mm_set1_ps((float)offset));
+				for (int edge = 0; edge < 3; edge++) {
+					mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_add_ps(_mm_set1_ps(wRow[edge]), _mm_mul_ps(dx, wDx[edge])), zero));
+				}
+			}
+			if (!_mm_test_all_zeros(_mm_castps_si128(mask), _mm_castps_si128(mask))) {
+				ShadeFragments4<FragmentShader, DepthMode, BlendMode, nVaryings>(rowOffset + x, mask, interpolatedInverseZ,
+					interpolatedVaryings, uniforms, counts);
+			}
+
+			interpolatedInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZColumnIncrement);
+			for (int i = 0; i < nVaryings; i++) {
+				interpolatedVaryings[i] = _mm_add_ps(interpolatedVaryings[i], varyingsColumnIncrement[i]);
+			}
+		}
+	}
+
+	AddFragmentCounts(counts);
 }
 
-// t.a.z, t.b.z and t.c.z are the inverse depths (1 / w after multiplication by perspective matrix)
-// This is needed for perspective correct interpolation
-void Renderer::DrawTexturedTriangleSSE(Triangle& t, const Texture& texture) 
+// Proceed at your own risk
+
+// Inverse depths (1 / w after multiplication by perspective matrix) and varyings divided by w come from the
+// setup as plane equations. This is needed for perspective correct interpolation.
+template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+void Renderer::DrawTriangleSSE(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms) 
 {
 	constexpr int simdAlignment = 4;
 
-	// Triangle bounding box ( +0.5f for pixel centers )
-	auto xBounds = std::minmax({ t.a.x, t.b.x, t.c.x });
-	auto yBounds = std::minmax({ t.a.y, t.b.y, t.c.y });
-	float minX = (int)xBounds.first + 0.5f;
-	float maxX = (int)xBounds.second + 0.5f;
-	float minY = (int)yBounds.first + 0.5f;
-	float maxY = (int)yBounds.second + 0.5f;
-
-	// Clamp to screen bounds. This allows clipping only to the near plane when clipping triangles against frustum planes.
-	// Clipping against the other planes is automatically taken care of by simply clamping to screen bounds (except far plane which we're not clipping against).
-	if (minX < 0) minX = 0.5f;
-	if (maxX > width - 1) maxX = width - 1.0f; 
-	if (minY < 0) minY = 0.5f;
-	if (maxY > height - 1) maxY = height - 4.5f;
-
-	// Align AABB for SIMD
-	minX = ((int)minX / simdAlignment) * simdAlignment; // round down
-	maxX = ((int)(maxX + 0.999f) / simdAlignment) * simdAlignment; // round up
-	minX += 0.5f;
-	maxX += 0.5f;
-
-	Vec2 v0 = { t.a.x, t.a.y };
-	Vec2 v1 = { t.b.x, t.b.y };
-	Vec2 v2 = { t.c.x, t.c.y };
-
-	// Used for calculating barycentric coordinates
-	auto triAreaTimes2 = orient2d(v0, v1, _mm_set1_ps(v2.x), _mm_set1_ps(v2.y));
-	auto inverseTriAreaTimes2 = _mm_rcp_ps(triAreaTimes2); // 1.0f / triAreaTimes2
-
-	// Divide (AKA multiply by inverse) the vertex attributes by view space Z for perspective correct interpolation
-	Vec2 aInverseDepthTimesUV = t.a.z * t.aUV;
-	Vec2 bInverseDepthTimesUV = t.b.z * t.bUV;
-	Vec2 cInverseDepthTimesUV = t.c.z * t.cUV;
-
-	// Used for interpolating texture coordinates and inverse z's. 
-	const auto abDeltaU = _mm_set1_ps(bInverseDepthTimesUV.u - aInverseDepthTimesUV.u);
-	const auto abDeltaV = _mm_set1_ps(bInverseDepthTimesUV.v - aInverseDepthTimesUV.v);
-	const auto acDeltaU = _mm_set1_ps(cInverseDepthTimesUV.u - aInverseDepthTimesUV.u);
-	const auto acDeltaV = _mm_set1_ps(cInverseDepthTimesUV.v - aInverseDepthTimesUV.v);
-	auto aInverseDepthTimesU = _mm_set1_ps(t.a.z * t.aUV.u);
-	auto aInverseDepthTimesV = _mm_set1_ps(t.a.z * t.aUV.v);
-
-	const auto abDeltaInverseZ = _mm_set1_ps(t.b.z - t.a.z);
-	const auto acDeltaInverseZ = _mm_set1_ps(t.c.z - t.a.z);
-	const auto aInverseZ = _mm_set1_ps(t.a.z);
-
-	Vec2 p{ minX, minY };
-
-	auto firstFourInRowX = _mm_set_ps(p.x + 3.0f, p.x + 2.0f, p.x + 1.0f, p.x);
-	auto firstFourInRowY = _mm_set1_ps(p.y);
-	
+	// Align bounding box for SIMD (round down). The setup already clamped it to screen bounds.
+	const int minX = t.minX[lane];
+	const int alignedMinX = (minX / simdAlignment) * simdAlignment;
+	const int maxX = t.maxX[lane];
+	const int minY = t.minY[lane];
+	const int maxY = t.maxY[lane];
+
+	// Small triangles fit in a 4x4 or an 8x2 block
+	if (maxX - alignedMinX < simdAlignment && maxY - minY < 4) {
+		DrawSmallTriangleSSE<4, 1, FragmentShader, DepthMode, BlendMode>(t, lane, uniforms);
+		return;
+	}
+	if (maxX - alignedMinX < 2 * simdAlignment && maxY - minY < 2) {
+		DrawSmallTriangleSSE<2, 2, FragmentShader, DepthMode, BlendMode>(t, lane, uniforms);
+		return;
+	}
+	// Wide ones are filled span by span
+	if constexpr (!DepthMode::passEqual) {
+		if (maxX - minX >= spanFillMinWidth && maxY - minY >= spanFillMinHeight) {
+			DrawTriangleSpansSSE<FragmentShader, DepthMode, BlendMode>(t, lane, uniforms);
+			return;
+		}
+	}
+
+	// Offsets of the first four pixels in a row from the bounding box origin
+	const auto firstFourInRowDx = _mm_add_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), _mm_set1_ps((float)(alignedMinX - minX)));
+
+	// Inverse z and the varyings are stepped like the edge functions: evaluated once for the first four pixels
+	// of the bounding box and then incremented per row and per four pixels.
+	auto inverseZRow = _mm_add_ps(_mm_set1_ps(t.inverseZ[0][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.inverseZ[1][lane])));
+	const auto inverseZColumnIncrement = _mm_set1_ps(simdAlignment * t.inverseZ[1][lane]);
+	const auto inverseZRowIncrement = _mm_set1_ps(t.inverseZ[2][lane]);
+
+	__m128 varyingsRow[nVaryings], varyingsColumnIncrement[nVaryings], varyingsRowIncrement[nVaryings];
+	for (int i = 0; i < nVaryings; i++) {
+		varyingsRow[i] = _mm_add_ps(_mm_set1_ps(t.varyings[i][0][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.varyings[i][1][lane])));
+		varyingsColumnIncrement[i] = _mm_set1_ps(simdAlignment * t.varyings[i][1][lane]);
+		varyingsRowIncrement[i] = _mm_set1_ps(t.varyings[i][2][lane]);
+	}
+
 	// Calculate the orientation of the first four pixels in the first row of the bounding box.
-	auto w0Row = orient2d(v1, v2, firstFourInRowX, firstFourInRowY);
-	auto w1Row = orient2d(v2, v0, firstFourInRowX, firstFourInRowY);
-	auto w2Row = orient2d(v0, v1, firstFourInRowX, firstFourInRowY);
+	auto w0Row = _mm_add_ps(_mm_set1_ps(t.w[0][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.wDx[0][lane])));
+	auto w1Row = _mm_add_ps(_mm_set1_ps(t.w[1][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.wDx[1][lane])));
+	auto w2Row = _mm_add_ps(_mm_set1_ps(t.w[2][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.wDx[2][lane])));
 
 	// Every time we move to the next set of 4 pixels in the row, these values can simply be added
 	// to w0, w1 and w2 rather than recalculating the orientation.
-	auto w0ColumnIncrement = _mm_set1_ps(simdAlignment * (v1.y - v2.y));
-	auto w1ColumnIncrement = _mm_set1_ps(simdAlignment * (v2.y - v0.y));
-	auto w2ColumnIncrement = _mm_set1_ps(simdAlignment * (v0.y - v1.y));
+	auto w0ColumnIncrement = _mm_set1_ps(simdAlignment * t.wDx[0][lane]);
+	auto w1ColumnIncrement = _mm_set1_ps(simdAlignment * t.wDx[1][lane]);
+	auto w2ColumnIncrement = _mm_set1_ps(simdAlignment * t.wDx[2][lane]);
 
 	// Every time we move to the next row of the bounding box, these values can simply be added
 	// to w0Row, w1Row and w2Row.
-	auto w0RowIncrement = _mm_set1_ps(v2.x - v1.x);
-	auto w1RowIncrement = _mm_set1_ps(v0.x - v2.x);
-	auto w2RowIncrement = _mm_set1_ps(v1.x - v0.x);
+	auto w0RowIncrement = _mm_set1_ps(t.wDy[0][lane]);
+	auto w1RowIncrement = _mm_set1_ps(t.wDy[1][lane]);
+	auto w2RowIncrement = _mm_set1_ps(t.wDy[2][lane]);
 
 	// From Game Engine Architecture. Apparently this is a portable way to cast between uint and float.
 	// Used to treat float as bytes.
@@ -272,15 +1187,44 @@ void Renderer::DrawTexturedTriangleSSE(Triangle& t, const Texture& texture)
 	all1Bits.u32 = 0xFFFFFFFF;
 	auto zero = _mm_setzero_ps();
 
-	for (p.y = minY; p.y <= maxY; p.y++) 
+	// Counters, added to the thread's totals once per triangle
+	FragmentCounts counts;
+
+	// A partial frame only draws the scissor rect, the values are stepped there from the bounding box origin
+	const ScissorRect rect = DrawRect(alignedMinX, minY, maxX, maxY);
+	for (int y = minY; y < rect.minY; y++) {
+		w0Row = _mm_add_ps(w0Row, w0RowIncrement);
+		w1Row = _mm_add_ps(w1Row, w1RowIncrement);
+		w2Row = _mm_add_ps(w2Row, w2RowIncrement);
+		inverseZRow = _mm_add_ps(inverseZRow, inverseZRowIncrement);
+		for (int i = 0; i < nVaryings; i++) {
+			varyingsRow[i] = _mm_add_ps(varyingsRow[i], varyingsRowIncrement[i]);
+		}
+	}
+
+	for (int y = rect.minY; y <= rect.maxY; y++) 
 	{
-		const int rowOffset = (int)p.y * width;
+		const int rowOffset = y * width;
 
 		auto w0 = w0Row;
 		auto w1 = w1Row;
 		auto w2 = w2Row;
+		auto interpolatedInverseZ = inverseZRow;
+		__m128 interpolatedVaryings[nVaryings];
+		for (int i = 0; i < nVaryings; i++) {
+			interpolatedVaryings[i] = varyingsRow[i];
+		}
+		for (int x = alignedMinX; x < rect.minX; x += simdAlignment) {
+			w0 = _mm_add_ps(w0, w0ColumnIncrement);
+			w1 = _mm_add_ps(w1, w1ColumnIncrement);
+			w2 = _mm_add_ps(w2, w2ColumnIncrement);
+			interpolatedInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZColumnIncrement);
+			for (int i = 0; i < nVaryings; i++) {
+				interpolatedVaryings[i] = _mm_add_ps(interpolatedVaryings[i], varyingsColumnIncrement[i]);
+			}
+		}
 
-		for (p.x = minX; p.x <= maxX; p.x += 4.0f) 
+		for (int x = rect.minX; x <= rect.maxX; x += simdAlignment) 
 		{
 			auto writeFlag = _mm_set1_ps(all1Bits.f32);
 			writeFlag = _mm_and_ps(writeFlag, _mm_cmpge_ps(w0, zero));
@@ -289,70 +1233,520 @@ void Renderer::DrawTexturedTriangleSSE(Triangle& t, const Texture& texture)
 			
 			// Only proceed if at least one of the four pixel centers lies inside of the triangle.
 			if (!_mm_test_all_zeros(_mm_castps_si128(writeFlag), _mm_castps_si128(writeFlag))) {
-				auto beta = _mm_mul_ps(w1, inverseTriAreaTimes2);
-				auto gamma = _mm_mul_ps(w2, inverseTriAreaTimes2);
-				
-				// Depth buffer test
-				auto interpolatedInverseZ = _mm_add_ps(aInverseZ, _mm_add_ps(_mm_mul_ps(beta, abDeltaInverseZ), _mm_mul_ps(gamma, acDeltaInverseZ)));
-				const int pixelIndex = rowOffset + p.x;
-				auto currentZInBuffer = _mm_load_ps(depthBuffer + pixelIndex);
+				ShadeFragments4<FragmentShader, DepthMode, BlendMode, nVaryings>(rowOffset + x, writeFlag, interpolatedInverseZ,
+					interpolatedVaryings, uniforms, counts);
+			}
 
-				writeFlag = _mm_and_ps(writeFlag, _mm_cmpgt_ps(interpolatedInverseZ, currentZInBuffer));
+			w0 = _mm_add_ps(w0, w0ColumnIncrement);
+			w1 = _mm_add_ps(w1, w1ColumnIncrement);
+			w2 = _mm_add_ps(w2, w2ColumnIncrement);
+			interpolatedInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZColumnIncrement);
+			for (int i = 0; i < nVaryings; i++) {
+				interpolatedVaryings[i] = _mm_add_ps(interpolatedVaryings[i], varyingsColumnIncrement[i]);
+			}
+		}
 
-				// Only proceed if at least one of the four fragments passes the depth buffer test.
-				if (!_mm_test_all_zeros(_mm_castps_si128(writeFlag), _mm_castps_si128(writeFlag))) {
-					// Write to depth buffer using predication
-					_mm_store_ps(depthBuffer + pixelIndex,
-						_mm_or_ps(
-							_mm_and_ps(writeFlag, interpolatedInverseZ), // writeFlag & interpolatedInvZ
-							_mm_andnot_ps(writeFlag, currentZInBuffer)   // !writeFlag & currentZInBuffer
-						));
-
-					auto interpolatedTexCoordU = _mm_add_ps(aInverseDepthTimesU, _mm_add_ps(_mm_mul_ps(beta, abDeltaU), _mm_mul_ps(gamma, acDeltaU)));
-					auto interpolatedTexCoordV = _mm_add_ps(aInverseDepthTimesV, _mm_add_ps(_mm_mul_ps(beta, abDeltaV), _mm_mul_ps(gamma, acDeltaV)));
-
-					const auto interpolatedZ = _mm_rcp_ps(interpolatedInverseZ); 
-
-					interpolatedTexCoordU = _mm_mul_ps(interpolatedTexCoordU, interpolatedZ);
-					interpolatedTexCoordV = _mm_mul_ps(interpolatedTexCoordV, interpolatedZ);
-					
-					// Magenta is easy to spot. Pixels that shouldn't be colored will show up as magenta.
-					U32F32 colors[4] = {
-						Colors::magenta, Colors::magenta, Colors::magenta, Colors::magenta
-					};
-
-					// Only fetch textures for pixels which will be written
-					if (GetByIndex<0>(writeFlag) != 0.0f) {
-						colors[0].u32 = texture(GetByIndex<0>(interpolatedTexCoordU), GetByIndex<0>(interpolatedTexCoordV));
+		w0Row = _mm_add_ps(w0Row, w0RowIncrement);
+		w1Row = _mm_add_ps(w1Row, w1RowIncrement);
+		w2Row = _mm_add_ps(w2Row, w2RowIncrement);
+		inverseZRow = _mm_add_ps(inverseZRow, inverseZRowIncrement);
+		for (int i = 0; i < nVaryings; i++) {
+			varyingsRow[i] = _mm_add_ps(varyingsRow[i], varyingsRowIncrement[i]);
+		}
+	}
+
+	AddFragmentCounts(counts);
+}
+
+// Sample positions relative to the pixel center, the usual rotated grid so that near horizontal and near
+// vertical edges both see four distinct sample rows/columns
+static constexpr float msaaSampleX[msaaSampleCount] = { -2.0f / 16, 6.0f / 16, -6.0f / 16, 2.0f / 16 };
+static constexpr float msaaSampleY[msaaSampleCount] = { -6.0f / 16, -2.0f / 16, 2.0f / 16, 6.0f / 16 };
+
+// Like DrawTriangleSSE, four pixels at a time, but the edge functions and depth are evaluated at each pixel's four
+// samples by adding per sample offsets to their values at the pixel centers. The fragment shader runs once per
+// pixel on the samples that pass. It is evaluated at the pixel center if that is covered, otherwise at the first
+// covered sample, so that the varyings aren't extrapolated past the triangle's edges.
+template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+void Renderer::DrawTriangleMSAA(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms)
+{
+	constexpr int simdAlignment = 4;
+
+	// The setup's bounding box also bounds the samples, which lie within the pixels
+	const int minX = t.minX[lane];
+	const int alignedMinX = (minX / simdAlignment) * simdAlignment;
+	const int maxX = t.maxX[lane];
+	const int minY = t.minY[lane];
+	const int maxY = t.maxY[lane];
+
+	const auto firstFourInRowDx = _mm_add_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), _mm_set1_ps((float)(alignedMinX - minX)));
+
+	auto inverseZRow = _mm_add_ps(_mm_set1_ps(t.inverseZ[0][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.inverseZ[1][lane])));
+	const auto inverseZDx = _mm_set1_ps(t.inverseZ[1][lane]);
+	const auto inverseZDy = _mm_set1_ps(t.inverseZ[2][lane]);
+	const auto inverseZColumnIncrement = _mm_set1_ps(simdAlignment * t.inverseZ[1][lane]);
+
+	__m128 varyingsRow[nVaryings], varyingsDx[nVaryings], varyingsDy[nVaryings], varyingsColumnIncrement[nVaryings];
+	for (int i = 0; i < nVaryings; i++) {
+		varyingsRow[i] = _mm_add_ps(_mm_set1_ps(t.varyings[i][0][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.varyings[i][1][lane])));
+		varyingsDx[i] = _mm_set1_ps(t.varyings[i][1][lane]);
+		varyingsDy[i] = _mm_set1_ps(t.varyings[i][2][lane]);
+		varyingsColumnIncrement[i] = _mm_set1_ps(simdAlignment * t.varyings[i][1][lane]);
+	}
+
+	__m128 wRow[3], wColumnIncrement[3], wRowIncrement[3];
+	for (int e = 0; e < 3; e++) {
+		wRow[e] = _mm_add_ps(_mm_set1_ps(t.w[e][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.wDx[e][lane])));
+		wColumnIncrement[e] = _mm_set1_ps(simdAlignment * t.wDx[e][lane]);
+		wRowIncrement[e] = _mm_set1_ps(t.wDy[e][lane]);
+	}
+
+	// Constant offsets from the pixel center to each sample
+	__m128 wSampleOffset[msaaSampleCount][3], inverseZSampleOffset[msaaSampleCount];
+	for (int s = 0; s < msaaSampleCount; s++) {
+		for (int e = 0; e < 3; e++) {
+			wSampleOffset[s][e] = _mm_set1_ps(t.wDx[e][lane] * msaaSampleX[s] + t.wDy[e][lane] * msaaSampleY[s]);
+		}
+		inverseZSampleOffset[s] = _mm_set1_ps(t.inverseZ[1][lane] * msaaSampleX[s] + t.inverseZ[2][lane] * msaaSampleY[s]);
+	}
+
+	const auto zero = _mm_setzero_ps();
+	const auto zeroi = _mm_setzero_si128();
+	int tested = 0;
+	int passed = 0;
+	int written = 0;
+
+	// A partial frame only draws the scissor rect, the values are stepped there from the bounding box origin
+	const ScissorRect rect = DrawRect(alignedMinX, minY, maxX, maxY);
+	for (int y = minY; y < rect.minY; y++) {
+		for (int e = 0; e < 3; e++) {
+			wRow[e] = _mm_add_ps(wRow[e], wRowIncrement[e]);
+		}
+		inverseZRow = _mm_add_ps(inverseZRow, inverseZDy);
+		for (int i = 0; i < nVaryings; i++) {
+			varyingsRow[i] = _mm_add_ps(varyingsRow[i], varyingsDy[i]);
+		}
+	}
+
+	for (int y = rect.minY; y <= rect.maxY; y++)
+	{
+		const int rowOffset = y * width;
+
+		__m128 w[3] = { wRow[0], wRow[1], wRow[2] };
+		auto interpolatedInverseZ = inverseZRow;
+		__m128 interpolatedVaryings[nVaryings];
+		for (int i = 0; i < nVaryings; i++) {
+			interpolatedVaryings[i] = varyingsRow[i];
+		}
+		for (int x = alignedMinX; x < rect.minX; x += simdAlignment) {
+			for (int e = 0; e < 3; e++) {
+				w[e] = _mm_add_ps(w[e], wColumnIncrement[e]);
+			}
+			interpolatedInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZColumnIncrement);
+			for (int i = 0; i < nVaryings; i++) {
+				interpolatedVaryings[i] = _mm_add_ps(interpolatedVaryings[i], varyingsColumnIncrement[i]);
+			}
+		}
+
+		for (int x = rect.minX; x <= rect.maxX; x += simdAlignment)
+		{
+			__m128 covered[msaaSampleCount];
+			auto anyCovered = zero;
+			for (int s = 0; s < msaaSampleCount; s++) {
+				covered[s] = _mm_and_ps(_mm_and_ps(
+					_mm_cmpge_ps(_mm_add_ps(w[0], wSampleOffset[s][0]), zero),
+					_mm_cmpge_ps(_mm_add_ps(w[1], wSampleOffset[s][1]), zero)),
+					_mm_cmpge_ps(_mm_add_ps(w[2], wSampleOffset[s][2]), zero));
+				anyCovered = _mm_or_ps(anyCovered, covered[s]);
+			}
+
+			if (!_mm_test_all_zeros(_mm_castps_si128(anyCovered), _mm_castps_si128(anyCovered))) {
+				const int pixelIndex = rowOffset + x;
+				float* sampleDepth = msaaDepth + pixelIndex * msaaSampleCount;
+
+				// Per sample depth test
+				__m128 pass[msaaSampleCount];
+				auto anyPass = zero;
+				auto allPass = _mm_castsi128_ps(_mm_cmpeq_epi32(zeroi, zeroi));
+				for (int s = 0; s < msaaSampleCount; s++) {
+					const auto sampleInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZSampleOffset[s]);
+					const auto currentZInBuffer = _mm_load_ps(sampleDepth + s * simdAlignment);
+					pass[s] = covered[s];
+					if constexpr (DepthMode::test) {
+						const auto depthPassed = DepthMode::passEqual ?
+							_mm_cmpge_ps(sampleInverseZ, currentZInBuffer) : _mm_cmpgt_ps(sampleInverseZ, currentZInBuffer);
+						pass[s] = _mm_and_ps(pass[s], depthPassed);
 					}
-					if (GetByIndex<1>(writeFlag) != 0.0f) {
-						colors[1].u32 = texture(GetByIndex<1>(interpolatedTexCoordU), GetByIndex<1>(interpolatedTexCoordV));
+					if constexpr (DepthMode::write) {
+						_mm_store_ps(sampleDepth + s * simdAlignment, _mm_blendv_ps(currentZInBuffer, sampleInverseZ, pass[s]));
 					}
-					if (GetByIndex<2>(writeFlag) != 0.0f) {
-						colors[2].u32 = texture(GetByIndex<2>(interpolatedTexCoordU), GetByIndex<2>(interpolatedTexCoordV));
+					anyPass = _mm_or_ps(anyPass, pass[s]);
+					allPass = _mm_and_ps(allPass, pass[s]);
+				}
+				tested += PopCount4(_mm_movemask_ps(anyCovered));
+				passed += PopCount4(_mm_movemask_ps(anyPass));
+
+				if (!_mm_test_all_zeros(_mm_castps_si128(anyPass), _mm_castps_si128(anyPass))) {
+					written += PopCount4(_mm_movemask_ps(anyPass));
+					if (overdrawHeatmap) {
+						CountOverdraw4(pixelIndex, anyPass);
+					}
+
+					// Shading position, relative to the pixel center
+					auto shadeInverseZ = interpolatedInverseZ;
+					__m128 shadeVaryings[nVaryings];
+					for (int i = 0; i < nVaryings; i++) {
+						shadeVaryings[i] = interpolatedVaryings[i];
 					}
-					if (GetByIndex<3>(writeFlag) != 0.0f) {
-						colors[3].u32 = texture(GetByIndex<3>(interpolatedTexCoordU), GetByIndex<3>(interpolatedTexCoordV));
+					const auto centerCovered = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w[0], zero), _mm_cmpge_ps(w[1], zero)), _mm_cmpge_ps(w[2], zero));
+					if (_mm_movemask_ps(_mm_andnot_ps(centerCovered, anyPass)) != 0) {
+						auto dx = zero;
+						auto dy = zero;
+						for (int s = msaaSampleCount - 1; s >= 0; s--) {
+							dx = _mm_blendv_ps(dx, _mm_set1_ps(msaaSampleX[s]), covered[s]);
+							dy = _mm_blendv_ps(dy, _mm_set1_ps(msaaSampleY[s]), covered[s]);
+						}
+						dx = _mm_andnot_ps(centerCovered, dx);
+						dy = _mm_andnot_ps(centerCovered, dy);
+						shadeInverseZ = _mm_add_ps(shadeInverseZ, _mm_add_ps(_mm_mul_ps(dx, inverseZDx), _mm_mul_ps(dy, inverseZDy)));
+						for (int i = 0; i < nVaryings; i++) {
+							shadeVaryings[i] = _mm_add_ps(shadeVaryings[i], _mm_add_ps(_mm_mul_ps(dx, varyingsDx[i]), _mm_mul_ps(dy, varyingsDy[i])));
+						}
 					}
 
-					// More predication
-					auto newBufferVal = _mm_set_ps(colors[3].f32, colors[2].f32, colors[1].f32, colors[0].f32);
-					auto origBufferVal = _mm_load_ps((const float*)colorBuffer + pixelIndex);
-					_mm_store_ps((float*)colorBuffer + pixelIndex,
-						_mm_or_ps(
-							_mm_and_ps(writeFlag, newBufferVal),
-							_mm_andnot_ps(writeFlag, origBufferVal)
-						));
+					const auto interpolatedZ = _mm_rcp_ps(shadeInverseZ);
+					for (int i = 0; i < nVaryings; i++) {
+						shadeVaryings[i] = _mm_mul_ps(shadeVaryings[i], interpolatedZ);
+					}
+					const auto shaded = FragmentShader::Shade(shadeVaryings, _mm_movemask_ps(anyPass), uniforms);
+
+					// Pixels keep a single color if all their samples get the same one: opaque fragments that cover
+					// the whole pixel (which also collapses pixels that had distinct samples), or any fragment
+					// covering a pixel that has a single color. Everything else is written per sample, expanding
+					// single color pixels first.
+					const auto flagBytes = _mm_cvtsi32_si128(*(const int*)(msaaFlags + pixelIndex));
+					const auto expanded = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_cvtepu8_epi32(flagBytes), zeroi));
+					const auto singleColorWrite = BlendMode::opaque ? allPass : _mm_andnot_ps(expanded, allPass);
+					const auto sampleWrite = _mm_andnot_ps(singleColorWrite, anyPass);
+					const auto pixelColors = _mm_load_si128((const __m128i*)(colorBuffer + pixelIndex));
+
+					if (!_mm_test_all_zeros(_mm_castps_si128(sampleWrite), _mm_castps_si128(sampleWrite))) {
+						const auto toExpand = _mm_castps_si128(_mm_andnot_ps(expanded, sampleWrite));
+						Color* sampleColors = msaaColor + pixelIndex * msaaSampleCount;
+						for (int s = 0; s < msaaSampleCount; s++) {
+							__m128i* sampleColor = (__m128i*)(sampleColors + s * simdAlignment);
+							const auto current = _mm_blendv_epi8(_mm_load_si128(sampleColor), pixelColors, toExpand);
+							_mm_store_si128(sampleColor,
+								_mm_blendv_epi8(current, BlendMode::Blend(shaded, current), _mm_castps_si128(_mm_and_ps(pass[s], sampleWrite))));
+						}
+					}
+					_mm_store_si128((__m128i*)(colorBuffer + pixelIndex),
+						_mm_blendv_epi8(pixelColors, BlendMode::Blend(shaded, pixelColors), _mm_castps_si128(singleColorWrite)));
+
+					const auto newFlags = _mm_and_si128(_mm_castps_si128(_mm_andnot_ps(singleColorWrite, _mm_or_ps(expanded, sampleWrite))), _mm_set1_epi32(1));
+					*(int*)(msaaFlags + pixelIndex) = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packus_epi32(newFlags, newFlags), zeroi));
+				}
+			}
+
+			for (int e = 0; e < 3; e++) {
+				w[e] = _mm_add_ps(w[e], wColumnIncrement[e]);
+			}
+			interpolatedInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZColumnIncrement);
+			for (int i = 0; i < nVaryings; i++) {
+				interpolatedVaryings[i] = _mm_add_ps(interpolatedVaryings[i], varyingsColumnIncrement[i]);
+			}
+		}
+
+		for (int e = 0; e < 3; e++) {
+			wRow[e] = _mm_add_ps(wRow[e], wRowIncrement[e]);
+		}
+		inverseZRow = _mm_add_ps(inverseZRow, inverseZDy);
+		for (int i = 0; i < nVaryings; i++) {
+			varyingsRow[i] = _mm_add_ps(varyingsRow[i], varyingsDy[i]);
+		}
+	}
+
+	PipelineStats& stats = ThreadStats();
+	stats.pixelsTested += tested;
+	stats.depthPassed += passed;
+	stats.pixelsWritten += written;
+}
+
+void Renderer::PresentTo(Color* dst, int pitch, int dstWidth, int dstHeight)
+{
+	PROFILE_SCOPE("Present");
+	if (dstWidth == viewportWidth && dstHeight == height) {
+		ResolveTo(dst, pitch);
+		return;
+	}
+	ResolveTo(colorBuffer, Pitch());
+	PROFILE_SCOPE("Upscale");
+	upscaler.Upscale(colorBuffer, viewportWidth, height, Pitch(), dst, dstWidth, dstHeight, pitch, threadPool);
+}
+
+void Renderer::ResolveTo(Color* dst, int pitch)
+{
+	PROFILE_SCOPE("Resolve");
+	if (!multisampling) {
+		for (int y = 0; y < height; y++) {
+			Color* dstRow = (Color*)((char*)dst + (std::size_t)y * pitch);
+			if (dstRow != colorBuffer + y * width) {
+				std::copy(colorBuffer + y * width, colorBuffer + y * width + viewportWidth, dstRow);
+			}
+		}
+		return;
+	}
+
+	// Bands of rows in parallel. Four pixels at a time, pixels with a single color are copied and the others
+	// get the rounded average of their samples.
+	constexpr int bandHeight = 16;
+	const int nBands = (height + bandHeight - 1) / bandHeight;
+	threadPool.ParallelFor(nBands, [&](std::size_t band) {
+		PROFILE_SCOPE("Resolve band");
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i rounding = _mm_set1_epi16(msaaSampleCount / 2);
+		const int minY = (int)band * bandHeight;
+		const int maxY = std::min(minY + bandHeight, height);
+		for (int y = minY; y < maxY; y++) {
+			Color* dstRow = (Color*)((char*)dst + (std::size_t)y * pitch);
+			for (int x = 0; x < viewportWidth; x += 4) {
+				const int pixelIndex = y * width + x;
+				auto colors = _mm_load_si128((const __m128i*)(colorBuffer + pixelIndex));
+				const int flags = *(const int*)(msaaFlags + pixelIndex);
+				if (flags != 0) {
+					const Color* sampleColors = msaaColor + pixelIndex * msaaSampleCount;
+					__m128i sumLo = zero;
+					__m128i sumHi = zero;
+					for (int s = 0; s < msaaSampleCount; s++) {
+						const auto sample = _mm_load_si128((const __m128i*)(sampleColors + s * 4));
+						sumLo = _mm_add_epi16(sumLo, _mm_unpacklo_epi8(sample, zero));
+						sumHi = _mm_add_epi16(sumHi, _mm_unpackhi_epi8(sample, zero));
+					}
+					// Divide by four
+					sumLo = _mm_srli_epi16(_mm_add_epi16(sumLo, rounding), 2);
+					sumHi = _mm_srli_epi16(_mm_add_epi16(sumHi, rounding), 2);
+					const auto expanded = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(flags)), zero);
+					colors = _mm_blendv_epi8(colors, _mm_packus_epi16(sumLo, sumHi), expanded);
+				}
+				if (x + 4 <= viewportWidth) {
+					_mm_storeu_si128((__m128i*)(dstRow + x), colors);
+				}
+				else {
+					// dst rows aren't padded
+					alignas(16) Color last[4];
+					_mm_store_si128((__m128i*)last, colors);
+					std::copy(last, last + (viewportWidth - x), dstRow + x);
 				}
 			}
+		}
+	});
+}
+
+// Only the edge functions and the depth plane are stepped, which makes this the cheapest way to fill a depth
+// buffer: shadow maps, the depth pre-pass and the raster pass of the visibility buffer all go through here.
+template<bool writeIds, int nVaryings>
+void Renderer::DrawTriangleDepthSSE(const TriangleSetupBatch<nVaryings>& t, int lane, float* depthTarget, int targetWidth, VisibilityId id)
+{
+	constexpr int simdAlignment = 4;
+
+	const int minX = t.minX[lane];
+	const int alignedMinX = (minX / simdAlignment) * simdAlignment;
+	const int maxX = t.maxX[lane];
+	const int minY = t.minY[lane];
+	const int maxY = t.maxY[lane];
 
+	const auto firstFourInRowDx = _mm_add_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), _mm_set1_ps((float)(alignedMinX - minX)));
+
+	auto inverseZRow = _mm_add_ps(_mm_set1_ps(t.inverseZ[0][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.inverseZ[1][lane])));
+	const auto inverseZColumnIncrement = _mm_set1_ps(simdAlignment * t.inverseZ[1][lane]);
+	const auto inverseZRowIncrement = _mm_set1_ps(t.inverseZ[2][lane]);
+
+	auto w0Row = _mm_add_ps(_mm_set1_ps(t.w[0][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.wDx[0][lane])));
+	auto w1Row = _mm_add_ps(_mm_set1_ps(t.w[1][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.wDx[1][lane])));
+	auto w2Row = _mm_add_ps(_mm_set1_ps(t.w[2][lane]), _mm_mul_ps(firstFourInRowDx, _mm_set1_ps(t.wDx[2][lane])));
+	const auto w0ColumnIncrement = _mm_set1_ps(simdAlignment * t.wDx[0][lane]);
+	const auto w1ColumnIncrement = _mm_set1_ps(simdAlignment * t.wDx[1][lane]);
+	const auto w2ColumnIncrement = _mm_set1_ps(simdAlignment * t.wDx[2][lane]);
+	const auto w0RowIncrement = _mm_set1_ps(t.wDy[0][lane]);
+	const auto w1RowIncrement = _mm_set1_ps(t.wDy[1][lane]);
+	const auto w2RowIncrement = _mm_set1_ps(t.wDy[2][lane]);
+
+	const auto zero = _mm_setzero_ps();
+	const auto ids = _mm_set1_epi32((int)id);
+	int tested = 0;
+	int passed = 0;
+
+	// A partial frame only draws the scissor rect, the values are stepped there from the bounding box origin
+	const ScissorRect rect = DrawRect(alignedMinX, minY, maxX, maxY);
+	for (int y = minY; y < rect.minY; y++) {
+		w0Row = _mm_add_ps(w0Row, w0RowIncrement);
+		w1Row = _mm_add_ps(w1Row, w1RowIncrement);
+		w2Row = _mm_add_ps(w2Row, w2RowIncrement);
+		inverseZRow = _mm_add_ps(inverseZRow, inverseZRowIncrement);
+	}
+
+	for (int y = rect.minY; y <= rect.maxY; y++)
+	{
+		const int rowOffset = y * targetWidth;
+
+		auto w0 = w0Row;
+		auto w1 = w1Row;
+		auto w2 = w2Row;
+		auto interpolatedInverseZ = inverseZRow;
+		for (int x = alignedMinX; x < rect.minX; x += simdAlignment) {
 			w0 = _mm_add_ps(w0, w0ColumnIncrement);
 			w1 = _mm_add_ps(w1, w1ColumnIncrement);
 			w2 = _mm_add_ps(w2, w2ColumnIncrement);
+			interpolatedInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZColumnIncrement);
+		}
+
+		for (int x = rect.minX; x <= rect.maxX; x += simdAlignment)
+		{
+			auto writeFlag = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_cmpge_ps(w1, zero)), _mm_cmpge_ps(w2, zero));
+
+			if (!_mm_test_all_zeros(_mm_castps_si128(writeFlag), _mm_castps_si128(writeFlag))) {
+				const int pixelIndex = rowOffset + x;
+				const auto currentZInBuffer = _mm_load_ps(depthTarget + pixelIndex);
+				tested += PopCount4(_mm_movemask_ps(writeFlag));
+				writeFlag = _mm_and_ps(writeFlag, _mm_cmpgt_ps(interpolatedInverseZ, currentZInBuffer));
+				passed += PopCount4(_mm_movemask_ps(writeFlag));
+
+				if (!_mm_test_all_zeros(_mm_castps_si128(writeFlag), _mm_castps_si128(writeFlag))) {
+					_mm_store_ps(depthTarget + pixelIndex, _mm_blendv_ps(currentZInBuffer, interpolatedInverseZ, writeFlag));
+					if (overdrawHeatmap && countingStats) {
+						CountOverdraw4(pixelIndex, writeFlag);
+					}
+					if constexpr (writeIds) {
+						const auto currentIds = _mm_load_si128((const __m128i*)(idBuffer + pixelIndex));
+						_mm_store_si128((__m128i*)(idBuffer + pixelIndex), _mm_blendv_epi8(currentIds, ids, _mm_castps_si128(writeFlag)));
+					}
+				}
+			}
+
+			w0 = _mm_add_ps(w0, w0ColumnIncrement);
+			w1 = _mm_add_ps(w1, w1ColumnIncrement);
+			w2 = _mm_add_ps(w2, w2ColumnIncrement);
+			interpolatedInverseZ = _mm_add_ps(interpolatedInverseZ, inverseZColumnIncrement);
 		}
 
 		w0Row = _mm_add_ps(w0Row, w0RowIncrement);
 		w1Row = _mm_add_ps(w1Row, w1RowIncrement);
 		w2Row = _mm_add_ps(w2Row, w2RowIncrement);
+		inverseZRow = _mm_add_ps(inverseZRow, inverseZRowIncrement);
 	}
-}
\ No newline at end of file
+
+	PipelineStats& stats = ThreadStats();
+	stats.pixelsTested += tested;
+	stats.depthPassed += passed;
+}
+
+void Renderer::RenderVisibilityBuffer(const Scene& scene, const Mat4& view, const Mat4& proj)
+{
+	PROFILE_SCOPE("Visibility buffer");
+	std::fill(idBuffer, idBuffer + (width * height), emptyVisibilityId);
+
+	// Raster pass: depth and ids of the opaque models. Anything the visibility buffer can't hold is drawn forward afterwards.
+	std::vector<const Model*> forwardModels;
+	nVisibilityDraws = 0;
+	for (std::uint32_t index : SortModels(scene, view)) {
+		const Model& model = scene.models[index];
+		if (model.blending != Blending::Opaque || nVisibilityDraws == maxVisibilityDraws) {
+			forwardModels.push_back(&model);
+			continue;
+		}
+		if (visibilityDraws.size() == nVisibilityDraws) {
+			visibilityDraws.emplace_back();
+		}
+
+		VisibilityDraw& draw = visibilityDraws[nVisibilityDraws];
+		draw.uniforms = MakeUniforms(model, view, scene.light);
+		DispatchShadingModel(model.shading, draw.uniforms.shadowMap != nullptr, [&](auto vertexShader, auto fragmentShader) {
+			using VertexShader = decltype(vertexShader);
+			using FragmentShader = decltype(fragmentShader);
+			constexpr int nVaryings = VertexShader::nVaryings;
+
+			if (!std::holds_alternative<TriangleSetupBuffer<nVaryings>>(draw.setup)) {
+				draw.setup.template emplace<TriangleSetupBuffer<nVaryings>>();
+			}
+			auto& setupBuffer = std::get<TriangleSetupBuffer<nVaryings>>(draw.setup);
+			setupBuffer.Clear();
+			ProcessGeometry<VertexShader>(model, view, proj, draw.uniforms, viewportWidth, height, setupBuffer);
+
+			if (setupBuffer.count > maxVisibilityTriangles) {
+				forwardModels.push_back(&model);
+				return;
+			}
+
+			draw.shade = &ShadeVisibility4<FragmentShader, nVaryings>;
+			const auto nTris = setupBuffer.count;
+			for (std::size_t i = 0; i < nTris; i++) {
+				DrawTriangleDepthSSE<true>(setupBuffer.batches[i / setupBatchSize], i % setupBatchSize,
+					depthBuffer, width, PackVisibilityId(nVisibilityDraws, (std::uint32_t)i));
+			}
+			nVisibilityDraws++;
+		});
+	}
+
+	ShadeVisibilityBuffer();
+
+	for (const Model* model : forwardModels) {
+		Render(*model, view, proj, scene.light);
+	}
+}
+
+void Renderer::ShadeVisibilityBuffer()
+{
+	PROFILE_SCOPE("Shade visibility buffer");
+	// Tiles keep each thread's reads and writes within a small part of the buffers. The width must be a multiple of 4.
+	constexpr int tileSize = 64;
+	const int tilesX = (width + tileSize - 1) / tileSize;
+	const int tilesY = (height + tileSize - 1) / tileSize;
+
+	threadPool.ParallelFor((std::size_t)tilesX * tilesY, [&](std::size_t tile) {
+		PROFILE_SCOPE("Shade tile");
+		const int minX = (int)(tile % tilesX) * tileSize;
+		const int minY = (int)(tile / tilesX) * tileSize;
+		const int maxX = std::min(minX + tileSize, width);
+		const int maxY = std::min(minY + tileSize, height);
+		const auto empty = _mm_set1_epi32((int)emptyVisibilityId);
+		std::uint64_t written = 0;
+
+		for (int y = minY; y < maxY; y++) {
+			for (int x = minX; x < maxX; x += 4) {
+				const int pixelIndex = y * width + x;
+				const auto ids = _mm_load_si128((const __m128i*)(idBuffer + pixelIndex));
+				int remaining = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(ids, empty))) & 0xF;
+				if (remaining == 0) {
+					continue;
+				}
+				written += PopCount4(remaining);
+
+				alignas(16) VisibilityId laneIds[4];
+				_mm_store_si128((__m128i*)laneIds, ids);
+				auto colors = _mm_load_si128((const __m128i*)(colorBuffer + pixelIndex));
+
+				// Usually all four pixels belong to the same draw and this loops once
+				while (remaining != 0) {
+					int first = 0;
+					while (!(remaining & (1 << first))) first++;
+					const std::uint32_t draw = laneIds[first] >> visibilityTriangleBits;
+					int laneMask = 0;
+					for (int lane = first; lane < 4; lane++) {
+						if ((remaining & (1 << lane)) && (laneIds[lane] >> visibilityTriangleBits) == draw) {
+							laneMask |= 1 << lane;
+						}
+					}
+					visibilityDraws[draw].shade(visibilityDraws[draw], laneIds, x, y, laneMask, colors);
+					remaining &= ~laneMask;
+				}
+
+				_mm_store_si128((__m128i*)(colorBuffer + pixelIndex), colors);
+			}
+		}
+		ThreadStats().pixelsWritten += written;
+	});
+}
+
+// The microbenchmarks time these kernels on their own
+template void Renderer::DrawTriangle<TexturedFragmentShader, DepthTestNoWrite, OpaqueBlend, 2>(const TriangleSetupBatch<2>&, int, const ShaderUniforms&);
+template void Renderer::DrawTriangleSSE<TexturedFragmentShader, DepthTestNoWrite, OpaqueBlend, 2>(const TriangleSetupBatch<2>&, int, const ShaderUniforms&);
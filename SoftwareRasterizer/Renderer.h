@@ -1,36 +1,302 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
+#include "PipelineStats.h"
+#include "Profiler.h"
+#include "RadixSort.h"
 #include "Scene.h"
+#include "Shader.h"
+#include "SpscQueue.h"
+#include "ThreadPool.h"
+#include "TriangleSetup.h"
+#include "Upscale.h"
+#include "VisibilityBuffer.h"
 #include "Window.h"
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <tuple>
 #include <vector>
 
+enum class RenderPath {
+    Forward,            // Shade fragments as they pass the depth test
+    VisibilityBuffer    // Rasterize triangle ids first, then shade every visible pixel once (opaque models only)
+};
+
+// Coverage and depth samples per pixel with multisampling
+constexpr int msaaSampleCount = 4;
+
 class Renderer {
 public:
-    Renderer(int width, int height);
+    // width and height are the largest render size, all buffers are allocated for it up front. nWorkerThreads helps
+    // the calling thread with each frame, 0 when frames are already rendered in parallel.
+    Renderer(int width, int height, unsigned nWorkerThreads = ThreadPool::DefaultWorkerCount());
     ~Renderer() {
+        StopRasterThread();
         _aligned_free(colorBuffer);
         _aligned_free(depthBuffer);
+        _aligned_free(idBuffer);
+        _aligned_free(shadowMap);
+        _aligned_free(msaaDepth);
+        _aligned_free(msaaColor);
+        _aligned_free(msaaFlags);
+        _aligned_free(overdrawCounts);
     }
-    void Render(const Scene& scene);
-    void Render(const Model& model, const Mat4& view, const Mat4& proj);
+    void SetRenderPath(RenderPath path) { renderPath = path; frameValid = false; }
+    // Draw opaque models, and the meshlets of large models, front to back so that more fragments fail the depth test
+    // before they are shaded. Blended models are drawn after them, back to front.
+    void SetFrontToBackSorting(bool enabled) { frontToBackSorting = enabled; frameValid = false; }
+    // Forward path only: lay down the depth of all opaque models first, then shade only the fragments that are
+    // visible in the end. Pays for a second geometry pass to shade every opaque pixel once.
+    void SetDepthPrePass(bool enabled) { depthPrePass = enabled; frameValid = false; }
+    // 4x multisampling for the forward path: coverage and depth are tested at four samples per pixel but fragments
+    // are still shaded once per pixel. Pixels whose samples all hold the same color only store it once, in the
+    // color buffer. Replaces the depth pre-pass, which works on the single sample depth buffer.
+    void SetMultisampling(bool enabled);
+    // Renders the following frames at a smaller size, up to the size given to the constructor. Clears the buffers.
+    void SetRenderSize(int renderWidth, int renderHeight);
+    int RenderWidth() const { return viewportWidth; }
+    int RenderHeight() const { return height; }
+    // Counted during the last Render(scene), not including the shadow map
+    const PipelineStats& GetPipelineStats() const { return pipelineStats; }
+    // Debug view: Render(scene) replaces the image with the number of fragments that passed the depth test at each
+    // pixel (the depth pre-pass included), from black for none over blue, green and yellow to red for eight or more.
+    // Every pass after the first on a pixel is overdraw.
+    void SetOverdrawHeatmap(bool enabled);
+    bool OverdrawHeatmap() const { return overdrawHeatmap; }
+    // For mostly static scenes: Render(scene) keeps the last frame and only redraws what changed. Nothing at all if
+    // neither the camera nor any model changed, otherwise the screen area the changed models covered in the last
+    // frame and cover now, with rasterization restricted to it. Render(scene) clears the buffers itself then, a
+    // ClearBuffers between frames makes the next one a full redraw. Only the forward path without the heatmap is
+    // redrawn partially, and changes in a scene that casts shadows redraw the full frame as shadows move with them.
+    void SetIncremental(bool enabled) { incremental = enabled; frameValid = false; }
+    bool Incremental() const { return incremental; }
+    // Forward path: a raster thread of the renderer draws the models' triangles while the calling thread and the
+    // pool process the geometry of the following models, up to nGeometrySlots - 1 models ahead. Render(scene) still
+    // returns a finished frame. Adds a thread, which sleeps while it has nothing to draw, and one of the pool's
+    // workers sits out in exchange.
+    void SetPipelining(bool enabled);
+    bool Pipelining() const { return pipelining; }
+    void Render(const Scene& scene) { Render(scene, scene.cam); }
+    // Renders the scene from another camera, so that several renderers can share one scene
+    void Render(const Scene& scene, const Camera& camera);
+    void Render(const Model& model, const Mat4& view, const Mat4& proj, const DirectionalLight& light);
+    // Unresolved with multisampling, edges are only anti-aliased by ResolveTo. Rows may be padded past RenderWidth().
     const Color* ColorBufferData() { return colorBuffer; }
+    // 1/w of the closest fragment per pixel, with the same pitch. Multisampling keeps depth per sample instead.
+    const float* DepthBufferData() { return depthBuffer; }
     int Pitch() { return width * sizeof(Color); }
+    // Writes the final image to dst (pitch in bytes), averaging the samples of multisampled pixels. dst may be the color buffer.
+    void ResolveTo(Color* dst, int pitch);
+    // ResolveTo, but bilinearly scaled to dstWidth x dstHeight if that differs from the render size
+    void PresentTo(Color* dst, int pitch, int dstWidth, int dstHeight);
     void ClearBuffers() {
+        PROFILE_SCOPE("Clear");
+        frameValid = false;
         std::fill(colorBuffer, colorBuffer + (width * height), Colors::magenta); 
         std::fill(depthBuffer, depthBuffer + (width * height), FLT_MIN);
+        if (multisampling) {
+            std::fill(msaaDepth, msaaDepth + (width * height * msaaSampleCount), FLT_MIN);
+            std::fill(msaaFlags, msaaFlags + (width * height), 0);
+        }
+        if (overdrawHeatmap) {
+            std::fill(overdrawCounts, overdrawCounts + (width * height), 0);
+        }
     }
 private:
-    void DrawTexturedTriangle(Triangle& t, const Texture& texture);
-    void DrawTexturedTriangleSSE(Triangle& t, const Texture& texture);
+    // Indices of the scene's models in the order they should be drawn
+    const std::vector<std::uint32_t>& SortModels(const Scene& scene, const Mat4& view);
+    ShaderUniforms MakeUniforms(const Model& model, const Mat4& view, const DirectionalLight& light) const;
+
+    // Culls, transforms, shades, clips and sets up the model's triangles for a render target of the given size
+    template<typename VertexShader, bool orthographic = false>
+    void ProcessGeometry(const Model& model, const Mat4& view, const Mat4& proj, const ShaderUniforms& uniforms,
+        int targetWidth, int targetHeight, TriangleSetupBuffer<VertexShader::nVaryings>& out);
+
+    // Depth of the opaque models as seen from the light, fitted around the whole scene
+    void RenderShadowMap(const Scene& scene);
+    // Depth of the opaque models into the depth buffer
+    void RenderDepthPrePass(const Scene& scene, const std::vector<std::uint32_t>& order, const Mat4& view, const Mat4& proj);
+
+    // Picks the blend mode and the matching depth mode
+    template<typename VertexShader, typename FragmentShader>
+    void Render(const Model& model, const Mat4& view, const Mat4& proj, const ShaderUniforms& uniforms);
+    template<typename VertexShader, typename FragmentShader, typename DepthMode, typename BlendMode>
+    void Render(const Model& model, const Mat4& view, const Mat4& proj, const ShaderUniforms& uniforms);
+
+    template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+    void Rasterize(const TriangleSetupBuffer<nVaryings>& setupBuffer, const ShaderUniforms& uniforms);
+
+    template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+    void DrawTriangle(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms);
+    template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+    void DrawTriangleSSE(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms);
+    template<int nRows, int nGroups, typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+    void DrawSmallTriangleSSE(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms);
+    template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+    void DrawTriangleSpansSSE(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms);
+    template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+    void DrawTriangleMSAA(const TriangleSetupBatch<nVaryings>& t, int lane, const ShaderUniforms& uniforms);
+
+    // Fragments of one triangle, added to the thread's counters once per triangle
+    struct FragmentCounts {
+        int tested = 0;
+        int passed = 0;
+        int written = 0;
+    };
+    void AddFragmentCounts(const FragmentCounts& counts);
+    template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+    void ShadeFragments4(int pixelIndex, __m128 coverage, __m128 interpolatedInverseZ, const __m128* interpolatedVaryings,
+        const ShaderUniforms& uniforms, FragmentCounts& counts);
+
+    // Depth only kernel, no varyings and no color. Also writes id to the visibility buffer if writeIds is set.
+    // depthTarget is the depth buffer or the shadow map, targetWidth must be a multiple of 4.
+    template<bool writeIds, int nVaryings>
+    void DrawTriangleDepthSSE(const TriangleSetupBatch<nVaryings>& t, int lane, float* depthTarget, int targetWidth, VisibilityId id);
+
+    // Incremental rendering: compares the scene with the one the last frame was rendered from and sets dirtyRect
+    enum class FrameChange { None, Partial, Full };
+    FrameChange TrackChanges(const Scene& scene, const Camera& camera, const Mat4& viewProjection);
+    // Screen area the model can cover, empty (minX > maxX) if none. Whole groups of four pixels, as the kernels and
+    // the multisampled buffers work on them.
+    ScissorRect ScreenRect(const Model& model, const Mat4& viewProjection) const;
+    // The pixels of a triangle's bounding box that the raster kernels draw, the box without the columns and rows
+    // outside the scissor rect of a partial frame. The kernels still step their values from the box origin, so
+    // redrawn pixels come out exactly as in a full frame.
+    ScissorRect DrawRect(int alignedMinX, int minY, int maxX, int maxY) const {
+        if (!scissor) {
+            return { alignedMinX, minY, maxX, maxY };
+        }
+        return { std::max(alignedMinX, scissor->minX), std::max(minY, scissor->minY), std::min(maxX, scissor->maxX), std::min(maxY, scissor->maxY) };
+    }
+    void ClearRect(const ScissorRect& rect);
+    bool IsOutsideScissor(std::uint32_t modelIndex) const;
+
+    // Pipelining: one slot of processed geometry, and what draws it
+    struct GeometrySlot {
+        std::tuple<TriangleSetupBuffer<0>, TriangleSetupBuffer<2>, TriangleSetupBuffer<3>, TriangleSetupBuffer<6>> setupBuffers;
+        ShaderUniforms uniforms;
+        void (Renderer::*rasterize)(GeometrySlot& slot) = nullptr;
+    };
+    template<typename FragmentShader, typename DepthMode, typename BlendMode, int nVaryings>
+    void RasterizeSlot(GeometrySlot& slot);
+    void RasterLoop();
+    void StartPipelineFrame();
+    // Returns once the raster thread has drawn everything handed to it
+    void FinishPipelineFrame();
+    void StopRasterThread();
+
+    void RenderVisibilityBuffer(const Scene& scene, const Mat4& view, const Mat4& proj);
+    void ShadeVisibilityBuffer();
+
+    // Counters of the calling thread, or its scratch ones while counting is off. The raster thread has the last set.
+    PipelineStats& ThreadStats() {
+        const unsigned index = std::this_thread::get_id() == rasterThreadId ? threadPool.ThreadCount() : threadPool.ThreadIndex();
+        return (countingStats ? threadStats : uncountedStats)[index];
+    }
+    // Adds one to the overdraw counts of the four pixels at pixelIndex whose lanes are set in mask
+    void CountOverdraw4(int pixelIndex, __m128 mask);
+    void DrawOverdrawHeatmap();
 private:
     using ColorBuffer = Color*;
     using DepthBuffer = float*;
 
+    // The raster kernels work on groups of four pixels, so rows are padded to a multiple of 4: width is the row length
+    // of the buffers, viewportWidth the number of columns that are shown
+    int viewportWidth;
     int width, height;
+    int maxWidth, maxHeight;
     ColorBuffer colorBuffer;
     DepthBuffer depthBuffer;
+
+    RenderPath renderPath = RenderPath::Forward;
+    bool frontToBackSorting = false;
+    bool depthPrePass = false;
+    bool depthPrePassDone = false; // Set while opaque models are drawn after a pre-pass, they only pass on equal depth
+    bool multisampling = false;
+
+    // One set of counters per thread of the pool, summed at the end of Render(scene). Geometry is processed in
+    // parallel while counting is off as well, so the scratch counters are per thread too.
+    std::vector<PipelineStats> threadStats;
+    std::vector<PipelineStats> uncountedStats;
+    PipelineStats pipelineStats;
+    bool countingStats = true;
+
+    // What the kept frame was rendered from, for incremental rendering
+    struct ModelSnapshot {
+        Vec3 position, rotation, scale;
+        const Face* faces;
+        std::size_t faceCount;
+        const Texture* texture;
+        ShadingModel shading;
+        Blending blending;
+        ScissorRect screenRect;
+    };
+    bool incremental = false;
+    bool frameValid = false;    // The buffers hold a complete frame
+    Camera previousCamera;
+    DirectionalLight previousLight = {};
+    std::vector<ModelSnapshot> modelSnapshots, nextModelSnapshots;
+    ScissorRect dirtyRect = {};
+    const ScissorRect* scissor = nullptr; // Set while a partial frame is rendered
+
+    // Fragments that passed the depth test per pixel, saturating at 255
+    bool overdrawHeatmap = false;
+    std::uint8_t* overdrawCounts = nullptr;
+
+    // Sorting buffers, reused across frames
+    std::vector<std::uint32_t> modelOrder;
+    std::vector<SortItem> sortItems, transparentSortItems, sortScratch;
+
+    // Reused across draws to avoid reallocating every frame, one per varying count used by the vertex shaders
+    std::tuple<TriangleSetupBuffer<0>, TriangleSetupBuffer<2>, TriangleSetupBuffer<3>, TriangleSetupBuffer<6>> setupBuffers;
+    // Setup output of the geometry chunks after the first, see ProcessGeometry
+    std::tuple<std::vector<TriangleSetupBuffer<0>>, std::vector<TriangleSetupBuffer<2>>, std::vector<TriangleSetupBuffer<3>>,
+        std::vector<TriangleSetupBuffer<6>>> chunkSetupBuffers;
+
+    // Pipelining. Slot indices go to the raster thread through readySlots, followed by endOfFrame, and come back
+    // through freeSlots once drawn. Both queues have room for all slots and the end marker, so pushes never wait.
+    static constexpr int nGeometrySlots = 3;
+    static constexpr int endOfFrame = -1;
+    bool pipelining = false;
+    bool pipelineFrame = false; // Set while the forward pass hands models to the raster thread
+    GeometrySlot geometrySlots[nGeometrySlots];
+    SpscQueue<int, 4> readySlots;
+    SpscQueue<int, 4> freeSlots;
+    std::thread rasterThread;
+    std::thread::id rasterThreadId;
+    // Wakes the raster thread for a frame and the calling thread once it is drawn
+    std::mutex pipelineMutex;
+    std::condition_variable pipelineWake;
+    bool frameStarted = false;
+    bool frameRasterized = false;
+    bool stopRasterThread = false;
+
+    // Shadow map of the scene's light, 1 - z from the light (greater is closer) like the depth buffer
+    float* shadowMap = nullptr;
+    int shadowMapSize = 0;
+    bool hasShadowMap = false;
+    Mat4 shadowViewProjection; // World space to the shadow map's clip space
+    float shadowDepthBias = 0.0f;
+
+    // Multisampling. Samples are stored per group of four horizontally adjacent pixels: all first samples of the
+    // group, then all second samples and so on, so that each is one SIMD register. Pixels with a nonzero flag
+    // have distinct samples, the others only use the color buffer.
+    float* msaaDepth = nullptr;
+    Color* msaaColor = nullptr;
+    std::uint8_t* msaaFlags = nullptr;
+
+    // Visibility buffer path. Draws are reused across frames to keep their setup buffers' memory.
+    VisibilityId* idBuffer;
+    std::vector<VisibilityDraw> visibilityDraws;
+    std::uint32_t nVisibilityDraws = 0;
+    ThreadPool threadPool;
+
+    BilinearUpscaler upscaler;
+
+    // Times the raster kernels in isolation
+    friend class Microbenchmarks;
 };
 
 
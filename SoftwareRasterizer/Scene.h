@@ -2,12 +2,14 @@
 #define SCENE_H
 
 #include "Camera.h"
+#include "Light.h"
 #include "Model.h"
 
 #include <vector>
 
 struct Scene {
 	Camera cam;
+	DirectionalLight light = { Normalize(Vec3{ 0.5f, -1.0f, 1.0f }) };
 	std::vector<Model> models;
 };
 
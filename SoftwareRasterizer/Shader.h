@@ -1,8 +1,330 @@
 #ifndef SHADER_H
 #define SHADER_H
 
-struct {
+#include <algorithm>
+#include <cstdint>
+#include <immintrin.h>
+#include "Light.h"
+#include "Matrix.h"
+#include "Texture.h"
+#include "Triangle.h"
+#include "Utilities.h"
+#include "Vector.h"
 
+// Shaders are plain structs with static functions. They are passed to the pipeline as template parameters so
+// that every combination of vertex shader, fragment shader, depth mode and blend mode is compiled into its own
+// fully inlined raster kernel. Selecting a shader costs one switch per draw and nothing per pixel.
+
+enum class ShadingModel {
+	Unlit,		// Texture only
+	Flat,		// Texture modulated by per face diffuse lighting
+	Gouraud		// Texture modulated by per vertex diffuse lighting, interpolated across the face
+};
+
+enum class Blending {
+	Opaque,
+	AlphaBlend	// Blended with the texture's alpha, doesn't write depth
+};
+
+// Values that are constant for a whole draw
+struct ShaderUniforms {
+	const Texture* texture;
+	Vec3 lightDirection;	// View space, normalized. Direction the light travels in.
+	float ambient;
+
+	// Shadow map of the light, only read by shaders that receive shadows
+	const float* shadowMap = nullptr;
+	int shadowMapSize = 0;
+	Mat4 shadowTransform;	// Model space to shadow map texel x, y and depth (1 - z, greater is closer to the light)
+	float shadowBias = 0.0f;
+};
+
+// Vertex shader interface:
+//   static constexpr int nVaryings;		Number of varyings written, the raster kernels only interpolate these
+//   static constexpr bool usesNormal;		Whether normal is set, saves transforming normals for unlit shaders
+//   static constexpr bool isPerFace;		Shaded once per face with the face normal instead of once per vertex
+//   static void Shade(const Vec3& position, Vec2 uv, const Vec3& normal, const ShaderUniforms&, Varyings& out);
+//   static void Shade(const __m128 position[3], const __m128 uv[2], const __m128 normal[3], const ShaderUniforms&, __m128* out);
+//
+// Positions are in model space, normals in view space. The second overload shades four vertices at once
+// (structure of arrays) right after they are transformed. Per face shaders only need the first one.
+//
+// Texture coordinates always go in varyings 0 and 1. Lit shaders put the light intensity in varying 2
+// and, if they receive shadows, the shadow map coordinates in varyings 3 to 5.
+
+inline float DiffuseIntensity(const Vec3& normal, const ShaderUniforms& uniforms) {
+	const float diffuse = std::max(0.0f, -Dot(normal, uniforms.lightDirection));
+	return Clamp(uniforms.ambient + (1.0f - uniforms.ambient) * diffuse, 0.0f, 1.0f);
+}
+
+inline __m128 DiffuseIntensity(const __m128 normal[3], const ShaderUniforms& uniforms) {
+	const __m128 dot = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(normal[0], _mm_set1_ps(uniforms.lightDirection.x)),
+		_mm_mul_ps(normal[1], _mm_set1_ps(uniforms.lightDirection.y))),
+		_mm_mul_ps(normal[2], _mm_set1_ps(uniforms.lightDirection.z)));
+	const __m128 diffuse = _mm_max_ps(_mm_sub_ps(_mm_setzero_ps(), dot), _mm_setzero_ps());
+	const __m128 intensity = _mm_add_ps(_mm_set1_ps(uniforms.ambient), _mm_mul_ps(_mm_set1_ps(1.0f - uniforms.ambient), diffuse));
+	return _mm_min_ps(_mm_max_ps(intensity, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+}
+
+// Shadow map texel x, y and depth of a model space position. These are affine in the position so perspective
+// correct interpolation reproduces them exactly across the triangle.
+inline void ShadowCoordinates(const Vec3& position, const ShaderUniforms& uniforms, float* out) {
+	const Vec3 coordinates = uniforms.shadowTransform * position;
+	out[0] = coordinates.x;
+	out[1] = coordinates.y;
+	out[2] = coordinates.z;
+}
+
+inline void ShadowCoordinates(const __m128 position[3], const ShaderUniforms& uniforms, __m128* out) {
+	const Mat4& m = uniforms.shadowTransform;
+	for (int r = 0; r < 3; r++) {
+		out[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(position[0], _mm_set1_ps(m[r][0])),
+			_mm_mul_ps(position[1], _mm_set1_ps(m[r][1]))),
+			_mm_mul_ps(position[2], _mm_set1_ps(m[r][2]))),
+			_mm_set1_ps(m[r][3]));
+	}
+}
+
+// Position only, for depth only passes (shadow maps and the depth pre-pass)
+struct DepthOnlyVertexShader {
+	static constexpr int nVaryings = 0;
+	static constexpr bool usesNormal = false;
+	static constexpr bool isPerFace = false;
+	static void Shade(const Vec3&, Vec2, const Vec3&, const ShaderUniforms&, Varyings&) {}
+	static void Shade(const __m128[3], const __m128[2], const __m128[3], const ShaderUniforms&, __m128*) {}
+};
+
+struct UnlitVertexShader {
+	static constexpr int nVaryings = 2;
+	static constexpr bool usesNormal = false;
+	static constexpr bool isPerFace = false;
+	static void Shade(const Vec3&, Vec2 uv, const Vec3&, const ShaderUniforms&, Varyings& out) {
+		out.v[0] = uv.u;
+		out.v[1] = uv.v;
+	}
+	static void Shade(const __m128[3], const __m128 uv[2], const __m128[3], const ShaderUniforms&, __m128* out) {
+		out[0] = uv[0];
+		out[1] = uv[1];
+	}
+};
+
+template<bool receivesShadows = false>
+struct FlatVertexShader {
+	static constexpr int nVaryings = receivesShadows ? 6 : 3;
+	static constexpr bool usesNormal = true;
+	static constexpr bool isPerFace = true;
+	static void Shade(const Vec3& position, Vec2 uv, const Vec3& normal, const ShaderUniforms& uniforms, Varyings& out) {
+		out.v[0] = uv.u;
+		out.v[1] = uv.v;
+		out.v[2] = DiffuseIntensity(normal, uniforms);
+		if constexpr (receivesShadows) {
+			ShadowCoordinates(position, uniforms, out.v + 3);
+		}
+	}
+};
+
+template<bool receivesShadows = false>
+struct GouraudVertexShader {
+	static constexpr int nVaryings = receivesShadows ? 6 : 3;
+	static constexpr bool usesNormal = true;
+	static constexpr bool isPerFace = false;
+	static void Shade(const Vec3& position, Vec2 uv, const Vec3& normal, const ShaderUniforms& uniforms, Varyings& out) {
+		out.v[0] = uv.u;
+		out.v[1] = uv.v;
+		out.v[2] = DiffuseIntensity(normal, uniforms);
+		if constexpr (receivesShadows) {
+			ShadowCoordinates(position, uniforms, out.v + 3);
+		}
+	}
+	static void Shade(const __m128 position[3], const __m128 uv[2], const __m128 normal[3], const ShaderUniforms& uniforms, __m128* out) {
+		out[0] = uv[0];
+		out[1] = uv[1];
+		out[2] = DiffuseIntensity(normal, uniforms);
+		if constexpr (receivesShadows) {
+			ShadowCoordinates(position, uniforms, out + 3);
+		}
+	}
+};
+
+// Fragment shader interface:
+//   static Color Shade(const float* varyings, const ShaderUniforms&);
+//   static __m128i Shade(const __m128* varyings, int laneMask, const ShaderUniforms&);
+//
+// The second overload shades four horizontally adjacent pixels. Only the lanes set in laneMask are used
+// so shaders can skip their texture fetches for the others.
+
+// Fetches texels for the lanes set in laneMask. Other lanes are magenta, which is easy to spot should they ever be written.
+inline __m128i SampleTexture4(const Texture& texture, __m128 u, __m128 v, int laneMask) {
+	alignas(16) float us[4], vs[4];
+	_mm_store_ps(us, u);
+	_mm_store_ps(vs, v);
+	alignas(16) Color colors[4] = { Colors::magenta, Colors::magenta, Colors::magenta, Colors::magenta };
+	for (int i = 0; i < 4; i++) {
+		if (laneMask & (1 << i)) {
+			colors[i] = texture(us[i], vs[i]);
+		}
+	}
+	return _mm_load_si128((const __m128i*)colors);
+}
+
+struct TexturedFragmentShader {
+	static Color Shade(const float* varyings, const ShaderUniforms& uniforms) {
+		return (*uniforms.texture)(varyings[0], varyings[1]);
+	}
+	static __m128i Shade(const __m128* varyings, int laneMask, const ShaderUniforms& uniforms) {
+		return SampleTexture4(*uniforms.texture, varyings[0], varyings[1], laneMask);
+	}
+};
+
+// Whether a fragment is farther from the light than the closest surface in the shadow map. Fragments outside
+// the shadow map are lit.
+inline bool IsInShadow(const float* shadowCoordinates, const ShaderUniforms& uniforms) {
+	const float x = shadowCoordinates[0];
+	const float y = shadowCoordinates[1];
+	const float size = (float)uniforms.shadowMapSize;
+	if (!(x >= 0.0f && x < size && y >= 0.0f && y < size)) {
+		return false;
+	}
+	const float closest = uniforms.shadowMap[(int)y * uniforms.shadowMapSize + (int)x];
+	return closest > shadowCoordinates[2] + uniforms.shadowBias;
+}
+
+// IsInShadow for four fragments, all ones in the lanes that are in shadow. The bounds checks, addressing
+// and depth comparisons are done for all lanes at once, only the four shadow map loads are scalar.
+inline __m128 IsInShadow4(const __m128* shadowCoordinates, const ShaderUniforms& uniforms) {
+	const __m128 x = shadowCoordinates[0];
+	const __m128 y = shadowCoordinates[1];
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 size = _mm_set1_ps((float)uniforms.shadowMapSize);
+	const __m128 inside = _mm_and_ps(
+		_mm_and_ps(_mm_cmpge_ps(x, zero), _mm_cmplt_ps(x, size)),
+		_mm_and_ps(_mm_cmpge_ps(y, zero), _mm_cmplt_ps(y, size)));
+
+	// Outside lanes read texel 0, their result is masked out
+	const __m128i texelX = _mm_and_si128(_mm_cvttps_epi32(x), _mm_castps_si128(inside));
+	const __m128i texelY = _mm_and_si128(_mm_cvttps_epi32(y), _mm_castps_si128(inside));
+	alignas(16) std::int32_t indices[4];
+	_mm_store_si128((__m128i*)indices, _mm_add_epi32(_mm_mullo_epi32(texelY, _mm_set1_epi32(uniforms.shadowMapSize)), texelX));
+	const float* map = uniforms.shadowMap;
+	const __m128 closest = _mm_set_ps(map[indices[3]], map[indices[2]], map[indices[1]], map[indices[0]]);
+
+	return _mm_and_ps(inside, _mm_cmpgt_ps(closest, _mm_add_ps(shadowCoordinates[2], _mm_set1_ps(uniforms.shadowBias))));
+}
+
+template<bool receivesShadows = false>
+struct LitTexturedFragmentShader {
+	static Color Shade(const float* varyings, const ShaderUniforms& uniforms) {
+		float intensity = varyings[2];
+		if constexpr (receivesShadows) {
+			// Only ambient light reaches shadowed fragments
+			if (IsInShadow(varyings + 3, uniforms)) {
+				intensity = std::min(intensity, uniforms.ambient);
+			}
+		}
+		return ApplyIntensity((*uniforms.texture)(varyings[0], varyings[1]), intensity);
+	}
+	static __m128i Shade(const __m128* varyings, int laneMask, const ShaderUniforms& uniforms) {
+		__m128 intensity = varyings[2];
+		if constexpr (receivesShadows) {
+			const __m128 shadowed = IsInShadow4(varyings + 3, uniforms);
+			intensity = _mm_blendv_ps(intensity, _mm_min_ps(intensity, _mm_set1_ps(uniforms.ambient)), shadowed);
+		}
+		return ApplyIntensity4(SampleTexture4(*uniforms.texture, varyings[0], varyings[1], laneMask), intensity);
+	}
+};
+
+// Calls f(VertexShader{}, FragmentShader{}) with the shaders that implement a shading model. This is the
+// only runtime branch on the shading model, everything f does can be specialized for it.
+// Unlit shading ignores receivesShadows.
+template<typename F>
+void DispatchShadingModel(ShadingModel shading, bool receivesShadows, F&& f) {
+	switch (shading) {
+	case ShadingModel::Unlit:
+		f(UnlitVertexShader{}, TexturedFragmentShader{});
+		break;
+	case ShadingModel::Flat:
+		if (receivesShadows) {
+			f(FlatVertexShader<true>{}, LitTexturedFragmentShader<true>{});
+		}
+		else {
+			f(FlatVertexShader<false>{}, LitTexturedFragmentShader<false>{});
+		}
+		break;
+	case ShadingModel::Gouraud:
+		if (receivesShadows) {
+			f(GouraudVertexShader<true>{}, LitTexturedFragmentShader<true>{});
+		}
+		else {
+			f(GouraudVertexShader<false>{}, LitTexturedFragmentShader<false>{});
+		}
+		break;
+	}
+}
+
+// Depth modes. Depth is 1/w, greater is closer.
+struct DepthTestAndWrite {
+	static constexpr bool test = true;
+	static constexpr bool write = true;
+	static constexpr bool passEqual = false;
+};
+
+struct DepthTestNoWrite {
+	static constexpr bool test = true;
+	static constexpr bool write = false;
+	static constexpr bool passEqual = false;
+};
+
+// After a depth pre-pass only the fragments that wrote the depth buffer pass. The pre-pass interpolates
+// depth exactly like the color pass, so the closest fragment compares equal.
+struct DepthTestEqual {
+	static constexpr bool test = true;
+	static constexpr bool write = false;
+	static constexpr bool passEqual = true;
+};
+
+// Blend modes, combining the shaded color with the color already in the buffer. Opaque blend modes ignore the
+// destination, which lets fully covered multisampled pixels drop their samples.
+struct OpaqueBlend {
+	static constexpr bool opaque = true;
+	static Color Blend(Color src, Color) { return src; }
+	static __m128i Blend(__m128i src, __m128i) { return src; }
+};
+
+struct AlphaBlend {
+	static constexpr bool opaque = false;
+	static Color Blend(Color src, Color dst) {
+		const std::uint32_t alpha = src >> 24;
+		std::uint32_t result = 0xFF000000;
+		for (int shift = 0; shift < 24; shift += 8) {
+			const std::uint32_t s = (src >> shift) & 0xFF;
+			const std::uint32_t d = (dst >> shift) & 0xFF;
+			const std::uint32_t t = s * alpha + d * (255 - alpha) + 128;
+			result |= ((t + (t >> 8)) >> 8) << shift;
+		}
+		return result;
+	}
+	// (src * alpha + dst * (255 - alpha)) / 255 per 8 bit channel, in 16 bit lanes. The sum fits in 16 bits unsigned.
+	static __m128i Blend(__m128i src, __m128i dst) {
+		const __m128i zero = _mm_setzero_si128();
+		// Broadcast each pixel's alpha to its four channels
+		const __m128i alphaShuffle = _mm_set_epi8(-1, 14, -1, 14, -1, 14, -1, 14, -1, 6, -1, 6, -1, 6, -1, 6);
+		const __m128i srcLo = _mm_unpacklo_epi8(src, zero);
+		const __m128i srcHi = _mm_unpackhi_epi8(src, zero);
+		const __m128i dstLo = _mm_unpacklo_epi8(dst, zero);
+		const __m128i dstHi = _mm_unpackhi_epi8(dst, zero);
+		const __m128i alphaLo = _mm_shuffle_epi8(srcLo, alphaShuffle);
+		const __m128i alphaHi = _mm_shuffle_epi8(srcHi, alphaShuffle);
+		auto blend = [](__m128i s, __m128i d, __m128i a) {
+			const __m128i inverseA = _mm_sub_epi16(_mm_set1_epi16(255), a);
+			__m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, inverseA)), _mm_set1_epi16(128));
+			// (t + (t >> 8)) >> 8 is t / 255 rounded
+			return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+		};
+		const __m128i result = _mm_packus_epi16(blend(srcLo, dstLo, alphaLo), blend(srcHi, dstHi, alphaHi));
+		return _mm_or_si128(result, _mm_set1_epi32((int)Colors::black));
+	}
 };
 
 #endif // !SHADER_H
@@ -0,0 +1,87 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Bounded queue from one producer thread to one consumer thread, lock-free unless a side has to wait. Each side only
+// writes its own index, and the indices are on separate cache lines so that the two threads don't invalidate each
+// other's line on every push and pop. capacity must be a power of two.
+template<typename T, std::size_t capacity>
+class SpscQueue {
+	static_assert(capacity > 0 && (capacity & (capacity - 1)) == 0, "Capacity must be a power of two");
+public:
+	// Producer only. Returns false if the queue is full.
+	bool TryPush(const T& item) {
+		const std::size_t back = tail.load(std::memory_order_relaxed);
+		if (back - head.load(std::memory_order_acquire) == capacity) {
+			return false;
+		}
+		items[back % capacity] = item;
+		tail.store(back + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Returns false if the queue is empty.
+	bool TryPop(T& item) {
+		const std::size_t front = head.load(std::memory_order_relaxed);
+		if (front == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = items[front % capacity];
+		head.store(front + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Sleep until there is room or an item instead of spinning, so that a waiting stage leaves its core to the
+	// others. The mutex is only taken to wait and to wake a side that waits.
+	void Push(const T& item) {
+		if (!TryPush(item)) {
+			Wait(producerWaiting, [&] { return TryPush(item); });
+		}
+		WakeIfWaiting(consumerWaiting);
+	}
+	T Pop() {
+		T item;
+		if (!TryPop(item)) {
+			Wait(consumerWaiting, [&] { return TryPop(item); });
+		}
+		WakeIfWaiting(producerWaiting);
+		return item;
+	}
+private:
+	template<typename Ready>
+	void Wait(std::atomic<bool>& waiting, Ready ready) {
+		std::unique_lock<std::mutex> lock(mutex);
+		waiting.store(true, std::memory_order_relaxed);
+		// The flag is set before ready reads the other side's index, pairs with the fence in WakeIfWaiting: either
+		// the other side sees the flag or ready sees its index
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		changed.wait(lock, ready);
+		waiting.store(false, std::memory_order_relaxed);
+	}
+	void WakeIfWaiting(const std::atomic<bool>& waiting) {
+		// Orders the index stored by TryPush or TryPop before the flag is read
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed)) {
+			{
+				// The waiting side holds the mutex from setting the flag until it sleeps
+				std::lock_guard<std::mutex> lock(mutex);
+			}
+			// Only one side can be waiting: the queue can't be full and empty at once
+			changed.notify_one();
+		}
+	}
+private:
+	alignas(64) std::atomic<std::size_t> head{ 0 };	// Next item to pop, written by the consumer
+	alignas(64) std::atomic<std::size_t> tail{ 0 };	// Next free slot, written by the producer
+	alignas(64) T items[capacity];
+	alignas(64) std::atomic<bool> producerWaiting{ false };	// Set while Push sleeps on a full queue
+	std::atomic<bool> consumerWaiting{ false };	// Set while Pop sleeps on an empty queue
+	std::mutex mutex;
+	std::condition_variable changed;
+};
+
+#endif // !SPSC_QUEUE_H
@@ -12,8 +12,44 @@ std::optional<Texture> textureFromFile(const char* path)
     if (surface->format->format != SDL_PIXELFORMAT_ARGB8888) {
         argbSurface = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
         SDL_FreeSurface(surface);
+        if (argbSurface == NULL) {
+            std::cerr << "Unable to convert image " << path << ". \nSDL error: " << SDL_GetError() << '\n';
+            return std::nullopt;
+        }
     }
-    Texture texture((Color*)argbSurface->pixels, argbSurface->w, argbSurface->h);
-    SDL_FreeSurface(argbSurface);
-    return texture;
-}
\ No newline at end of file
+    if (argbSurface->pitch != argbSurface->w * (int)sizeof(Color)) {
+        // Padded rows, never the case for 32 bit surfaces so far
+        std::vector<Color> pixels((std::size_t)argbSurface->w * argbSurface->h);
+        for (int y = 0; y < argbSurface->h; y++) {
+            const Color* row = (const Color*)((const char*)argbSurface->pixels + (std::size_t)y * argbSurface->pitch);
+            std::copy(row, row + argbSurface->w, pixels.begin() + (std::size_t)y * argbSurface->w);
+        }
+        Texture texture(std::move(pixels), argbSurface->w, argbSurface->h);
+        SDL_FreeSurface(argbSurface);
+        return texture;
+    }
+    // Freed with the last copy of the texture
+    const std::shared_ptr<SDL_Surface> owner(argbSurface, SDL_FreeSurface);
+    return Texture((const Color*)argbSurface->pixels, argbSurface->w, argbSurface->h, owner);
+}
+
+std::shared_ptr<const Texture> placeholderTexture()
+{
+    static const auto placeholder = std::make_shared<const Texture>(std::vector<Color>(1, 0xFF808080), 1, 1);
+    return placeholder;
+}
+
+bool pngFromPixels(const Color* pixels, int width, int height, const char* path)
+{
+    SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormatFrom((void*)pixels, width, height, 32, width * (int)sizeof(Color), SDL_PIXELFORMAT_ARGB8888);
+    if (surface == NULL) {
+        std::cerr << "Unable to create a surface for " << path << ". \nSDL error: " << SDL_GetError() << '\n';
+        return false;
+    }
+    const bool saved = IMG_SavePNG(surface, path) == 0;
+    if (!saved) {
+        std::cerr << "Unable to save image " << path << ". \nSDL_image error: " << IMG_GetError() << '\n';
+    }
+    SDL_FreeSurface(surface);
+    return saved;
+}
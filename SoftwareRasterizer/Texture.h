@@ -4,11 +4,17 @@
 #include <vector>
 #include "Vector.h"
 #include "Utilities.h"
+#include <memory>
 #include <optional>
 
+// Copies share the pixels, which are freed with the last copy
 struct Texture {
-	Texture(int width, int height) : size(width * height), width(width), height(height), buffer((std::size_t)width * height) {}
-	Texture(Color* pixels, int width, int height) : size(width * height), width(width), height(height), buffer(pixels, pixels + (std::size_t)width * height) {}
+	Texture(int width, int height) : Texture(std::vector<Color>((std::size_t)width * height), width, height) {}
+	Texture(const Color* pixels, int width, int height) : Texture(std::vector<Color>(pixels, pixels + (std::size_t)width * height), width, height) {}
+	Texture(std::vector<Color> pixels, int width, int height) : Texture(std::make_shared<const std::vector<Color>>(std::move(pixels)), width, height) {}
+	// Adopts width x height tightly packed pixels without copying them, owner keeps them alive (the decoded image)
+	Texture(const Color* pixels, int width, int height, std::shared_ptr<const void> owner)
+		: size(width * height), width(width), height(height), buffer(pixels), owner(std::move(owner)) {}
 	Color operator()(float u, float v) const {
 		auto x = int(u * width);
 		auto y = int(v * height);
@@ -18,9 +24,17 @@ struct Texture {
 	}
 	const int size;
 	const int width, height;
-	const std::vector<Color> buffer;
+	const Color* const buffer;
+	const std::shared_ptr<const void> owner;
+private:
+	Texture(std::shared_ptr<const std::vector<Color>> pixels, int width, int height) : Texture(pixels->data(), width, height, pixels) {}
 };
 
+// The decoded image becomes the texture's memory, it is only copied if it has to be converted to ARGB
 std::optional<Texture> textureFromFile(const char* path);
+// Flat gray, drawn in place of textures that are still loading or failed to load
+std::shared_ptr<const Texture> placeholderTexture();
+// Writes width x height ARGB pixels, tightly packed, as a PNG file
+bool pngFromPixels(const Color* pixels, int width, int height, const char* path);
 
 #endif // !TEXTURE_H
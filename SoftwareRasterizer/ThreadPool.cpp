@@ -0,0 +1,102 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace {
+	// Set for the workers, a thread can belong to one pool and call into others
+	thread_local const ThreadPool* workerPool = nullptr;
+	thread_local unsigned workerIndex = 0;
+}
+
+ThreadPool::ThreadPool(unsigned nWorkers)
+	: activeWorkers(nWorkers)
+{
+	workers.reserve(nWorkers);
+	for (unsigned i = 0; i < nWorkers; i++) {
+		workers.emplace_back(&ThreadPool::WorkerLoop, this, i + 1);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::ParallelFor(std::size_t count, const std::function<void(std::size_t)>& job)
+{
+	if (count == 0) {
+		return;
+	}
+	if (activeWorkers == 0 || count == 1) {
+		for (std::size_t i = 0; i < count; i++) {
+			job(i);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->job = &job;
+		this->count = count;
+		next = 0;
+		loopWorkers = activeWorkers;
+		busyWorkers = activeWorkers;
+		generation++;
+	}
+	wake.notify_all();
+
+	RunJobs();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return busyWorkers == 0; });
+	this->job = nullptr;
+}
+
+void ThreadPool::SetActiveWorkers(unsigned nWorkers)
+{
+	activeWorkers = std::min(nWorkers, (unsigned)workers.size());
+}
+
+unsigned ThreadPool::ThreadIndex() const
+{
+	return workerPool == this ? workerIndex : 0;
+}
+
+void ThreadPool::WorkerLoop(unsigned index)
+{
+	workerPool = this;
+	workerIndex = index;
+	unsigned seenGeneration = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			// Workers left out of a loop keep an older generation, but stay out until one includes them
+			wake.wait(lock, [&] { return stop || (generation != seenGeneration && index <= loopWorkers); });
+			if (stop) {
+				return;
+			}
+			seenGeneration = generation;
+		}
+
+		RunJobs();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--busyWorkers == 0) {
+			done.notify_one();
+		}
+	}
+}
+
+void ThreadPool::RunJobs()
+{
+	for (std::size_t i = next.fetch_add(1); i < count; i = next.fetch_add(1)) {
+		(*job)(i);
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data parallel loops. The calling thread takes part in the work too.
+class ThreadPool {
+public:
+	// nWorkers extra threads are started, 0 runs everything on the calling thread
+	explicit ThreadPool(unsigned nWorkers = DefaultWorkerCount());
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Calls job(i) for every i in [0, count) and returns once all calls are done. Indices are handed out
+	// dynamically so uneven jobs balance out. Not reentrant: job must not call ParallelFor.
+	void ParallelFor(std::size_t count, const std::function<void(std::size_t)>& job);
+
+	// Number of threads that run jobs, including the calling thread
+	unsigned ThreadCount() const { return (unsigned)workers.size() + 1; }
+
+	// Only the first nWorkers workers take part in the following loops, the others keep sleeping. For callers that
+	// keep threads of their own busy alongside the pool. Must not be called during ParallelFor.
+	void SetActiveWorkers(unsigned nWorkers);
+
+	// Index of the current thread in [0, ThreadCount()): 1 + i for worker i of this pool, 0 for any other thread
+	// (the one calling ParallelFor). Lets jobs keep per-thread data without locking.
+	unsigned ThreadIndex() const;
+
+	static unsigned DefaultWorkerCount() {
+		const unsigned hardwareThreads = std::thread::hardware_concurrency();
+		return hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+	}
+private:
+	void WorkerLoop(unsigned index);
+	void RunJobs();
+private:
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	// Current loop, guarded by mutex except for next
+	const std::function<void(std::size_t)>* job = nullptr;
+	std::size_t count = 0;
+	std::atomic<std::size_t> next{ 0 };
+	unsigned generation = 0;	// Incremented for every loop so workers can tell a new loop from a spurious wakeup
+	unsigned loopWorkers = 0;	// Workers taking part in the current loop
+	unsigned busyWorkers = 0;
+	unsigned activeWorkers;		// Only used by the calling thread
+	bool stop = false;
+};
+
+#endif // !THREAD_POOL_H
@@ -5,41 +5,29 @@
 #include "Utilities.h"
 #include "Vector.h"
 
-struct Triangle {
-	Vec3 a, b, c;		// z component = 1/w
-	Vec2 aUV, bUV, cUV;
+// Per vertex values interpolated across triangles (texture coordinates, lighting, ...). Which slots are used
+// and what they mean is up to the pipeline, which only ever touches the first N of them for a compile time N.
+constexpr int maxVaryings = 8;
+
+struct Varyings {
+	float v[maxVaryings];
 };
 
+inline Varyings Lerp(const Varyings& a, const Varyings& b, float alpha) {
+	Varyings result;
+	for (int i = 0; i < maxVaryings; i++) {
+		result.v[i] = a.v[i] + (b.v[i] - a.v[i]) * alpha;
+	}
+	return result;
+}
+
 struct ClipSpaceTriangle {
 	Vec4 a, b, c;
-	Vec2 aUV, bUV, cUV;
+	Varyings aVaryings, bVaryings, cVaryings;
 };
 
-inline Triangle ClipSpaceToScreenSpace(const ClipSpaceTriangle& triangle, float screenHalfWidth, float screenHalfHeight) {
-	Triangle tri;
-
-	tri.a.x = (triangle.a.x / triangle.a.w) * screenHalfWidth + screenHalfWidth;
-	tri.a.y = -(triangle.a.y / triangle.a.w) * screenHalfHeight + screenHalfHeight;
-	tri.a.z = 1.0f / triangle.a.w;
-
-	tri.b.x = (triangle.b.x / triangle.b.w) * screenHalfWidth + screenHalfWidth;
-	tri.b.y = -(triangle.b.y / triangle.b.w) * screenHalfHeight + screenHalfHeight;
-	tri.b.z = 1.0f / triangle.b.w;
-
-	tri.c.x = (triangle.c.x / triangle.c.w) * screenHalfWidth + screenHalfWidth;
-   	tri.c.y = -(triangle.c.y / triangle.c.w) * screenHalfHeight + screenHalfHeight;
-	tri.c.z = 1.0f / triangle.c.w;
-
-	tri.aUV = triangle.aUV;
-	tri.bUV = triangle.bUV;
-	tri.cUV = triangle.cUV;
-
-	return tri;
-}
-
 struct Face {
 	std::uint32_t a, b, c;
-	Vec2 aUV, bUV, cUV;
 	Color color;
 };
 
@@ -62,4 +50,9 @@ inline bool IsFrontFacingViewSpace(const Vec3& a, const Vec3& b, const Vec3& c)
 	return Dot(fNormal, a) < 0;
 }
 
+// Same test for an orthographic (directional) view, where every view ray points along +z
+inline bool IsFrontFacingOrthographic(const Vec3& a, const Vec3& b, const Vec3& c) {
+	return Cross(b - a, c - b).z < 0;
+}
+
 #endif // TRIANGLE_H
@@ -0,0 +1,274 @@
+#ifndef TRIANGLE_SETUP_H
+#define TRIANGLE_SETUP_H
+
+#include <algorithm>
+#include <immintrin.h>
+#include <vector>
+#include "Triangle.h"
+
+constexpr int setupBatchSize = 4;
+
+// Screen space setup data for up to four triangles, one triangle per SIMD lane (structure of arrays).
+// Everything is relative to the center of the top left pixel of the triangle's bounding box (minX, minY)
+// so that the raster kernels can step incrementally from there.
+template<int nVaryings>
+struct alignas(16) TriangleSetupBatch {
+	// Bounding box in pixels, already clamped to the screen
+	int minX[setupBatchSize], minY[setupBatchSize];
+	int maxX[setupBatchSize], maxY[setupBatchSize];
+
+	// Edge functions divided by twice the triangle area. w[i] is the value at (minX, minY), wDx[i] and wDy[i]
+	// are added when moving one pixel right or down. w[1] and w[2] are the barycentric coordinates of b and c.
+	float w[3][setupBatchSize];
+	float wDx[3][setupBatchSize];
+	float wDy[3][setupBatchSize];
+
+	// Plane equations (value at (minX, minY), d/dx, d/dy) of the attributes that are linear in screen space:
+	// 1/w, which is also the value stored in the depth buffer, and each varying divided by w.
+	// Orthographic projections store 1 - z instead since w is constant (see SetupTriangles).
+	float inverseZ[3][setupBatchSize];
+	float varyings[nVaryings > 0 ? nVaryings : 1][3][setupBatchSize];
+};
+
+// Setup records for all triangles of a draw. Triangle i is stored in lane i % 4 of batches[i / 4].
+template<int nVaryings>
+struct TriangleSetupBuffer {
+	std::vector<TriangleSetupBatch<nVaryings>> batches;
+	std::size_t count = 0;
+
+	void Clear() { batches.clear(); count = 0; }
+
+	// Appends triangle lane of batch
+	void Push(const TriangleSetupBatch<nVaryings>& batch, int lane) {
+		const int outLane = count % setupBatchSize;
+		if (outLane == 0) {
+			batches.emplace_back();
+		}
+		TriangleSetupBatch<nVaryings>& dst = batches.back();
+		dst.minX[outLane] = batch.minX[lane];
+		dst.minY[outLane] = batch.minY[lane];
+		dst.maxX[outLane] = batch.maxX[lane];
+		dst.maxY[outLane] = batch.maxY[lane];
+		for (int i = 0; i < 3; i++) {
+			dst.w[i][outLane] = batch.w[i][lane];
+			dst.wDx[i][outLane] = batch.wDx[i][lane];
+			dst.wDy[i][outLane] = batch.wDy[i][lane];
+			dst.inverseZ[i][outLane] = batch.inverseZ[i][lane];
+			for (int j = 0; j < nVaryings; j++) {
+				dst.varyings[j][i][outLane] = batch.varyings[j][i][lane];
+			}
+		}
+		count++;
+	}
+
+	// Appends the triangles of other in their order. Whole batches are copied if this buffer ends on a batch boundary.
+	void Append(const TriangleSetupBuffer& other) {
+		if (count % setupBatchSize == 0) {
+			batches.insert(batches.end(), other.batches.begin(), other.batches.end());
+			count += other.count;
+			return;
+		}
+		for (std::size_t i = 0; i < other.count; i++) {
+			Push(other.batches[i / setupBatchSize], i % setupBatchSize);
+		}
+	}
+};
+
+// Inclusive pixel bounds that rasterization is restricted to
+struct ScissorRect {
+	int minX, minY, maxX, maxY;
+};
+
+// Screen space position, normalized depth and 1/w of the same vertex (a, b or c) of four triangles
+struct ScreenVertex4 {
+	__m128 x, y, z, inverseW;
+};
+
+// Loads one vertex of four triangles, transposes it to SoA and does the perspective divide and viewport transform.
+// One division per four vertices replaces the three scalar divisions per vertex.
+inline ScreenVertex4 ToScreenSpace(const Vec4& v0, const Vec4& v1, const Vec4& v2, const Vec4& v3, __m128 halfW, __m128 halfH)
+{
+	__m128 x = _mm_loadu_ps(&v0.x);
+	__m128 y = _mm_loadu_ps(&v1.x);
+	__m128 z = _mm_loadu_ps(&v2.x);
+	__m128 w = _mm_loadu_ps(&v3.x);
+	_MM_TRANSPOSE4_PS(x, y, z, w);
+
+	ScreenVertex4 out;
+	out.inverseW = _mm_div_ps(_mm_set1_ps(1.0f), w);
+	out.x = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(x, out.inverseW), halfW), halfW);
+	out.y = _mm_sub_ps(halfH, _mm_mul_ps(_mm_mul_ps(y, out.inverseW), halfH));
+	out.z = _mm_mul_ps(z, out.inverseW);
+	return out;
+}
+
+// Plane equation of an attribute given its values at the three vertices and the normalized edge functions
+// (w1 and w2 are the barycentric coordinates of b and c).
+inline void AttributePlane(__m128 a, __m128 b, __m128 c,
+	__m128 w1, __m128 w2, __m128 w1Dx, __m128 w2Dx, __m128 w1Dy, __m128 w2Dy, __m128 plane[3])
+{
+	const __m128 ab = _mm_sub_ps(b, a);
+	const __m128 ac = _mm_sub_ps(c, a);
+	plane[0] = _mm_add_ps(a, _mm_add_ps(_mm_mul_ps(w1, ab), _mm_mul_ps(w2, ac)));
+	plane[1] = _mm_add_ps(_mm_mul_ps(w1Dx, ab), _mm_mul_ps(w2Dx, ac));
+	plane[2] = _mm_add_ps(_mm_mul_ps(w1Dy, ab), _mm_mul_ps(w2Dy, ac));
+}
+
+// Varyings [first, first + 4) of four triangles' vertices, transposed so that out[i] holds varying first + i of all four
+inline void LoadVaryings4(const Varyings& v0, const Varyings& v1, const Varyings& v2, const Varyings& v3, int first, __m128 out[4])
+{
+	static_assert(maxVaryings % 4 == 0, "Varyings are loaded four at a time");
+	out[0] = _mm_loadu_ps(v0.v + first);
+	out[1] = _mm_loadu_ps(v1.v + first);
+	out[2] = _mm_loadu_ps(v2.v + first);
+	out[3] = _mm_loadu_ps(v3.v + first);
+	_MM_TRANSPOSE4_PS(out[0], out[1], out[2], out[3]);
+}
+
+// Perspective divide, viewport transform, back face / zero area / off screen culling and edge and attribute
+// setup, four triangles at a time. Only the first nVaryings varyings of each vertex are set up.
+// Surviving triangles are appended to out. With a scissor rect, triangles outside it are culled. Bounding boxes are
+// still only clamped to the screen, so that a triangle gets the same setup as in a full frame, and the raster
+// kernels restrict their loops to the rect.
+// With an orthographic projection 1/w is the same everywhere and can't be depth tested, so the depth plane is
+// 1 - z (z in [0, 1] after projection) instead, which keeps greater meaning closer.
+template<int nVaryings, bool orthographic = false>
+void SetupTriangles(const std::vector<ClipSpaceTriangle>& triangles, int width, int height, TriangleSetupBuffer<nVaryings>& out,
+	const ScissorRect* scissor = nullptr)
+{
+	static_assert(nVaryings <= maxVaryings, "Too many varyings");
+
+	const __m128 halfW = _mm_set1_ps(width / 2.0f);
+	const __m128 halfH = _mm_set1_ps(height / 2.0f);
+	const __m128i screenMaxX = _mm_set1_epi32(width - 1);
+	const __m128i screenMaxY = _mm_set1_epi32(height - 1);
+	const __m128i minXi = _mm_set1_epi32(scissor ? scissor->minX : 0);
+	const __m128i minYi = _mm_set1_epi32(scissor ? scissor->minY : 0);
+	const __m128i maxXi = scissor ? _mm_set1_epi32(scissor->maxX) : screenMaxX;
+	const __m128i maxYi = scissor ? _mm_set1_epi32(scissor->maxY) : screenMaxY;
+	const __m128 pixelCenter = _mm_set1_ps(0.5f);
+
+	const std::size_t nTriangles = triangles.size();
+	out.batches.reserve(out.batches.size() + nTriangles / setupBatchSize + 1);
+
+	for (std::size_t first = 0; first < nTriangles; first += setupBatchSize) {
+		// Pad the last batch by repeating its last triangle, the extra lanes are discarded below
+		const ClipSpaceTriangle* t[setupBatchSize];
+		for (int lane = 0; lane < setupBatchSize; lane++) {
+			t[lane] = &triangles[std::min(first + lane, nTriangles - 1)];
+		}
+		const int nValid = (int)std::min<std::size_t>(setupBatchSize, nTriangles - first);
+
+		const ScreenVertex4 a = ToScreenSpace(t[0]->a, t[1]->a, t[2]->a, t[3]->a, halfW, halfH);
+		const ScreenVertex4 b = ToScreenSpace(t[0]->b, t[1]->b, t[2]->b, t[3]->b, halfW, halfH);
+		const ScreenVertex4 c = ToScreenSpace(t[0]->c, t[1]->c, t[2]->c, t[3]->c, halfW, halfH);
+
+		// Twice the signed area. Winding order is cw in object space but since screen space flips y (therefore changing
+		// handedness), front facing triangles are ccw and positive here. Clockwise and zero area triangles can't cover any pixel.
+		const __m128 area = _mm_sub_ps(
+			_mm_mul_ps(_mm_sub_ps(b.x, a.x), _mm_sub_ps(c.y, a.y)),
+			_mm_mul_ps(_mm_sub_ps(b.y, a.y), _mm_sub_ps(c.x, a.x)));
+		__m128 accept = _mm_cmpgt_ps(area, _mm_setzero_ps());
+
+		// Bounding box (+0.5f for pixel centers is added below)
+		const __m128i minX = _mm_cvttps_epi32(_mm_min_ps(a.x, _mm_min_ps(b.x, c.x)));
+		const __m128i maxX = _mm_cvttps_epi32(_mm_max_ps(a.x, _mm_max_ps(b.x, c.x)));
+		const __m128i minY = _mm_cvttps_epi32(_mm_min_ps(a.y, _mm_min_ps(b.y, c.y)));
+		const __m128i maxY = _mm_cvttps_epi32(_mm_max_ps(a.y, _mm_max_ps(b.y, c.y)));
+
+		// Cull triangles whose bounding box misses the screen (possible inside the guard band) or the scissor rect
+		const __m128i offscreen = _mm_or_si128(
+			_mm_or_si128(_mm_cmplt_epi32(maxX, minXi), _mm_cmpgt_epi32(minX, maxXi)),
+			_mm_or_si128(_mm_cmplt_epi32(maxY, minYi), _mm_cmpgt_epi32(minY, maxYi)));
+		accept = _mm_andnot_ps(_mm_castsi128_ps(offscreen), accept);
+
+		int acceptMask = _mm_movemask_ps(accept) & ((1 << nValid) - 1);
+		if (acceptMask == 0) {
+			continue;
+		}
+
+		// Clamp to screen bounds. This allows clipping only to the near plane (and guard band) when clipping triangles against frustum planes.
+		const __m128i clampedMinX = _mm_max_epi32(minX, _mm_setzero_si128());
+		const __m128i clampedMinY = _mm_max_epi32(minY, _mm_setzero_si128());
+		const __m128i clampedMaxX = _mm_min_epi32(maxX, screenMaxX);
+		const __m128i clampedMaxY = _mm_min_epi32(maxY, screenMaxY);
+
+		const __m128 originX = _mm_add_ps(_mm_cvtepi32_ps(clampedMinX), pixelCenter);
+		const __m128 originY = _mm_add_ps(_mm_cvtepi32_ps(clampedMinY), pixelCenter);
+
+		// Edge functions at the bounding box origin (orient2d), normalized so w1 and w2 are barycentric coordinates.
+		// Source: https://fgiesen.wordpress.com/2013/02/08/triangle-rasterization-in-practice/
+		const __m128 inverseArea = _mm_div_ps(_mm_set1_ps(1.0f), area);
+		auto edge = [&](const ScreenVertex4& from, const ScreenVertex4& to, __m128& w, __m128& wDx, __m128& wDy) {
+			const __m128 dx = _mm_sub_ps(to.x, from.x);
+			const __m128 dy = _mm_sub_ps(to.y, from.y);
+			w = _mm_sub_ps(_mm_mul_ps(dx, _mm_sub_ps(originY, from.y)), _mm_mul_ps(dy, _mm_sub_ps(originX, from.x)));
+			w = _mm_mul_ps(w, inverseArea);
+			wDx = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), dy), inverseArea);
+			wDy = _mm_mul_ps(dx, inverseArea);
+		};
+		__m128 w[3], wDx[3], wDy[3];
+		edge(b, c, w[0], wDx[0], wDy[0]);
+		edge(c, a, w[1], wDx[1], wDy[1]);
+		edge(a, b, w[2], wDx[2], wDy[2]);
+
+		TriangleSetupBatch<nVaryings> setup;
+
+		__m128 plane[3];
+		if constexpr (orthographic) {
+			const __m128 one = _mm_set1_ps(1.0f);
+			AttributePlane(_mm_sub_ps(one, a.z), _mm_sub_ps(one, b.z), _mm_sub_ps(one, c.z), w[1], w[2], wDx[1], wDx[2], wDy[1], wDy[2], plane);
+		}
+		else {
+			AttributePlane(a.inverseW, b.inverseW, c.inverseW, w[1], w[2], wDx[1], wDx[2], wDy[1], wDy[2], plane);
+		}
+		for (int i = 0; i < 3; i++) {
+			_mm_store_ps(setup.inverseZ[i], plane[i]);
+		}
+
+		// Divide (AKA multiply by inverse) the vertex attributes by view space Z for perspective correct interpolation.
+		// Varyings are loaded four at a time and transposed so each register holds one varying of the four triangles.
+		for (int first = 0; first < nVaryings; first += 4) {
+			__m128 aVaryings[4], bVaryings[4], cVaryings[4];
+			LoadVaryings4(t[0]->aVaryings, t[1]->aVaryings, t[2]->aVaryings, t[3]->aVaryings, first, aVaryings);
+			LoadVaryings4(t[0]->bVaryings, t[1]->bVaryings, t[2]->bVaryings, t[3]->bVaryings, first, bVaryings);
+			LoadVaryings4(t[0]->cVaryings, t[1]->cVaryings, t[2]->cVaryings, t[3]->cVaryings, first, cVaryings);
+			for (int i = first; i < nVaryings && i < first + 4; i++) {
+				AttributePlane(
+					_mm_mul_ps(aVaryings[i - first], a.inverseW),
+					_mm_mul_ps(bVaryings[i - first], b.inverseW),
+					_mm_mul_ps(cVaryings[i - first], c.inverseW),
+					w[1], w[2], wDx[1], wDx[2], wDy[1], wDy[2], plane);
+				for (int j = 0; j < 3; j++) {
+					_mm_store_ps(setup.varyings[i][j], plane[j]);
+				}
+			}
+		}
+
+		_mm_store_si128((__m128i*)setup.minX, clampedMinX);
+		_mm_store_si128((__m128i*)setup.minY, clampedMinY);
+		_mm_store_si128((__m128i*)setup.maxX, clampedMaxX);
+		_mm_store_si128((__m128i*)setup.maxY, clampedMaxY);
+		for (int i = 0; i < 3; i++) {
+			_mm_store_ps(setup.w[i], w[i]);
+			_mm_store_ps(setup.wDx[i], wDx[i]);
+			_mm_store_ps(setup.wDy[i], wDy[i]);
+		}
+
+		// Common case: all four triangles survived and the output is batch aligned, append the batch as is
+		if (acceptMask == 0xF && out.count % setupBatchSize == 0) {
+			out.batches.push_back(setup);
+			out.count += setupBatchSize;
+			continue;
+		}
+
+		// Otherwise compact the surviving lanes into the output
+		while (acceptMask) {
+			const int lane = acceptMask & 1 ? 0 : acceptMask & 2 ? 1 : acceptMask & 4 ? 2 : 3;
+			acceptMask &= acceptMask - 1;
+			out.Push(setup, lane);
+		}
+	}
+}
+
+#endif // !TRIANGLE_SETUP_H
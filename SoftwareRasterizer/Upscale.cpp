@@ -0,0 +1,115 @@
+#include "Upscale.h"
+
+#include "Profiler.h"
+
+#include <algorithm>
+#include <immintrin.h>
+
+namespace {
+	constexpr int weightBits = 7;
+	constexpr int weightOne = 1 << weightBits;
+
+	// Source coordinates of the output pixel centers (pixel centers line up at both ends), clamped to the source
+	void SourceTaps(int srcSize, int dstSize, std::vector<std::int32_t>& first, std::vector<std::int32_t>& second, std::vector<std::int16_t>& weight)
+	{
+		first.resize(dstSize);
+		second.resize(dstSize);
+		weight.resize(dstSize);
+		const float scale = (float)srcSize / (float)dstSize;
+		for (int i = 0; i < dstSize; i++) {
+			const float position = std::max(0.0f, (i + 0.5f) * scale - 0.5f);
+			const int index = std::min((int)position, srcSize - 1);
+			first[i] = index;
+			second[i] = std::min(index + 1, srcSize - 1);
+			weight[i] = (std::int16_t)((position - index) * weightOne + 0.5f);
+		}
+	}
+
+	// a + (b - a) * weight for 16 bit channels
+	inline __m128i Lerp16(__m128i a, __m128i b, __m128i weight)
+	{
+		return _mm_add_epi16(a, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(b, a), weight), weightBits));
+	}
+
+	inline Color Lerp(Color a, Color b, int weight)
+	{
+		Color result = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			const int ca = (a >> shift) & 0xFF;
+			const int cb = (b >> shift) & 0xFF;
+			result |= (Color)(ca + (((cb - ca) * weight) >> weightBits)) << shift;
+		}
+		return result;
+	}
+}
+
+void BilinearUpscaler::Resize(int newSrcWidth, int newSrcHeight, int newDstWidth, int newDstHeight)
+{
+	if (newSrcWidth != srcWidth || newDstWidth != dstWidth) {
+		SourceTaps(newSrcWidth, newDstWidth, columnLeft, columnRight, columnWeight);
+	}
+	if (newSrcHeight != srcHeight || newDstHeight != dstHeight) {
+		SourceTaps(newSrcHeight, newDstHeight, rowTop, rowBottom, rowWeight);
+	}
+	srcWidth = newSrcWidth;
+	srcHeight = newSrcHeight;
+	dstWidth = newDstWidth;
+	dstHeight = newDstHeight;
+}
+
+void BilinearUpscaler::Upscale(const Color* src, int newSrcWidth, int newSrcHeight, int srcPitch, Color* dst, int newDstWidth, int newDstHeight,
+	int dstPitch, ThreadPool& threadPool)
+{
+	Resize(newSrcWidth, newSrcHeight, newDstWidth, newDstHeight);
+
+	constexpr int bandHeight = 16;
+	const int nBands = (dstHeight + bandHeight - 1) / bandHeight;
+	threadPool.ParallelFor(nBands, [&](std::size_t band) {
+		PROFILE_SCOPE("Upscale band");
+		const int minY = (int)band * bandHeight;
+		const int maxY = std::min(minY + bandHeight, dstHeight);
+		for (int y = minY; y < maxY; y++) {
+			UpscaleRow(src, srcPitch, y, (Color*)((char*)dst + (std::size_t)y * dstPitch));
+		}
+	});
+}
+
+// Four output pixels at a time: the four source taps of each are gathered into one register per tap, widened
+// to 16 bits per channel and blended horizontally, then vertically.
+void BilinearUpscaler::UpscaleRow(const Color* src, int srcPitch, int dstY, Color* dstRow) const
+{
+	const Color* top = (const Color*)((const char*)src + (std::size_t)rowTop[dstY] * srcPitch);
+	const Color* bottom = (const Color*)((const char*)src + (std::size_t)rowBottom[dstY] * srcPitch);
+	const __m128i verticalWeight = _mm_set1_epi16(rowWeight[dstY]);
+	const __m128i zero = _mm_setzero_si128();
+
+	int x = 0;
+	for (; x + 4 <= dstWidth; x += 4) {
+		const std::int32_t* left = columnLeft.data() + x;
+		const std::int32_t* right = columnRight.data() + x;
+		const __m128i topLeft = _mm_set_epi32(top[left[3]], top[left[2]], top[left[1]], top[left[0]]);
+		const __m128i topRight = _mm_set_epi32(top[right[3]], top[right[2]], top[right[1]], top[right[0]]);
+		const __m128i bottomLeft = _mm_set_epi32(bottom[left[3]], bottom[left[2]], bottom[left[1]], bottom[left[0]]);
+		const __m128i bottomRight = _mm_set_epi32(bottom[right[3]], bottom[right[2]], bottom[right[1]], bottom[right[0]]);
+
+		// Each pixel's weight repeated for its four channels, pixels 0-1 and 2-3
+		const __m128i weights = _mm_loadl_epi64((const __m128i*)(columnWeight.data() + x));
+		const __m128i weightPairs = _mm_unpacklo_epi16(weights, weights);
+		const __m128i weightLo = _mm_unpacklo_epi32(weightPairs, weightPairs);
+		const __m128i weightHi = _mm_unpackhi_epi32(weightPairs, weightPairs);
+
+		const __m128i topLo = Lerp16(_mm_unpacklo_epi8(topLeft, zero), _mm_unpacklo_epi8(topRight, zero), weightLo);
+		const __m128i topHi = Lerp16(_mm_unpackhi_epi8(topLeft, zero), _mm_unpackhi_epi8(topRight, zero), weightHi);
+		const __m128i bottomLo = Lerp16(_mm_unpacklo_epi8(bottomLeft, zero), _mm_unpacklo_epi8(bottomRight, zero), weightLo);
+		const __m128i bottomHi = Lerp16(_mm_unpackhi_epi8(bottomLeft, zero), _mm_unpackhi_epi8(bottomRight, zero), weightHi);
+
+		const __m128i result = _mm_packus_epi16(Lerp16(topLo, bottomLo, verticalWeight), Lerp16(topHi, bottomHi, verticalWeight));
+		_mm_storeu_si128((__m128i*)(dstRow + x), result);
+	}
+
+	for (; x < dstWidth; x++) {
+		const Color upper = Lerp(top[columnLeft[x]], top[columnRight[x]], columnWeight[x]);
+		const Color lower = Lerp(bottom[columnLeft[x]], bottom[columnRight[x]], columnWeight[x]);
+		dstRow[x] = Lerp(upper, lower, rowWeight[dstY]);
+	}
+}
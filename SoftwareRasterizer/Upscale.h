@@ -0,0 +1,32 @@
+#ifndef UPSCALE_H
+#define UPSCALE_H
+
+#include <cstdint>
+#include <vector>
+#include "ThreadPool.h"
+#include "Utilities.h"
+
+// Bilinear filter from a smaller render target to the output size. The source position and weights of every
+// output column only depend on the two widths, so they are computed once per size change and reused for every
+// row. Weights are 7 bit fixed point so that the 16 bit SIMD lerps can't overflow.
+class BilinearUpscaler {
+public:
+	// Pitches are in bytes
+	void Upscale(const Color* src, int srcWidth, int srcHeight, int srcPitch, Color* dst, int dstWidth, int dstHeight, int dstPitch,
+		ThreadPool& threadPool);
+private:
+	void Resize(int srcWidth, int srcHeight, int dstWidth, int dstHeight);
+	void UpscaleRow(const Color* src, int srcPitch, int dstY, Color* dstRow) const;
+private:
+	int srcWidth = 0, srcHeight = 0;
+	int dstWidth = 0, dstHeight = 0;
+
+	// Per output column: left and right source column and the weight of the right one
+	std::vector<std::int32_t> columnLeft, columnRight;
+	std::vector<std::int16_t> columnWeight;
+	// Per output row: top and bottom source row and the weight of the bottom one
+	std::vector<std::int32_t> rowTop, rowBottom;
+	std::vector<std::int16_t> rowWeight;
+};
+
+#endif // !UPSCALE_H
@@ -108,6 +108,14 @@ inline std::ostream& operator<<(std::ostream& os, const Vec3& v) {
 	return os << v.x << ' ' << v.y << ' ' << v.z;
 }
 
+inline bool operator==(const Vec3& lhs, const Vec3& rhs) {
+	return lhs.x == rhs.x && lhs.y == rhs.y && lhs.z == rhs.z;
+}
+
+inline bool operator!=(const Vec3& lhs, const Vec3& rhs) {
+	return !(lhs == rhs);
+}
+
 inline Vec3 operator+(const Vec3& lhs, const Vec3& rhs) {
 	return Vec3{
 		lhs.x + rhs.x,
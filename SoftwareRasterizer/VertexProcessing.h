@@ -0,0 +1,130 @@
+#ifndef VERTEX_PROCESSING_H
+#define VERTEX_PROCESSING_H
+
+#include <cstdint>
+#include <immintrin.h>
+#include <vector>
+#include "Matrix.h"
+#include "Model.h"
+#include "Shader.h"
+#include "Triangle.h"
+#include "Vector.h"
+
+constexpr int vertexBatchSize = 4;
+
+// Matrix elements broadcast to all four lanes, so that four vertices can be transformed with one
+// multiply per element instead of one per element and vertex
+struct SimdMat4 {
+	__m128 m[4][4];
+
+	explicit SimdMat4(const Mat4& mat) {
+		for (int r = 0; r < 4; r++) {
+			for (int c = 0; c < 4; c++) {
+				m[r][c] = _mm_set1_ps(mat[r][c]);
+			}
+		}
+	}
+
+	// Row r of the matrix times (x, y, z, w)
+	__m128 Row(int r, __m128 x, __m128 y, __m128 z, __m128 w) const {
+		return _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], x), _mm_mul_ps(m[r][1], y)), _mm_mul_ps(m[r][2], z)), _mm_mul_ps(m[r][3], w));
+	}
+	// Row r of the matrix times (x, y, z, 1)
+	__m128 Row(int r, __m128 x, __m128 y, __m128 z) const {
+		return _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], x), _mm_mul_ps(m[r][1], y)), _mm_mul_ps(m[r][2], z)), m[r][3]);
+	}
+	// Row r of the upper left 3x3 part times (x, y, z)
+	__m128 Row3(int r, __m128 x, __m128 y, __m128 z) const {
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r][0], x), _mm_mul_ps(m[r][1], y)), _mm_mul_ps(m[r][2], z));
+	}
+};
+
+struct VertexTransforms {
+	SimdMat4 modelView;
+	SimdMat4 projection;
+	SimdMat4 normal;	// See NormalMatrix
+};
+
+// Transforms the vertices indices[0..3] of the model to view and clip space and runs the vertex shader on them,
+// four at a time in structure of arrays form. Indices may repeat (to pad a partial batch).
+template<typename VertexShader>
+void ProcessVertices4(const Model& model, const std::uint32_t indices[vertexBatchSize], const VertexTransforms& transforms,
+	const ShaderUniforms& uniforms, std::vector<Vec3>& viewSpaceVertices, std::vector<Vec4>& clipSpaceVertices, std::vector<Varyings>& vertexVaryings)
+{
+	const Vec3& p0 = model.vertices[indices[0]];
+	const Vec3& p1 = model.vertices[indices[1]];
+	const Vec3& p2 = model.vertices[indices[2]];
+	const Vec3& p3 = model.vertices[indices[3]];
+	const __m128 x = _mm_set_ps(p3.x, p2.x, p1.x, p0.x);
+	const __m128 y = _mm_set_ps(p3.y, p2.y, p1.y, p0.y);
+	const __m128 z = _mm_set_ps(p3.z, p2.z, p1.z, p0.z);
+
+	const __m128 viewX = transforms.modelView.Row(0, x, y, z);
+	const __m128 viewY = transforms.modelView.Row(1, x, y, z);
+	const __m128 viewZ = transforms.modelView.Row(2, x, y, z);
+	const __m128 one = _mm_set1_ps(1.0f);
+	__m128 clip[4];
+	for (int r = 0; r < 4; r++) {
+		clip[r] = transforms.projection.Row(r, viewX, viewY, viewZ, one);
+	}
+
+	alignas(16) float viewSpace[3][vertexBatchSize];
+	_mm_store_ps(viewSpace[0], viewX);
+	_mm_store_ps(viewSpace[1], viewY);
+	_mm_store_ps(viewSpace[2], viewZ);
+	_MM_TRANSPOSE4_PS(clip[0], clip[1], clip[2], clip[3]);
+	for (int i = 0; i < vertexBatchSize; i++) {
+		viewSpaceVertices[indices[i]] = { viewSpace[0][i], viewSpace[1][i], viewSpace[2][i] };
+		_mm_storeu_ps(&clipSpaceVertices[indices[i]].x, clip[i]);
+	}
+
+	// Depth only shaders have nothing to shade
+	if constexpr (!VertexShader::isPerFace && VertexShader::nVaryings > 0) {
+		constexpr int nVaryings = VertexShader::nVaryings;
+
+		const Vec2& uv0 = model.textureCoords[indices[0]];
+		const Vec2& uv1 = model.textureCoords[indices[1]];
+		const Vec2& uv2 = model.textureCoords[indices[2]];
+		const Vec2& uv3 = model.textureCoords[indices[3]];
+		const __m128 uv[2] = {
+			_mm_set_ps(uv3.u, uv2.u, uv1.u, uv0.u),
+			_mm_set_ps(uv3.v, uv2.v, uv1.v, uv0.v)
+		};
+
+		__m128 normal[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+		if constexpr (VertexShader::usesNormal) {
+			const Vec3& n0 = model.normals[indices[0]];
+			const Vec3& n1 = model.normals[indices[1]];
+			const Vec3& n2 = model.normals[indices[2]];
+			const Vec3& n3 = model.normals[indices[3]];
+			const __m128 nx = _mm_set_ps(n3.x, n2.x, n1.x, n0.x);
+			const __m128 ny = _mm_set_ps(n3.y, n2.y, n1.y, n0.y);
+			const __m128 nz = _mm_set_ps(n3.z, n2.z, n1.z, n0.z);
+			normal[0] = transforms.normal.Row3(0, nx, ny, nz);
+			normal[1] = transforms.normal.Row3(1, nx, ny, nz);
+			normal[2] = transforms.normal.Row3(2, nx, ny, nz);
+			const __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(normal[0], normal[0]), _mm_mul_ps(normal[1], normal[1])), _mm_mul_ps(normal[2], normal[2])));
+			for (__m128& n : normal) {
+				n = _mm_div_ps(n, length);
+			}
+		}
+
+		// Shade, then transpose back to one Varyings per vertex four varyings at a time
+		constexpr int nPadded = (nVaryings + 3) / 4 * 4;
+		__m128 varyings[nPadded];
+		for (int i = nVaryings; i < nPadded; i++) {
+			varyings[i] = _mm_setzero_ps();
+		}
+		const __m128 position[3] = { x, y, z };
+		VertexShader::Shade(position, uv, normal, uniforms, varyings);
+		for (int first = 0; first < nVaryings; first += 4) {
+			_MM_TRANSPOSE4_PS(varyings[first], varyings[first + 1], varyings[first + 2], varyings[first + 3]);
+			for (int i = 0; i < vertexBatchSize; i++) {
+				_mm_storeu_ps(vertexVaryings[indices[i]].v + first, varyings[first + i]);
+			}
+		}
+	}
+}
+
+#endif // !VERTEX_PROCESSING_H
@@ -0,0 +1,80 @@
+#ifndef VISIBILITY_BUFFER_H
+#define VISIBILITY_BUFFER_H
+
+#include <cstdint>
+#include <immintrin.h>
+#include <variant>
+#include "Shader.h"
+#include "TriangleSetup.h"
+#include "Utilities.h"
+
+// Visibility buffer: the raster pass stores, per pixel, which triangle of which draw is visible. Shading happens
+// afterwards in screen space, so every visible pixel is shaded exactly once regardless of depth complexity.
+// Source: http://jcgt.org/published/0002/02/04/ (The Visibility Buffer: A Cache-Friendly Approach to Deferred Shading)
+
+// Per pixel id: draw index in the high bits, index of the triangle in the draw's setup buffer in the low bits
+using VisibilityId = std::uint32_t;
+constexpr int visibilityTriangleBits = 24;
+constexpr VisibilityId visibilityTriangleMask = (1u << visibilityTriangleBits) - 1;
+constexpr VisibilityId emptyVisibilityId = 0xFFFFFFFF;
+// The all ones draw index is taken by emptyVisibilityId
+constexpr std::uint32_t maxVisibilityDraws = (1u << (32 - visibilityTriangleBits)) - 1;
+constexpr std::uint32_t maxVisibilityTriangles = visibilityTriangleMask + 1;
+
+inline VisibilityId PackVisibilityId(std::uint32_t draw, std::uint32_t triangle) {
+	return (draw << visibilityTriangleBits) | triangle;
+}
+
+// Setup buffers of every varying count a vertex shader can have
+using AnyTriangleSetupBuffer = std::variant<TriangleSetupBuffer<2>, TriangleSetupBuffer<3>, TriangleSetupBuffer<6>>;
+
+struct VisibilityDraw;
+
+// Shades the lanes in laneMask of four horizontally adjacent pixels starting at (x, y), all of which belong to
+// the same draw, and stores the results in colors
+using VisibilityShadeFunction = void(*)(const VisibilityDraw& draw, const VisibilityId ids[4], int x, int y, int laneMask, __m128i& colors);
+
+// Everything the shading pass needs to know about a draw
+struct VisibilityDraw {
+	ShaderUniforms uniforms;
+	AnyTriangleSetupBuffer setup;	// Kept from the raster pass, the attribute planes are evaluated again when shading
+	VisibilityShadeFunction shade;
+};
+
+// Reconstructs 1/w and the varyings of each pixel from its triangle's plane equations, then runs the fragment
+// shader on all four pixels at once
+template<typename FragmentShader, int nVaryings>
+void ShadeVisibility4(const VisibilityDraw& draw, const VisibilityId ids[4], int x, int y, int laneMask, __m128i& colors)
+{
+	const TriangleSetupBuffer<nVaryings>& setup = std::get<TriangleSetupBuffer<nVaryings>>(draw.setup);
+
+	alignas(16) float inverseZ[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	alignas(16) float varyings[nVaryings][4] = {};
+	for (int lane = 0; lane < 4; lane++) {
+		if (!(laneMask & (1 << lane))) {
+			continue;
+		}
+		const std::uint32_t triangle = ids[lane] & visibilityTriangleMask;
+		const TriangleSetupBatch<nVaryings>& t = setup.batches[triangle / setupBatchSize];
+		const int i = triangle % setupBatchSize;
+		const float dx = (float)(x + lane - t.minX[i]);
+		const float dy = (float)(y - t.minY[i]);
+		inverseZ[lane] = t.inverseZ[0][i] + dx * t.inverseZ[1][i] + dy * t.inverseZ[2][i];
+		for (int v = 0; v < nVaryings; v++) {
+			varyings[v][lane] = t.varyings[v][0][i] + dx * t.varyings[v][1][i] + dy * t.varyings[v][2][i];
+		}
+	}
+
+	const __m128 z = _mm_rcp_ps(_mm_load_ps(inverseZ));
+	__m128 interpolated[nVaryings];
+	for (int v = 0; v < nVaryings; v++) {
+		interpolated[v] = _mm_mul_ps(_mm_load_ps(varyings[v]), z);
+	}
+	const __m128i shaded = FragmentShader::Shade(interpolated, laneMask, draw.uniforms);
+
+	const __m128i laneBits = _mm_set_epi32(8, 4, 2, 1);
+	const __m128i writeMask = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(laneMask), laneBits), laneBits);
+	colors = _mm_blendv_epi8(colors, shaded, writeMask);
+}
+
+#endif // !VISIBILITY_BUFFER_H
@@ -44,6 +44,19 @@ void Window::CopyAndPresent(const Color* buffer, int pitch) {
 	SDL_RenderPresent(renderer);
 }
 
+void Window::Present(const std::function<void(Color* pixels, int pitch)>& fill) {
+	void* pixels;
+	int pitch;
+	if (SDL_LockTexture(colorBufferTexture, NULL, &pixels, &pitch) != 0) {
+		std::cerr << "Error locking texture: " << SDL_GetError() << '\n';
+		return;
+	}
+	fill((Color*)pixels, pitch);
+	SDL_UnlockTexture(colorBufferTexture);
+	SDL_RenderCopy(renderer, colorBufferTexture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+}
+
 // Using destructor also requires specifying move semantics... too much hassle
 void Window::Destroy()
 {
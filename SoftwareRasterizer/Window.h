@@ -2,6 +2,7 @@
 #define WINDOW_H
 
 #include <SDL.h>
+#include <functional>
 #include <optional>
 
 #include "Utilities.h"
@@ -11,6 +12,8 @@ public:
 	static std::optional<Window> CreateFullscreen();
 	void Destroy();
 	void CopyAndPresent(const Color* buffer, int pitch);
+	// Lets fill write the frame straight into the window's texture (pitch in bytes), saving a copy of the frame
+	void Present(const std::function<void(Color* pixels, int pitch)>& fill);
 	int w() const { return width; }
 	int h() const { return height; }
 private: